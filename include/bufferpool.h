@@ -0,0 +1,64 @@
+/**
+ * @file bufferpool.h
+ * @brief Receive buffers shared by the sessions of a server
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * @brief Free buffers by size, powers of two from min_size to max_size.
+ *
+ * A session holds a buffer only while it has bytes to read, so idle
+ * connections cost no buffer and busy ones reuse the buffers that the
+ * idle ones gave back.
+ */
+class BufferPool
+{
+    public:
+        enum { min_size = 1024, max_size = 65536 };
+
+        /**
+         * @brief A buffer of the pool, empty until acquired.
+         */
+        class Buffer
+        {
+            public:
+                char* data() const { return data_.get(); }
+                size_t size() const { return size_; }
+                bool empty() const { return size_ == 0; }
+
+            private:
+                friend class BufferPool;
+
+                std::unique_ptr<char[]> data_;
+                size_t size_ = 0;
+        };
+
+        /// Free buffers above max_idle bytes are freed.
+        explicit BufferPool(size_t max_idle = 16 << 20);
+
+        BufferPool(const BufferPool&) = delete;
+        BufferPool& operator=(const BufferPool&) = delete;
+
+        /// At least size bytes, clamped to max_size.
+        Buffer acquire(size_t size);
+        /// Takes the buffer back, nothing for an empty one.
+        void release(Buffer& buffer);
+
+        /// Bytes of the free buffers.
+        size_t idle() const;
+
+    private:
+        const size_t max_idle_;
+        mutable std::mutex m_;
+        /// Free buffers per size, the smallest first.
+        std::vector<std::vector<std::unique_ptr<char[]>>> free_;
+        size_t idle_ = 0;
+};
+
+using BufferPoolPtr = std::shared_ptr<BufferPool>;
@@ -0,0 +1,113 @@
+/**
+ * @file bulkfile.h
+ * @brief Table files read by LOAD and written by EXPORT
+ *
+ * CSV files hold one "id,name" line per row, the name is the rest of
+ * the line. Binary files are columnar: a BinHeader, the id column and
+ * one name column per name of a row. Integer ids are stored as
+ * little-endian int32 or int64, string ids and names as rows + 1
+ * uint64 offsets followed by the bytes.
+ */
+
+#pragma once
+
+#include "table.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+enum class FileFormat { Csv, Bin };
+
+struct BinHeader
+{
+    char magic[4];
+    uint8_t key_type;
+    /// Name columns, 1 for a table and 2 for a join.
+    uint8_t columns;
+    uint16_t reserved;
+    uint64_t rows;
+};
+
+/// Magic of the binary files.
+extern const char bin_magic[4];
+
+/**
+ * @brief Read-only mapping of a whole file.
+ */
+class MappedFile
+{
+    public:
+        /// Throws std::system_error when the file cannot be mapped.
+        explicit MappedFile(const std::string& path);
+        ~MappedFile();
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+
+    private:
+        const char* data_ = nullptr;
+        size_t size_ = 0;
+};
+
+/// One token of the protocol: not empty, no spaces, control bytes or DEL.
+/// Every name and string id that enters the tables is one.
+bool valid_token(const char* begin, const char* end);
+inline bool valid_token(const std::string& text)
+{
+    return valid_token(text.data(), text.data() + text.size());
+}
+
+/// @name Ids of the protocol and of the CSV files, false when the text
+///       is not an id of the type
+/// @{
+bool parse_id(const char* begin, const char* end, int32_t& id);
+bool parse_id(const char* begin, const char* end, int64_t& id);
+bool parse_id(const char* begin, const char* end, std::string& id);
+/// @}
+
+template <typename Key>
+using file_rows_t = std::vector<std::pair<Key, std::string>>;
+
+/**
+ * @brief Rows of a table file sorted by id, the first row of an id wins.
+ *
+ * CSV files are split at line ends and parsed and sorted by several
+ * threads, the sorted parts are merged. Throws std::runtime_error for
+ * a malformed file.
+ *
+ * @return Rows dropped as duplicates of an earlier row of the file.
+ */
+template <typename Key>
+size_t read_rows(const std::string& path, FileFormat format, file_rows_t<Key>& rows);
+
+/**
+ * @brief Row of an export, the names belong to a snapshot of the tables.
+ */
+template <typename Key>
+struct ExportRow
+{
+    Key id;
+    const std::string* names[2];
+};
+
+template <typename Key>
+using export_part_t = std::vector<ExportRow<Key>>;
+
+/**
+ * @brief Writes the parts one after the other as a single file.
+ *
+ * The region of every part in the file follows from the sizes of the
+ * rows, each part is written to its region by its own thread through
+ * a large aligned buffer. The file appears under its path once it is
+ * complete. Throws std::system_error when a write fails.
+ *
+ * @return Rows written.
+ */
+template <typename Key>
+size_t write_rows(const std::string& path, FileFormat format, unsigned columns,
+                  const std::vector<export_part_t<Key>>& parts);
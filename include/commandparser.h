@@ -0,0 +1,83 @@
+/**
+ * @file commandparser.h
+ * @brief Incremental parser of the command lines
+ */
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief Splits the command lines of a receive buffer into tokens as the
+ *        bytes arrive.
+ *
+ * A line is tokens separated by exactly one space and ended by "\n" or
+ * "\r\n", empty lines are skipped. The parser resumes where the previous
+ * call stopped, so every byte is looked at once however the lines are
+ * split between the reads. The tokens are views of the line in the
+ * caller's buffer.
+ */
+class CommandParser
+{
+    public:
+        enum class Result { Good, Bad, Indeterminate };
+
+        /// The verb and its arguments.
+        static const size_t max_tokens = 16;
+
+        /// Lines longer than max_line bytes are Bad.
+        explicit CommandParser(size_t max_line) : max_line_(max_line) {}
+
+        /**
+         * @brief Parses on from the bytes seen by the previous call.
+         *
+         * line points to the start of the current line and size counts
+         * all of its bytes received so far, the line may move between the
+         * calls. After a Good or Bad result the next call starts a new
+         * line.
+         */
+        Result parse(const char* line, size_t size);
+
+        /// Bytes the caller can drop from the front of the line: through
+        /// the end of a Good line or the bad byte, or the rest of a bad
+        /// line being skipped.
+        size_t consumed() const { return consumed_; }
+
+        /// @name Tokens of the Good line, valid while the line stays put
+        /// @{
+        size_t size() const { return count_; }
+        const char* token(size_t i) const { return line_ + tokens_[i].begin; }
+        size_t token_size(size_t i) const { return tokens_[i].size; }
+        /// @}
+
+        /// Why the line is Bad, with the offset of the byte in the line.
+        const std::string& error() const { return error_; }
+
+    private:
+        /// Done follows a complete line, Skip a bad one up to its end.
+        enum class State { Start, Token, Space, Return, Skip, Done };
+
+        struct Token
+        {
+            size_t begin;
+            size_t size;
+        };
+
+        /// Bad at byte pos_ of the line, control bytes are shown in hex.
+        Result fail(const char* what);
+        /// Bad when the line does not fit, the bytes so far are dropped.
+        Result overflow();
+
+        const size_t max_line_;
+        State state_ = State::Start;
+        const char* line_ = nullptr;
+        /// Start of the tokens after the empty lines, and the bytes seen.
+        size_t start_ = 0;
+        size_t pos_ = 0;
+        size_t consumed_ = 0;
+        std::array<Token, max_tokens> tokens_ {};
+        size_t count_ = 0;
+        std::string error_;
+};
@@ -1,11 +1,15 @@
 #pragma once
 
+#include "interpreter.h"
 #include "resultprinter.h"
 #include <string>
 #include <memory>
+#include <vector>
 
 class IStorage;
 
+using arguments_t = std::vector<std::string>;
+
 class Command
 {
     public:
@@ -14,7 +18,32 @@ class Command
 
         virtual ResultPrinterUPtr run() = 0;
 
+        /// Takes the arguments following the command keyword.
+        virtual bool parse(const arguments_t& args)
+        {
+            valid_ = args.empty();
+            return valid_;
+        }
+        /// PREPARE: the arguments with "?" in place of the parameters,
+        /// false when the command cannot be prepared.
+        virtual bool prepare(const arguments_t& args);
+        /// EXEC: args[first..] are the values of the parameters in order,
+        /// the command runs as if parsed with them.
+        virtual bool bind(const arguments_t& args, size_t first);
+
+        /// Heavy commands go through the scheduler.
+        virtual bool heavy() const { return false; }
+        /// Changes the tables, refused by a replica.
+        virtual bool mutates() const { return false; }
+        /// Adds the change to the writes of a transaction instead of
+        /// running, false when the command cannot be part of one.
+        virtual bool stage(WriteSet&) const { return false; }
+        /// Same key, same reply for unchanged tables, empty when the
+        /// reply must not be cached.
+        virtual std::string cache_key() const { return name_; }
+
         const std::string& name() const { return name_; }
+        bool valid() const { return valid_; }
 
     private:
         const std::string name_;
@@ -22,6 +51,9 @@ class Command
     protected:
         bool valid_;
         IStorage& storage_;
+        /// Arguments given to prepare() and the indexes of the "?" ones.
+        arguments_t prepared_;
+        std::vector<size_t> params_;
 };
 
 using CommandUPtr = std::unique_ptr<Command>;
@@ -32,18 +64,24 @@ class Insert : public Command
         Insert(IStorage& storage)
             : Command("Insert", storage) { valid_ = true; }
 
-        ResultPrinterUPtr run() override
-        {
-            return std::make_unique<InsertPrinter>();
-        }
+        ResultPrinterUPtr run() override;
+        bool parse(const arguments_t& args) override;
+        /// The fixed arguments are checked once, EXEC checks the
+        /// parameters only and goes straight to the storage.
+        bool prepare(const arguments_t& args) override;
+        bool bind(const arguments_t& args, size_t first) override;
+        bool mutates() const override { return true; }
+        bool stage(WriteSet& writes) const override;
+        bool heavy() const override;
+        std::string cache_key() const override { return std::string(); }
 
-        void setTable(const std::string& table) { table_ = table; }
-        void setId(int id) { id_ = id; }
+        void setTable(table_handle_t table) { table_ = table; }
+        void setId(const std::string& id) { id_ = id; }
         void setValue(const std::string& value) { value_ = value; }
 
     private:
-        std::string table_;
-        int id_;
+        table_handle_t table_ = no_table;
+        std::string id_;
         std::string value_;
 };
 
@@ -53,34 +91,122 @@ class Truncate : public Command
         Truncate(IStorage& storage)
             : Command("Truncate", storage) { valid_ = true; }
 
-        ResultPrinterUPtr run() override
+        ResultPrinterUPtr run() override;
+        bool parse(const arguments_t& args) override;
+        bool mutates() const override { return true; }
+        bool stage(WriteSet& writes) const override;
+        bool heavy() const override;
+        std::string cache_key() const override { return std::string(); }
+
+        void setTable(table_handle_t table) { table_ = table; }
+
+    private:
+        table_handle_t table_ = no_table;
+};
+
+/**
+ * @brief COMMIT of the writes staged since BEGIN, the reply counts the
+ *        rows inserted and the duplicates as for LOAD.
+ */
+class Commit : public Command
+{
+    public:
+        Commit(IStorage& storage, WriteSet writes)
+            : Command("Commit", storage), writes_(std::move(writes)) { valid_ = true; }
+
+        ResultPrinterUPtr run() override;
+        /// A batch may hold the lock for long, like LOAD.
+        bool heavy() const override { return true; }
+        bool mutates() const override { return true; }
+        std::string cache_key() const override { return std::string(); }
+
+    private:
+        const WriteSet writes_;
+};
+
+/**
+ * @brief Bulk insert of the rows of a server-side file.
+ */
+class Load : public Command
+{
+    public:
+        Load(IStorage& storage)
+            : Command("Load", storage) { valid_ = true; }
+
+        ResultPrinterUPtr run() override;
+        bool parse(const arguments_t& args) override;
+        bool heavy() const override { return true; }
+        bool mutates() const override { return true; }
+        std::string cache_key() const override { return std::string(); }
+
+    private:
+        std::string table_;
+        std::string path_;
+        FileFormat format_ = FileFormat::Csv;
+};
+
+/**
+ * @brief Writes a join or a table to a server-side file, the reply is the
+ *        number of rows written.
+ */
+class Export : public Command
+{
+    public:
+        Export(IStorage& storage)
+            : Command("Export", storage) { valid_ = true; }
+
+        ResultPrinterUPtr run() override;
+        bool parse(const arguments_t& args) override;
+        bool heavy() const override { return true; }
+        std::string cache_key() const override { return std::string(); }
+
+    private:
+        /// Empty for a join.
+        std::string table_;
+        JoinKind kind_ = JoinKind::Intersection;
+        std::string path_;
+        FileFormat format_ = FileFormat::Csv;
+};
+
+/**
+ * @brief Join of the tables, optionally restricted to a slice.
+ */
+class Join : public Command
+{
+    public:
+        Join(const std::string& command_name, IStorage& storage)
+            : Command(command_name, storage) { valid_ = true; }
+
+        bool parse(const arguments_t& args) override;
+        /// The estimates read the sketches only, unless they are on the
+        /// shards.
+        bool heavy() const override
         {
-            return std::make_unique<TruncatePrinter>();
+            return output_ != JoinOutput::Estimate || storage_.remote();
         }
+        std::string cache_key() const override;
+
+    protected:
+        JoinRange range_;
+        JoinOutput output_ = JoinOutput::Rows;
 };
 
-class Intersection : public Command
+class Intersection : public Join
 {
     public:
         Intersection(IStorage& storage)
-            : Command("Intersection", storage) { valid_ = true; }
+            : Join("Intersection", storage) {}
 
-        ResultPrinterUPtr run() override
-        {
-            return std::make_unique<IntersectionPrinter>();
-        }
+        ResultPrinterUPtr run() override;
 };
 
-class SymmetricDifference : public Command
+class SymmetricDifference : public Join
 {
     public:
         SymmetricDifference(IStorage& storage)
-            : Command("SymmetricDifference", storage) { valid_ = true; }
+            : Join("SymmetricDifference", storage) {}
 
-        ResultPrinterUPtr run() override
-        {
-            return std::make_unique<SymmetricDifferencePrinter>();
-        }
+        ResultPrinterUPtr run() override;
 };
 
 class Unknown : public Command
@@ -89,6 +215,13 @@ class Unknown : public Command
         Unknown(IStorage& storage)
             : Command("Unknown", storage) {}
 
+        bool parse(const arguments_t&) override
+        {
+            valid_ = true;
+            return valid_;
+        }
+        bool prepare(const arguments_t&) override { return false; }
+
         ResultPrinterUPtr run() override
         {
             return std::make_unique<UnknownPrinter>();
@@ -107,6 +240,18 @@ class CommandFactory
             else if (cmd_str == "TRUNCATE") {
                 return std::make_unique<Truncate>(storage);
             }
+            else if (cmd_str == "LOAD") {
+                return std::make_unique<Load>(storage);
+            }
+            else if (cmd_str == "EXPORT") {
+                return std::make_unique<Export>(storage);
+            }
+            else if (cmd_str == "INTERSECTION") {
+                return std::make_unique<Intersection>(storage);
+            }
+            else if (cmd_str == "SYMMETRIC_DIFFERENCE") {
+                return std::make_unique<SymmetricDifference>(storage);
+            }
             return std::make_unique<Unknown>(storage);
         }
 };
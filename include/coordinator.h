@@ -0,0 +1,166 @@
+/**
+ * @file coordinator.h
+ * @brief Storage of a coordinator, the tables live on shard processes
+ *
+ * Every shard is a join_server that owns the ids of a range, the ranges
+ * follow each other in the order the shards are given. An INSERT goes to
+ * the shard of its id, a join goes to every shard its range touches at
+ * once and, the ranges being disjoint and ordered, the partial results
+ * are merged by concatenating them in the order of the shards.
+ */
+
+#pragma once
+
+#include "storage.h"
+#include <asio.hpp>
+#include <chrono>
+#include <limits>
+
+/**
+ * @brief A shard owns the ids from its from up to the from of the next
+ *        shard.
+ */
+struct Shard
+{
+    int64_t from = std::numeric_limits<int64_t>::min();
+    std::string host;
+    std::string port;
+
+    std::string address() const { return host + ":" + port; }
+};
+
+/// Parses "[FROM@]HOST:PORT", throws std::invalid_argument.
+Shard parse_shard(const std::string& text);
+
+/**
+ * @brief Blocking connections to one shard, one command at a time on
+ *        each, kept for the next command.
+ */
+class ShardClient
+{
+    public:
+        /// A shard silent for reply_timeout while a reply is read is
+        /// given up on.
+        explicit ShardClient(const Shard& shard,
+                             std::chrono::milliseconds reply_timeout = std::chrono::seconds(30));
+
+        ShardClient(const ShardClient&) = delete;
+        ShardClient& operator=(const ShardClient&) = delete;
+
+        /**
+         * @brief Runs the command on the shard.
+         * @param out The lines of the reply before OK, or the message of
+         *        an ERR reply.
+         * @param rows The number of those lines.
+         * @return False for an ERR reply, throws std::runtime_error when
+         *         the shard cannot be reached.
+         */
+        bool call(const std::string& command, std::string& out, size_t& rows);
+
+        const Shard& shard() const { return shard_; }
+
+    private:
+        using SocketUPtr = std::unique_ptr<asio::ip::tcp::socket>;
+
+        /// Reads the reply, false when the connection failed before it.
+        bool exchange(asio::ip::tcp::socket& socket, const std::string& command,
+                      std::string& out, size_t& rows, bool& ok);
+
+        const Shard shard_;
+        const std::chrono::milliseconds reply_timeout_;
+        asio::io_service io_service_;
+        std::mutex m_;
+        std::vector<SocketUPtr> idle_;
+};
+
+/**
+ * @brief The rows of the shards as they replied, "id,a,b" lines one
+ *        after the other.
+ */
+class ShardRows : public IResultTable
+{
+    public:
+        size_t size() const override { return starts_.size(); }
+        void print(std::string& out) const override { out.append(text_); }
+        void print_json(std::string& out, size_t begin, size_t end,
+                        bool ndjson) const override;
+
+        /// Appends rows [skip, skip + limit) of the text of a reply.
+        void append(const std::string& text, size_t skip, size_t limit);
+
+    private:
+        std::string text_;
+        /// Offset of every row in the text.
+        std::vector<size_t> starts_;
+};
+
+/**
+ * @brief Tables A and B split by id ranges over shard processes, the
+ *        coordinator keeps no rows.
+ */
+class ShardedStorage : public IStorage
+{
+    public:
+        /// The from of the shards goes up, the first one has none.
+        ShardedStorage(KeyType key_type, const std::vector<Shard>& shards);
+
+        size_t n_tables() const override { return 2; }
+        /// The shards do not tell when they change.
+        versions_t versions() const override { return versions_t(2, 0); }
+        bool remote() const override { return true; }
+
+        bool valid_key(const std::string& id) const override;
+        table_handle_t find_table(const std::string& name) const override
+        {
+            return catalog_.find(name);
+        }
+        using IStorage::insert;
+        using IStorage::truncate;
+        bool insert(table_handle_t table,
+                    const std::string& id, const std::string& name) override;
+        bool truncate(table_handle_t table) override;
+        /// The shards cannot change together.
+        LoadResult apply(const WriteSet& writes) override;
+        LoadResult load(const std::string& table, const std::string& path,
+                        FileFormat format) override;
+        size_t export_join(JoinKind kind, const std::string& path,
+                           FileFormat format) const override;
+        size_t export_table(const std::string& table, const std::string& path,
+                            FileFormat format) const override;
+        /// The shards log their own changes.
+        void set_log(MutationLog*) override {}
+        DumpUPtr dump(uint64_t& lsn) const override;
+        SubscriptionPtr subscribe(JoinKind kind, size_t max_queued,
+                                  SubscriptionNotify notify) override;
+        result_table_t intersection(const JoinRange& range) const override;
+        result_table_t symmetric_difference(const JoinRange& range) const override;
+        size_t intersection_count(const JoinRange& range) const override;
+        size_t symmetric_difference_count(const JoinRange& range) const override;
+        Estimate intersection_estimate() const override;
+        Estimate symmetric_difference_estimate() const override;
+
+    private:
+        struct Reply
+        {
+            bool sent = false;
+            bool ok = false;
+            std::string text;
+            size_t rows = 0;
+        };
+
+        /// Runs the commands on their shards at once, an empty command
+        /// skips the shard. Throws when one of the shards failed.
+        std::vector<Reply> scatter(const std::vector<std::string>& commands) const;
+        /// The join restricted to the range of every shard, empty for the
+        /// shards out of the range.
+        std::vector<std::string> split(const char* verb, const JoinRange& range,
+                                       bool count) const;
+        result_table_t join(const char* verb, const JoinRange& range) const;
+        size_t count(const char* verb, const JoinRange& range) const;
+        Estimate estimate(const char* verb) const;
+
+        const KeyType key_type_;
+        /// A and B, as on the shards.
+        TableCatalog catalog_;
+        std::vector<std::unique_ptr<ShardClient>> shards_;
+};
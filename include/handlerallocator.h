@@ -0,0 +1,134 @@
+/**
+ * @file handlerallocator.h
+ * @brief Recycled memory for asio completion handlers
+ *
+ * After the allocation example shipped with asio: every operation kind
+ * of a session (read, write, timer) has one outstanding handler at a
+ * time, so a single slot per kind serves all of them without touching
+ * the heap.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+class HandlerMemory
+{
+    public:
+        HandlerMemory() = default;
+        HandlerMemory(const HandlerMemory&) = delete;
+        HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+        void* allocate(std::size_t size)
+        {
+            if (!in_use_ && size <= sizeof(storage_)) {
+                in_use_ = true;
+                return &storage_;
+            }
+            return ::operator new(size);
+        }
+
+        void deallocate(void* pointer)
+        {
+            if (pointer == &storage_) {
+                in_use_ = false;
+            }
+            else {
+                ::operator delete(pointer);
+            }
+        }
+
+    private:
+        typename std::aligned_storage<1024>::type storage_;
+        bool in_use_ = false;
+};
+
+template <typename T>
+class HandlerAllocator
+{
+    public:
+        using value_type = T;
+
+        explicit HandlerAllocator(HandlerMemory& memory) : memory_(memory) {}
+
+        template <typename U>
+        HandlerAllocator(const HandlerAllocator<U>& other) noexcept
+            : memory_(other.memory_) {}
+
+        T* allocate(std::size_t n) const
+        {
+            return static_cast<T*>(memory_.allocate(sizeof(T) * n));
+        }
+
+        void deallocate(T* p, std::size_t) const
+        {
+            memory_.deallocate(p);
+        }
+
+        bool operator==(const HandlerAllocator& other) const noexcept
+        {
+            return &memory_ == &other.memory_;
+        }
+
+        bool operator!=(const HandlerAllocator& other) const noexcept
+        {
+            return &memory_ != &other.memory_;
+        }
+
+    private:
+        template <typename> friend class HandlerAllocator;
+
+        HandlerMemory& memory_;
+};
+
+/**
+ * @brief Wraps a handler so that asio allocates its state from the
+ *        memory slot, both through the allocator and the legacy hooks.
+ */
+template <typename Handler>
+class CustomAllocHandler
+{
+    public:
+        using allocator_type = HandlerAllocator<Handler>;
+
+        CustomAllocHandler(HandlerMemory& memory, Handler handler)
+            : memory_(memory)
+            , handler_(std::move(handler)) {}
+
+        allocator_type get_allocator() const noexcept
+        {
+            return allocator_type(memory_);
+        }
+
+        template <typename... Args>
+        void operator()(Args&&... args)
+        {
+            handler_(std::forward<Args>(args)...);
+        }
+
+        friend void* asio_handler_allocate(std::size_t size,
+                                           CustomAllocHandler* this_handler)
+        {
+            return this_handler->memory_.allocate(size);
+        }
+
+        friend void asio_handler_deallocate(void* pointer, std::size_t,
+                                            CustomAllocHandler* this_handler)
+        {
+            this_handler->memory_.deallocate(pointer);
+        }
+
+    private:
+        HandlerMemory& memory_;
+        Handler handler_;
+};
+
+template <typename Handler>
+inline CustomAllocHandler<Handler> make_custom_alloc_handler(HandlerMemory& memory,
+                                                             Handler handler)
+{
+    return CustomAllocHandler<Handler>(memory, std::move(handler));
+}
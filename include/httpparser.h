@@ -0,0 +1,83 @@
+/**
+ * @file httpparser.h
+ * @brief Incremental parser of HTTP/1.x requests
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+/**
+ * @brief Request of the HTTP front-end, the parameters come from the
+ *        query string and from a form encoded body.
+ */
+struct HttpRequest
+{
+    std::string method;
+    /// The target without its query string.
+    std::string path;
+    std::map<std::string, std::string> params;
+    /// 0 for HTTP/1.0, 1 for HTTP/1.1.
+    int version_minor = 1;
+    bool keep_alive = true;
+    /// The client asked for application/x-ndjson.
+    bool ndjson = false;
+};
+
+/**
+ * @brief Byte at a time state machine in the manner of the request parser
+ *        of example/server, extended with the body of POST requests.
+ *
+ * Every byte given to parse() is used, the caller can drop the consumed
+ * bytes from its buffer whatever the result is. After a Good or Bad
+ * result the next call starts a new request.
+ */
+class HttpParser
+{
+    public:
+        enum class Result { Good, Bad, Indeterminate };
+
+        /// Requests longer than max_size bytes with their body are Bad.
+        explicit HttpParser(size_t max_size) : max_size_(max_size) {}
+
+        Result parse(HttpRequest& request, const char* data, size_t size);
+
+        size_t consumed() const { return consumed_; }
+        /// Why the request is Bad.
+        const std::string& error() const { return error_; }
+
+    private:
+        enum class State
+        {
+            Method, Target, Version, RequestLineEnd,
+            HeaderStart, HeaderName, HeaderValue, HeaderLineEnd, HeadersEnd,
+            Body, Done
+        };
+
+        Result consume(HttpRequest& request, char c);
+        Result fail(const std::string& what);
+        /// Applies the header just read.
+        bool header(HttpRequest& request);
+        /// Splits the target and the body into the parameters.
+        Result finish(HttpRequest& request);
+
+        const size_t max_size_;
+        State state_ = State::Method;
+        size_t consumed_ = 0;
+        size_t size_ = 0;
+        std::string target_;
+        std::string version_;
+        std::string name_;
+        std::string value_;
+        std::string body_;
+        size_t content_length_ = 0;
+        bool form_ = false;
+        bool close_ = false;
+        bool keep_alive_ = false;
+        std::string error_;
+};
+
+/// Decodes "a=1&b=x%20y" into the parameters, false for a bad escape.
+bool parse_form(const std::string& text, std::map<std::string, std::string>& params);
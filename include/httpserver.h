@@ -0,0 +1,112 @@
+/**
+ * @file httpserver.h
+ * @brief HTTP/JSON front-end of the storage
+ *
+ * POST /insert (table, id, name) and POST /truncate (table) take their
+ * parameters from the query string or a form encoded body.
+ * GET /intersection and GET /symmetric_difference take the join clauses
+ * as parameters: from, to, order=asc|desc, limit, offset, unordered,
+ * count, estimate. The rows come as a JSON array or, with
+ * "Accept: application/x-ndjson", one object per line; large results
+ * are streamed in chunks.
+ */
+
+#pragma once
+
+#include "httpparser.h"
+#include "processor.h"
+#include "server.h"
+#include <asio.hpp>
+#include <deque>
+
+class HttpSession
+    : public ISession
+    , public std::enable_shared_from_this<HttpSession>
+{
+    public:
+        HttpSession(asio::ip::tcp::socket socket, const ProcessorContext& context,
+                    SessionManager& manager, const ServerConfig& config);
+
+        HttpSession(const HttpSession&) = delete;
+        HttpSession& operator=(const HttpSession&) = delete;
+
+        void start() override;
+        void stop() override;
+        void drain() override;
+
+    private:
+        void do_read();
+        /// Handle the buffered requests one at a time.
+        void process_input();
+        void handle();
+        /// INSERT and TRUNCATE through the processor of the line protocol.
+        void update(const std::string& verb, const arguments_t& args);
+        void join(JoinKind kind);
+        /// Complete response with a JSON body.
+        void reply(int status, const std::string& body);
+        /// The rows as one body or, when they are many, in chunks.
+        void send_rows(result_table_t rows);
+        /// Queues the next chunk of the rows once the previous one is sent.
+        void next_chunk();
+        std::string head(int status, const char* content_type) const;
+        void deliver(std::string data);
+        void do_write();
+        /// Keep the connection for the next request or close it.
+        void response_done();
+        void arm_timer();
+
+        asio::ip::tcp::socket socket_;
+        asio::steady_timer timer_;
+        enum { max_length = 8192 };
+
+        /// [begin_, end_) is not parsed yet.
+        std::array<char, max_length> buffer_{};
+        size_t begin_ = 0;
+        size_t end_ = 0;
+        HttpParser parser_ { 1 << 20 };
+        HttpRequest request_;
+        std::deque<std::string> write_queue_;
+
+        HandlerMemory read_memory_;
+        HandlerMemory write_memory_;
+        HandlerMemory timer_memory_;
+
+        const ProcessorContext context_;
+        ProcessorUPtr processor_;
+        Scheduler::ClientPtr client_;
+        SessionManager& manager_;
+        const ServerConfig& config_;
+
+        /// Rows being streamed and the next one to send.
+        result_table_t stream_;
+        size_t next_row_ = 0;
+        bool keep_alive_ = true;
+        bool draining_ = false;
+        /// The response to the current request is not queued completely.
+        bool busy_ = false;
+};
+
+/**
+ * @brief Second listener next to the line protocol, on the same storage,
+ *        scheduler and io_service.
+ */
+class HttpServer : public IServer
+{
+    public:
+        HttpServer(asio::io_service& io_service, unsigned short port,
+                   const ProcessorContext& context,
+                   const ServerConfig& config = ServerConfig());
+
+        void drain(std::function<void()> on_drained) override;
+        void stop() override;
+
+    private:
+        void do_accept();
+
+        asio::ip::tcp::acceptor acceptor_;
+        asio::ip::tcp::socket socket_;
+        SessionManager manager_;
+
+        const ProcessorContext context_;
+        const ServerConfig config_;
+};
@@ -4,6 +4,7 @@
  */
 
 #pragma once
+#include "storage.h"
 #include <string>
 #include <memory>
 #include <regex>
@@ -67,3 +68,24 @@ using term_t = TerminalExpression;
 using expr_t = ExpressionPtr;
 using start_block_t = OrExpression<expr_t, expr_t>;
 using end_block_t = OrExpression<expr_t, expr_t, expr_t>;
+
+/**
+ * @brief Terminals of the protocol, shared by the commands.
+ */
+struct Grammar
+{
+    static const expr_t& table_name();
+    static const expr_t& id_field();
+    static const expr_t& name_field();
+    static const expr_t& count_field();
+};
+
+/// What a join command sends back.
+enum class JoinOutput { Rows, Count, Estimate };
+
+/**
+ * @brief Optional clauses of the join commands,
+ *        [FROM lo] [TO hi] [ORDER ASC|DESC] [LIMIT n] [OFFSET m]
+ *        [UNORDERED] [COUNT] in this order, or ESTIMATE alone.
+ */
+bool parse_join(std::vector<std::string> args, JoinRange& range, JoinOutput& output);
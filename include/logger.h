@@ -2,12 +2,104 @@
 
 #include "singleton.h"
 
-#define SPDLOG_TRACE_ON
-#define SPDLOG_DEBUG_ON
 #include <spdlog/spdlog.h>
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Compile-time floor for the LOG_* macros. Statements below the floor
+ * are dead code: arguments are still type checked but never evaluated.
+ * Values follow spdlog::level::level_enum: 0 - trace, 1 - debug, 2 - info.
+ */
+#define JOIN_SERVER_LEVEL_TRACE 0
+#define JOIN_SERVER_LEVEL_DEBUG 1
+#define JOIN_SERVER_LEVEL_INFO  2
+
+#ifndef JOIN_SERVER_LOG_LEVEL
+#  ifdef NDEBUG
+#    define JOIN_SERVER_LOG_LEVEL JOIN_SERVER_LEVEL_INFO
+#  else
+#    define JOIN_SERVER_LOG_LEVEL JOIN_SERVER_LEVEL_TRACE
+#  endif
+#endif
 
 using LoggerPtr = std::shared_ptr<spdlog::logger>;
 
 extern LoggerPtr gLogger;
 
-#define TRACE()  SPDLOG_TRACE(gLogger, "{}", __PRETTY_FUNCTION__)
+struct LogConfig
+{
+    bool debug = false;
+    /// Route records through the spdlog async queue.
+    bool async = false;
+    size_t async_queue_size = 8192;
+    /// Log one of every sample_rate commands, 0 disables sampling.
+    size_t sample_rate = 0;
+};
+
+/**
+ * @brief Picks every N-th event for the sampled log.
+ */
+class LogSampler
+{
+    public:
+        void set_rate(size_t rate) { rate_.store(rate, std::memory_order_relaxed); }
+
+        bool hit()
+        {
+            const size_t rate = rate_.load(std::memory_order_relaxed);
+            if (rate == 0) {
+                return false;
+            }
+            return counter_.fetch_add(1, std::memory_order_relaxed) % rate == 0;
+        }
+
+    private:
+        std::atomic<size_t> rate_ { 0 };
+        std::atomic<size_t> counter_ { 0 };
+};
+
+extern LogSampler gLogSampler;
+
+/**
+ * @brief Recreates gLogger according to the configuration.
+ *
+ * Must be called before any other thread uses the logger.
+ */
+void init_logger(const LogConfig& config);
+
+#define LOG_IF_LEVEL(lvl, ...)                              \
+    do {                                                    \
+        if (gLogger->should_log(lvl)) {                     \
+            gLogger->log(lvl, __VA_ARGS__);                 \
+        }                                                   \
+    } while (0)
+
+#define LOG_DISABLED(...)                                   \
+    do {                                                    \
+        if (false) {                                        \
+            gLogger->log(spdlog::level::off, __VA_ARGS__);  \
+        }                                                   \
+    } while (0)
+
+#if JOIN_SERVER_LOG_LEVEL <= JOIN_SERVER_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_IF_LEVEL(spdlog::level::trace, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) LOG_DISABLED(__VA_ARGS__)
+#endif
+
+#if JOIN_SERVER_LOG_LEVEL <= JOIN_SERVER_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_IF_LEVEL(spdlog::level::debug, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_DISABLED(__VA_ARGS__)
+#endif
+
+/// Always compiled in, costs a relaxed load while sampling is off.
+#define LOG_SAMPLED(...)                                    \
+    do {                                                    \
+        if (gLogSampler.hit()) {                            \
+            gLogger->info(__VA_ARGS__);                     \
+        }                                                   \
+    } while (0)
+
+#define TRACE()  LOG_TRACE("{}", __PRETTY_FUNCTION__)
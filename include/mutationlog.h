@@ -0,0 +1,61 @@
+/**
+ * @file mutationlog.h
+ * @brief Ordered log of the changes of the storage for the replicas
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Changes of the storage as commands of the line protocol,
+ *        numbered by lsn from 1.
+ *
+ * The storage appends under its own lock, so the order of the log is
+ * the order in which the changes were made. Only the newest entries up
+ * to max_bytes are kept, a replica that needs older ones starts over
+ * from a snapshot.
+ */
+class MutationLog
+{
+    public:
+        using Waiter = std::function<void()>;
+
+        explicit MutationLog(size_t max_bytes = size_t(64) << 20);
+
+        MutationLog(const MutationLog&) = delete;
+        MutationLog& operator=(const MutationLog&) = delete;
+
+        /// @return The lsn of the entry.
+        uint64_t append(std::string command);
+        uint64_t last_lsn() const;
+        /// Random per process, the lsns of another epoch mean nothing.
+        uint64_t epoch() const { return epoch_; }
+
+        /**
+         * @brief Appends "lsn command" lines of the entries after lsn until
+         *        out holds about max_bytes, lsn becomes the last one read.
+         * @return False when those entries were dropped already.
+         */
+        bool read(uint64_t& lsn, std::string& out, size_t max_bytes) const;
+
+        /// The waiter is called once on the next append, on the thread
+        /// that appends. False without waiting when there are entries
+        /// after lsn already.
+        bool wait(uint64_t lsn, Waiter waiter);
+
+    private:
+        const size_t max_bytes_;
+        const uint64_t epoch_;
+        mutable std::mutex m_;
+        std::deque<std::string> entries_;
+        /// Lsn of the front entry.
+        uint64_t first_lsn_ = 1;
+        size_t bytes_ = 0;
+        std::vector<Waiter> waiters_;
+};
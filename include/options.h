@@ -0,0 +1,42 @@
+#pragma once
+
+#include "coordinator.h"
+#include "logger.h"
+#include "scheduler.h"
+#include "server.h"
+#include "storage.h"
+#include <string>
+
+enum class Transport { Epoll, Uring };
+
+/**
+ * @brief Command line of join_server.
+ */
+struct Options
+{
+    unsigned short port = 0;
+    /// Port of the HTTP front-end, 0 disables it.
+    unsigned short http_port = 0;
+    Transport transport = Transport::Epoll;
+    LogConfig log;
+    ServerConfig server;
+    SchedulerConfig scheduler;
+    /// Bytes of cached join replies.
+    size_t cache_size = 64 << 20;
+    KeyType key_type = KeyType::Int32;
+    /// Directory of the files of LOAD, empty disables it.
+    std::string data_dir;
+    /// Port the replicas connect to, 0 when the process is no primary.
+    unsigned short replication_port = 0;
+    /// "host:port" of the primary, empty when the process is no replica.
+    std::string replica_of;
+    /// Shards by id range, a coordinator keeps no rows itself.
+    std::vector<Shard> shards;
+};
+
+/**
+ * @brief Parses the arguments, throws std::invalid_argument on a bad one.
+ */
+Options parse_options(int argc, char const** argv);
+
+std::string usage(const std::string& program);
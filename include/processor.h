@@ -1,18 +1,64 @@
 #pragma once
 
+#include "commands.h"
 #include "storage.h"
 #include "resultprinter.h"
+#include "scheduler.h"
+#include <functional>
+#include <map>
 #include <memory>
 
+class Command;
+class ResultCache;
+
+/**
+ * @brief Role of the process in the replication, reported by the
+ *        REPLICATION command.
+ */
+class IReplication
+{
+    public:
+        virtual ~IReplication() {}
+
+        /// A replica refuses the commands that change the tables.
+        virtual bool read_only() const = 0;
+        /// Reply lines without the final OK, called from any session.
+        virtual std::string status() const = 0;
+};
+
+/**
+ * @brief Shared by the processors of all the sessions.
+ */
+struct ProcessorContext
+{
+    IStorage& storage;
+    /// Without a scheduler the heavy commands run inline.
+    Scheduler* scheduler;
+    /// Without a cache every join is computed.
+    ResultCache* cache;
+    /// Null when the process does not replicate.
+    const IReplication* replication = nullptr;
+};
+
 using result_t = std::tuple<result_table_t, bool>;
 
 class IProcessor
 {
     public:
+        /// Receives the reply to one command.
+        using Reply = std::function<void(std::string)>;
+        /// Runs a task on the thread that owns the processor.
+        using Post = std::function<void(std::function<void()>)>;
+
         IProcessor(IStorage& storage) : storage_(storage) {}
         virtual ~IProcessor() {}
 
-        virtual ResultPrinterUPtr execute(const std::string& command) = 0;
+        /// Light commands reply before returning, heavy ones later
+        /// through Post.
+        virtual void execute(const std::string& command, Reply done) = 0;
+        /// The command split into its verb and arguments already.
+        virtual void execute(const std::string& verb, const arguments_t& args,
+                             Reply done) = 0;
 
     protected:
         IStorage& storage_;
@@ -23,7 +69,39 @@ using ProcessorUPtr = std::unique_ptr<IProcessor>;
 class Processor : public IProcessor
 {
     public:
-        Processor(IStorage& storage);
+        Processor(const ProcessorContext& context, Post post = Post());
+
+        void execute(const std::string& command, Reply done) override;
+        void execute(const std::string& verb, const arguments_t& args,
+                     Reply done) override;
+
+    private:
+        /// REPLICATION: the role, the lsns and the lag.
+        std::string replication(const arguments_t& args) const;
+        /// WEIGHT n: the share of this connection in the heavy commands.
+        std::string weight(const arguments_t& args);
+        /// PREPARE name VERB args..., "?" for the parameters given by EXEC.
+        std::string prepare(const arguments_t& args);
+        /// EXEC name params...
+        void exec(const arguments_t& args, Reply done);
+        /// BEGIN, COMMIT or ROLLBACK.
+        void transaction(const std::string& verb, const arguments_t& args, Reply done);
+        /// Runs a parsed command inline or on the scheduler.
+        void dispatch(std::shared_ptr<Command> cmd, Reply done);
+        static std::string run(Command& cmd);
+        /// Stores the reply unless the tables changed meanwhile.
+        static std::string run_cached(const ProcessorContext& context, Command& cmd);
 
-        virtual ResultPrinterUPtr execute(const std::string& command);
+        const ProcessorContext context_;
+        Scheduler::ClientPtr client_;
+        Post post_;
+        /// Commands of PREPARE by name, for this connection only. A
+        /// heavy one is not bound again before its reply, the sessions
+        /// run one command at a time.
+        std::map<std::string, std::shared_ptr<Command>> prepared_;
+        enum { max_prepared = 1024 };
+        /// Writes since BEGIN, null outside a transaction.
+        std::unique_ptr<WriteSet> writes_;
+        /// Above it the transaction is rolled back.
+        enum { max_writes = 1 << 20 };
 };
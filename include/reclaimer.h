@@ -0,0 +1,41 @@
+/**
+ * @file reclaimer.h
+ * @brief Frees retired objects on a background thread
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+/**
+ * @brief Drops the last references of large objects away from the
+ *        thread that retired them, so that freeing them does not hold
+ *        a lock or delay a reply.
+ */
+class Reclaimer
+{
+    public:
+        Reclaimer();
+        /// Frees what is still queued and joins the thread.
+        ~Reclaimer();
+
+        Reclaimer(const Reclaimer&) = delete;
+        Reclaimer& operator=(const Reclaimer&) = delete;
+
+        /// The object is destroyed on the background thread unless it
+        /// is still referenced elsewhere.
+        void retire(std::shared_ptr<void> object);
+
+    private:
+        void run();
+
+        std::mutex m_;
+        std::condition_variable cv_;
+        std::deque<std::shared_ptr<void>> retired_;
+        bool stop_ = false;
+        std::thread thread_;
+};
@@ -0,0 +1,186 @@
+/**
+ * @file replication.h
+ * @brief Shipping of the mutation log from a primary to its replicas
+ *
+ * A replica connects to the replication port of the primary, one line
+ * per message:
+ *
+ *     replica: REPLICATE <epoch> <lsn>   resume after lsn of the epoch
+ *     primary: SNAPSHOT <epoch> <lsn>    when the log cannot resume it,
+ *              TRUNCATE/INSERT lines     the tables as of lsn
+ *              END
+ *     primary: <lsn> <command>           the entries of the log in order
+ *     primary: HEARTBEAT <lsn>           when idle, the last lsn
+ *     replica: ACK <lsn>                 applied through lsn
+ *
+ * The replica applies the commands to its own storage and serves the
+ * read-only commands.
+ */
+
+#pragma once
+
+#include "mutationlog.h"
+#include "processor.h"
+#include "server.h"
+#include <asio.hpp>
+#include <array>
+#include <map>
+#include <mutex>
+
+class ReplicationServer;
+
+/**
+ * @brief Connection of one replica on the primary.
+ */
+class ReplicaFeed
+    : public ISession
+    , public std::enable_shared_from_this<ReplicaFeed>
+{
+    public:
+        ReplicaFeed(asio::io_service& io_service, asio::ip::tcp::socket socket,
+                    IStorage& storage, MutationLog& log, ReplicationServer& server);
+
+        ReplicaFeed(const ReplicaFeed&) = delete;
+        ReplicaFeed& operator=(const ReplicaFeed&) = delete;
+
+        void start() override;
+        void stop() override;
+        /// Nothing is owed to a replica, it reconnects later.
+        void drain() override;
+
+        const std::string& endpoint() const { return endpoint_; }
+
+    private:
+        /// The handshake, then the ACKs.
+        void do_read();
+        void handshake(const std::string& line);
+        /// Writes the next piece of the snapshot or of the log, waits for
+        /// the log when there is nothing to send.
+        void pump();
+        void do_write(std::string data);
+        void arm_heartbeat();
+
+        /// Outlives the log, unlike the feed.
+        asio::io_service& io_service_;
+        asio::ip::tcp::socket socket_;
+        asio::steady_timer heartbeat_;
+        asio::streambuf input_;
+        IStorage& storage_;
+        MutationLog& log_;
+        ReplicationServer& server_;
+        std::string endpoint_;
+
+        /// The snapshot being sent.
+        DumpUPtr dump_;
+        /// The write in flight.
+        std::string output_;
+        /// Last entry sent.
+        uint64_t sent_ = 0;
+        /// The handshake is done.
+        bool streaming_ = false;
+        bool writing_ = false;
+        /// A waiter is registered with the log.
+        bool waiting_ = false;
+};
+
+/**
+ * @brief Listener of the replicas on the primary, appends every change
+ *        of the storage to the log.
+ */
+class ReplicationServer
+    : public IServer
+    , public IReplication
+{
+    public:
+        ReplicationServer(asio::io_service& io_service, unsigned short port, IStorage& storage,
+                          MutationLog& log);
+        ~ReplicationServer();
+
+        void drain(std::function<void()> on_drained) override;
+        void stop() override;
+
+        /// The port listened on, chosen by the system for port 0.
+        unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
+        bool read_only() const override { return false; }
+        /// "primary,lsn,replicas" and an "endpoint,acked,lag" line per replica.
+        std::string status() const override;
+
+        /// @name Progress of the feeds
+        /// @{
+        void acked(const ReplicaFeed* feed, uint64_t lsn);
+        void remove(std::shared_ptr<ReplicaFeed> feed);
+        /// @}
+
+    private:
+        void do_accept();
+
+        asio::io_service& io_service_;
+        asio::ip::tcp::acceptor acceptor_;
+        asio::ip::tcp::socket socket_;
+        SessionManager manager_;
+        IStorage& storage_;
+        MutationLog& log_;
+
+        mutable std::mutex m_;
+        /// Endpoint and acked lsn of every feed.
+        std::map<const ReplicaFeed*, std::pair<std::string, uint64_t>> acked_;
+};
+
+/**
+ * @brief Replica side, follows the primary and reconnects when the
+ *        connection is lost.
+ */
+class ReplicaClient : public IReplication
+{
+    public:
+        /// primary is "host:port" of its replication port.
+        ReplicaClient(asio::io_service& io_service, const std::string& primary,
+                      IStorage& storage);
+
+        void stop();
+
+        bool read_only() const override { return true; }
+        /// "replica,state,applied,primary lsn,lag".
+        std::string status() const override;
+
+    private:
+        enum class State { Connecting, Snapshot, Streaming };
+
+        void connect();
+        /// Drops the connection and connects again a second later.
+        void retry();
+        void do_read();
+        /// False for a line that makes no sense, the connection is dropped.
+        bool handle(const std::string& line);
+        bool apply(const std::string& command);
+        void write(std::string data);
+        void send_ack();
+
+        asio::ip::tcp::resolver resolver_;
+        asio::ip::tcp::socket socket_;
+        asio::steady_timer timer_;
+        std::string host_;
+        std::string port_;
+        IStorage& storage_;
+
+        enum { max_length = 65536 };
+        std::array<char, max_length> buffer_{};
+        /// Start of a line that is not complete yet.
+        std::string pending_;
+        std::string output_;
+        bool writing_ = false;
+        bool ack_pending_ = false;
+        uint64_t ack_sent_ = 0;
+        bool stopped_ = false;
+
+        mutable std::mutex m_;
+        State state_ = State::Connecting;
+        /// Epoch of the primary, 0 until a snapshot is complete.
+        uint64_t epoch_ = 0;
+        uint64_t applied_ = 0;
+        /// Epoch and lsn of the snapshot being received.
+        uint64_t snapshot_epoch_ = 0;
+        uint64_t snapshot_lsn_ = 0;
+        uint64_t primary_lsn_ = 0;
+};
@@ -0,0 +1,62 @@
+/**
+ * @file resultcache.h
+ * @brief Replies of the joins for unchanged tables
+ */
+
+#pragma once
+
+#include "storage.h"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/**
+ * @brief LRU cache of join replies keyed by the query and the table
+ *        versions it ran against.
+ *
+ * Versions only grow, so a reply for older versions is never asked
+ * for again: every query keeps one entry, replaced by the newer reply.
+ */
+class ResultCache
+{
+    public:
+        using Bytes = std::shared_ptr<const std::string>;
+
+        /// Total size of the cached replies, 0 disables the cache.
+        explicit ResultCache(size_t capacity);
+
+        ResultCache(const ResultCache&) = delete;
+        ResultCache& operator=(const ResultCache&) = delete;
+
+        /// Null when there is no reply for these versions.
+        Bytes find(const std::string& query, const versions_t& versions);
+        void insert(const std::string& query, const versions_t& versions,
+                    std::string reply);
+
+        size_t hits() const { return hits_; }
+        size_t misses() const { return misses_; }
+        size_t size() const;
+
+    private:
+        struct Entry
+        {
+            std::string query;
+            versions_t versions;
+            Bytes reply;
+        };
+        using lru_t = std::list<Entry>;
+
+        void erase(lru_t::iterator entry);
+
+        const size_t capacity_;
+        mutable std::mutex m_;
+        /// Most recently used first.
+        lru_t lru_;
+        std::unordered_map<std::string, lru_t::iterator> index_;
+        size_t size_ = 0;
+        std::atomic<size_t> hits_ { 0 };
+        std::atomic<size_t> misses_ { 0 };
+};
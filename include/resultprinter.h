@@ -1,5 +1,6 @@
 #pragma once
 
+#include "storage.h"
 #include <string>
 #include <memory>
 
@@ -9,6 +10,7 @@ class IResultPrinter
         IResultPrinter(const std::string& n) : name_(n) {}
         virtual ~IResultPrinter() {};
 
+        /// Reply without the final new line.
         virtual std::string print() const = 0;
 
         const std::string& name() const { return name_; }
@@ -22,49 +24,119 @@ using ResultPrinterUPtr = std::unique_ptr<IResultPrinter>;
 class InsertPrinter : public IResultPrinter
 {
     public:
-        InsertPrinter() : IResultPrinter(__func__) {}
-        std::string print() const override
-        {
-            return "InsertPrinter";
-        }
+        InsertPrinter(bool inserted = true, const std::string& id = std::string())
+            : IResultPrinter(__func__), inserted_(inserted), id_(id) {}
+        std::string print() const override;
+
+    private:
+        const bool inserted_;
+        const std::string id_;
 };
 
 class TruncatePrinter : public IResultPrinter
 {
     public:
-        TruncatePrinter() : IResultPrinter(__func__) {}
+        TruncatePrinter(bool truncated = true)
+            : IResultPrinter(__func__), truncated_(truncated) {}
+        std::string print() const override;
+
+    private:
+        const bool truncated_;
+};
+
+/**
+ * @brief One "id,a,b" line per record and OK.
+ */
+class TablePrinter : public IResultPrinter
+{
+    public:
+        TablePrinter(const std::string& n, result_table_t result)
+            : IResultPrinter(n), result_(std::move(result)) {}
+        std::string print() const override;
+
+    private:
+        const result_table_t result_;
+};
+
+class IntersectionPrinter : public TablePrinter
+{
+    public:
+        IntersectionPrinter(result_table_t result = result_table_t())
+            : TablePrinter(__func__, std::move(result)) {}
+};
+
+class SymmetricDifferencePrinter : public TablePrinter
+{
+    public:
+        SymmetricDifferencePrinter(result_table_t result = result_table_t())
+            : TablePrinter(__func__, std::move(result)) {}
+};
+
+class CountPrinter : public IResultPrinter
+{
+    public:
+        CountPrinter(size_t count) : IResultPrinter(__func__), count_(count) {}
         std::string print() const override
         {
-            return "TruncatePrinter";
+            return std::to_string(count_) + "\nOK";
         }
+
+    private:
+        const size_t count_;
 };
 
-class IntersectionPrinter : public IResultPrinter
+/**
+ * @brief "loaded,duplicates" line and OK.
+ */
+class LoadPrinter : public IResultPrinter
 {
     public:
-        IntersectionPrinter() : IResultPrinter(__func__) {}
+        LoadPrinter(const LoadResult& result)
+            : IResultPrinter(__func__), result_(result) {}
         std::string print() const override
         {
-            return "IntersectionPrinter";
+            return std::to_string(result_.loaded) + ","
+                    + std::to_string(result_.duplicates) + "\nOK";
         }
+
+    private:
+        const LoadResult result_;
+};
+
+/**
+ * @brief "value,error" line and OK.
+ */
+class EstimatePrinter : public IResultPrinter
+{
+    public:
+        EstimatePrinter(const Estimate& estimate)
+            : IResultPrinter(__func__), estimate_(estimate) {}
+        std::string print() const override;
+
+    private:
+        const Estimate estimate_;
 };
 
-class SymmetricDifferencePrinter : public IResultPrinter
+class UnknownPrinter : public IResultPrinter
 {
     public:
-        SymmetricDifferencePrinter() : IResultPrinter(__func__) {}
+        UnknownPrinter() : IResultPrinter(__func__) {}
         std::string print() const override
         {
-            return "SymmetricDifferencePrinter";
+            return "ERR unknown command";
         }
 };
 
-class UnknownPrinter : public IResultPrinter
+class ErrorPrinter : public IResultPrinter
 {
     public:
-        UnknownPrinter() : IResultPrinter(__func__) {}
+        ErrorPrinter(const std::string& message)
+            : IResultPrinter(__func__), message_(message) {}
         std::string print() const override
         {
-            return "UnknownPrinter";
+            return "ERR " + message_;
         }
+
+    private:
+        const std::string message_;
 };
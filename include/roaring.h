@@ -0,0 +1,120 @@
+/**
+ * @file roaring.h
+ * @brief Roaring containers: the low 16 bits of the ids of one chunk
+ *
+ * A container holds a sorted array while it has at most 4096 values,
+ * a 65536 bit bitmap above that, and runs when run_optimize() finds
+ * them smaller. The set operations work on the containers directly,
+ * two bitmaps are combined a word at a time.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class RoaringContainer
+{
+    public:
+        enum class Type : uint8_t { Array, Bitmap, Run };
+        enum : size_t { array_max = 4096, bitmap_words = 1024 };
+
+        RoaringContainer() = default;
+
+        /// False when the value is already there.
+        bool add(uint16_t value);
+        bool contains(uint16_t value) const;
+        /// Number of values below value.
+        size_t rank(uint16_t value) const;
+
+        size_t cardinality() const { return cardinality_; }
+        Type type() const { return type_; }
+        /// Bytes used by the values.
+        size_t memory() const;
+
+        /// Switches to runs when they take less memory.
+        void run_optimize();
+
+        /// Calls f(uint16_t) in ascending order until it returns false.
+        template <typename F>
+        bool for_each(F f) const;
+
+        static RoaringContainer intersect(const RoaringContainer& a,
+                                          const RoaringContainer& b);
+        static RoaringContainer symmetric_difference(const RoaringContainer& a,
+                                                     const RoaringContainer& b);
+        static size_t intersect_cardinality(const RoaringContainer& a,
+                                            const RoaringContainer& b);
+
+        /**
+         * @brief Ranks of ascending values of one container, amortized
+         *        constant time for a walk through the container.
+         */
+        class RankCursor
+        {
+            public:
+                explicit RankCursor(const RoaringContainer& c) : c_(c) {}
+                /// Values must come in ascending order.
+                size_t rank(uint16_t value);
+
+            private:
+                const RoaringContainer& c_;
+                size_t pos_ = 0;
+                size_t acc_ = 0;
+        };
+
+    private:
+        void to_words(uint64_t* words) const;
+        static RoaringContainer from_words(const uint64_t* words);
+        void to_bitmap();
+        void to_array();
+        /// Number of runs starting at or below value.
+        size_t runs_before(uint16_t value) const;
+        /// add() of a run container, the value joins or extends the runs.
+        bool add_run(uint16_t value);
+
+        Type type_ = Type::Array;
+        uint32_t cardinality_ = 0;
+        /// Array: the values, Run: start and length - 1 of every run.
+        std::vector<uint16_t> values_;
+        /// Bitmap: bitmap_words words.
+        std::vector<uint64_t> bitmap_;
+};
+
+template <typename F>
+bool RoaringContainer::for_each(F f) const
+{
+    switch (type_) {
+    case Type::Array:
+        for (auto v : values_) {
+            if (!f(v)) {
+                return false;
+            }
+        }
+        break;
+    case Type::Bitmap:
+        for (size_t i = 0; i < bitmap_words; ++i) {
+            uint64_t word = bitmap_[i];
+            while (word) {
+                const auto v = static_cast<uint16_t>(i * 64 + __builtin_ctzll(word));
+                if (!f(v)) {
+                    return false;
+                }
+                word &= word - 1;
+            }
+        }
+        break;
+    case Type::Run:
+        for (size_t i = 0; i < values_.size(); i += 2) {
+            const uint32_t end = uint32_t(values_[i]) + values_[i + 1];
+            for (uint32_t v = values_[i]; v <= end; ++v) {
+                if (!f(static_cast<uint16_t>(v))) {
+                    return false;
+                }
+            }
+        }
+        break;
+    }
+    return true;
+}
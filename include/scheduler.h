@@ -0,0 +1,102 @@
+/**
+ * @file scheduler.h
+ * @brief Admission control for the heavy commands
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+struct SchedulerConfig
+{
+    /// Heavy commands running at the same time.
+    size_t max_running = 2;
+    /// Heavy commands waiting for a worker, the next one gets ERR busy.
+    size_t max_queued = 64;
+    /// Waiting and running heavy commands of one client.
+    size_t max_per_client = 4;
+    /// Weight of a new client.
+    unsigned client_weight = 1;
+    /// Highest weight a client may ask for with WEIGHT.
+    unsigned max_weight = 8;
+};
+
+/**
+ * @brief Runs the heavy commands on a few worker threads.
+ *
+ * The clients share the workers by start-time fair queueing: a job is
+ * tagged with max(virtual time, finish tag of the client's previous
+ * job) and the smallest tag runs first, so a client that floods the
+ * queue only delays itself. A client of weight 2 gets twice the turns
+ * of a client of weight 1.
+ */
+class Scheduler
+{
+    public:
+        using Job = std::function<void()>;
+
+        /// Per client state, owned by the session.
+        struct Client
+        {
+            explicit Client(unsigned w) : weight(w) {}
+
+            /// Changed under the lock of the scheduler.
+            unsigned weight;
+            double finish = 0;
+            size_t pending = 0;
+        };
+        using ClientPtr = std::shared_ptr<Client>;
+
+        explicit Scheduler(const SchedulerConfig& config = SchedulerConfig());
+        ~Scheduler();
+
+        Scheduler(const Scheduler&) = delete;
+        Scheduler& operator=(const Scheduler&) = delete;
+
+        /// Weight 0 takes the client_weight of the config.
+        ClientPtr add_client(unsigned weight = 0);
+        /// False for 0 or above max_weight, the next jobs of the client
+        /// are tagged with the new weight.
+        bool set_weight(const ClientPtr& client, unsigned weight);
+        /// False when the queue or the client's quota is full, the job
+        /// is dropped then. Otherwise it runs on a worker thread.
+        bool submit(const ClientPtr& client, Job job);
+        /// Drops the waiting jobs and joins the workers.
+        void stop();
+
+        size_t queued() const;
+
+    private:
+        struct Entry
+        {
+            double start;
+            uint64_t seq;
+            ClientPtr client;
+            Job job;
+        };
+        struct Later
+        {
+            bool operator()(const Entry& l, const Entry& r) const
+            {
+                return l.start > r.start || (l.start == r.start && l.seq > r.seq);
+            }
+        };
+
+        void work();
+
+        const SchedulerConfig config_;
+        mutable std::mutex m_;
+        std::condition_variable cv_;
+        std::priority_queue<Entry, std::vector<Entry>, Later> queue_;
+        double virtual_time_ = 0;
+        uint64_t seq_ = 0;
+        bool stopped_ = false;
+        std::vector<std::thread> workers_;
+};
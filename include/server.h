@@ -1,17 +1,66 @@
 #pragma once
 
+#include "bufferpool.h"
+#include "commandparser.h"
 #include "processor.h"
+#include "handlerallocator.h"
 #include <asio.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <set>
 #include <vector>
 
-class IStorage;
 class IProcessor;
+class SessionManager;
+
+struct ServerConfig
+{
+    /// Close a session that sent no command for this long.
+    std::chrono::seconds idle_timeout { 300 };
+    /// Close a session that started a command and did not finish it.
+    std::chrono::seconds read_timeout { 30 };
+    /// Connections above the limit are answered with an error and closed.
+    size_t max_connections = 10000;
+    /// How long SIGTERM waits for the sessions to finish.
+    std::chrono::seconds drain_timeout { 10 };
+    /// Changes queued for a SUBSCRIBE client, it is dropped above that.
+    size_t subscriber_queue = 65536;
+    /// Bytes of replies queued for a client above which its commands are
+    /// not read until half of them are sent.
+    size_t output_high_water = 1 << 20;
+    /// TCP_NODELAY, a reply goes out without waiting for the ACK of the
+    /// previous one.
+    bool no_delay = true;
+    /// TCP_CORK while replies are queued, partial segments wait for the
+    /// next reply until the queue is empty. Linux only.
+    bool cork = false;
+};
+
+/**
+ * @brief Connection of one of the protocols, kept by the SessionManager.
+ */
+class ISession
+{
+    public:
+        virtual ~ISession() {}
+
+        virtual void start() = 0;
+        virtual void stop() = 0;
+        /// Finish the writes in flight, then stop.
+        virtual void drain() = 0;
+};
+
+using SessionPtr = std::shared_ptr<ISession>;
 
 class Session
-    : public std::enable_shared_from_this<Session>
+    : public ISession
+    , public std::enable_shared_from_this<Session>
 {
     public:
-        Session(asio::ip::tcp::socket socket, IStorage& storage);
+        Session(asio::ip::tcp::socket socket, const ProcessorContext& context,
+                SessionManager& manager, const ServerConfig& config,
+                BufferPoolPtr pool);
         ~Session();
 
         Session(const Session&) = delete;
@@ -19,37 +68,143 @@ class Session
         Session& operator=(const Session&) = delete;
         Session& operator=(Session&&) = delete;
 
-        void start();
+        void start() override;
+        void stop() override;
+        void drain() override;
 
     private:
+        /// Waits for the socket without a buffer when nothing is pending,
+        /// reads right away otherwise.
         void do_read();
+        /// Read whatever the socket has into the free end of the buffer.
+        void read_some();
+        /// Run the buffered commands one at a time, read when a line is
+        /// incomplete.
+        void process_input();
+        /// The next command is parsed once the reply is queued.
+        void process();
+        void read_next();
+        /// Queue a reply, starts writing unless a write is in flight.
+        void deliver(std::string reply);
+        /// Writes the queued replies at once.
         void do_write();
+        void set_cork(bool on);
+        void arm_timer();
+        /// SUBSCRIBE and UNSUBSCRIBE, the reply to the command.
+        std::string subscribe();
+        /// Writes the queued changes once the replies are out.
+        void pump_changes();
 
         asio::ip::tcp::socket socket_;
+        asio::steady_timer timer_;
+        /// Longest command line.
         enum { max_length = 8192 };
+        static_assert(size_t(BufferPool::max_size) > max_length, "a line fits in a buffer");
+        /// Bytes of changes per write.
+        enum { max_changes = 65536 };
 
-        /// Buffer for incoming data.
-        std::array<char, max_length> buffer_{};
-        /// The reply to be sent back to the client.
-        std::string reply_;
-        asio::streambuf streambuf_;
-        void prompt();
+        /// Buffer for incoming data, [begin_, end_) is not parsed yet. It
+        /// goes back to the pool whenever everything read is parsed.
+        BufferPoolPtr pool_;
+        BufferPool::Buffer buffer_;
+        size_t begin_ = 0;
+        size_t end_ = 0;
+        /// Size of the next buffer, doubled by reads that fill the buffer
+        /// and halved by reads that use less than a quarter of it.
+        size_t want_ = BufferPool::min_size;
+        CommandParser parser_ { max_length };
+        /// Tokens of the command being run, reused between the commands.
+        std::string verb_;
+        arguments_t args_;
+        /// Replies waiting to be sent, the first in_flight_ are being
+        /// written.
+        std::deque<std::string> write_queue_;
+        std::vector<asio::const_buffer> write_buffers_;
+        size_t in_flight_ = 0;
+        size_t queued_bytes_ = 0;
+        /// Buffers of one gather write.
+        enum { max_write_buffers = 64 };
+
+        HandlerMemory read_memory_;
+        HandlerMemory write_memory_;
+        HandlerMemory timer_memory_;
 
         ProcessorUPtr processor;
+        IStorage& storage_;
+        /// The rows of the join, then its changes, pushed to the client; null
+        /// until SUBSCRIBE.
+        SubscriptionPtr subscription_;
+        SessionManager& manager_;
+        const ServerConfig& config_;
+        bool draining_ = false;
+        /// A heavy command is waiting for its reply.
+        bool busy_ = false;
+        /// Inside execute(), an inline reply does not parse the next command.
+        bool executing_ = false;
+        /// The replies reached the high water, reading waits for the writes.
+        bool output_full_ = false;
 };
 
-class Server
+/**
+ * @brief Keeps the live sessions so that they can be counted and
+ *        drained when the server shuts down.
+ */
+class SessionManager
+{
+    public:
+        SessionManager() = default;
+        SessionManager(const SessionManager&) = delete;
+        SessionManager& operator=(const SessionManager&) = delete;
+
+        void start(SessionPtr session);
+        void stop(SessionPtr session);
+        /// Drain every session, on_drained runs once the last one is gone.
+        void drain_all(std::function<void()> on_drained);
+        void stop_all();
+
+        size_t size() const { return sessions_.size(); }
+
+    private:
+        std::set<SessionPtr> sessions_;
+        std::function<void()> on_drained_;
+};
+
+/**
+ * @brief Transport front of the storage, asio or io_uring.
+ */
+class IServer
+{
+    public:
+        virtual ~IServer() {}
+
+        /// Stop accepting and let the sessions finish.
+        virtual void drain(std::function<void()> on_drained) = 0;
+        virtual void stop() = 0;
+};
+
+class Server : public IServer
 {
     public:
         Server(asio::io_service& io_service,
-               short port, IStorage& storage);
+               unsigned short port, const ProcessorContext& context,
+               const ServerConfig& config = ServerConfig());
+
+        void drain(std::function<void()> on_drained) override;
+        void stop() override;
+
+        /// The port listened on, chosen by the system for port 0.
+        unsigned short port() const { return acceptor_.local_endpoint().port(); }
 
     private:
         void do_accept();
+        void reject(asio::ip::tcp::socket& socket);
 
         asio::ip::tcp::acceptor acceptor_;
         asio::ip::tcp::socket socket_;
-        std::vector<std::shared_ptr<Session>> session_;
+        SessionManager manager_;
+        /// Outlives the server when sessions still wait in the io_service.
+        BufferPoolPtr pool_ = std::make_shared<BufferPool>();
 
-        IStorage& storage_;
+        const ProcessorContext context_;
+        const ServerConfig config_;
 };
@@ -0,0 +1,41 @@
+/**
+ * @file sketch.h
+ * @brief HyperLogLog sketch of the ids of a table
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Estimated cardinality with its error bound, the true value is
+ *        within value +- error with about 95% probability.
+ */
+struct Estimate
+{
+    double value;
+    double error;
+};
+
+class HyperLogLog
+{
+    public:
+        /// 2^precision registers of one byte.
+        explicit HyperLogLog(unsigned precision = 14);
+
+        /// The value is mixed before use, ids can be passed as they are.
+        void add(uint64_t value);
+        void clear();
+        /// Registers of the union of both sets.
+        void merge(const HyperLogLog& other);
+
+        double estimate() const;
+        /// Relative standard error, 1.04 / sqrt(registers).
+        double standard_error() const;
+
+    private:
+        const unsigned precision_;
+        std::vector<uint8_t> registers_;
+};
@@ -1,86 +1,393 @@
 #pragma once
 
+#include "bulkfile.h"
+#include "mutationlog.h"
+#include "reclaimer.h"
+#include "sketch.h"
+#include "table.h"
+#include <cstdint>
+#include <functional>
+#include <limits>
 #include <string>
 #include <vector>
 #include <map>
-#include <set>
+#include <memory>
 #include <mutex>
 
-struct Record;
-struct ResultRecord;
-
-using table_t = std::set<Record>;
-using tables_t = std::vector<table_t>;
-using result_table_t = std::set<ResultRecord>;
-using names_t = std::map<std::string, table_t&>;
-using keys_table_t = std::vector<int>;
-using keys_tables_t = std::vector<keys_table_t>;
-using lock_t = std::lock_guard<std::mutex>;
-
-struct Record
+template <typename Key>
+struct BasicRecord
 {
-    int id;
+    Key id;
     std::string name;
 
-    Record(int key, const char* value) : id(key), name(value) {}
-    Record(int key, const std::string& value) : id(key), name(value) {}
+    BasicRecord(const Key& key, const char* value) : id(key), name(value) {}
+    BasicRecord(const Key& key, const std::string& value) : id(key), name(value) {}
 
-    friend bool operator<(const Record& l, const Record& r) {
+    friend bool operator<(const BasicRecord& l, const BasicRecord& r) {
         return l.id < r.id;
     }
 };
 
-struct ResultRecord
+template <typename Key>
+struct BasicResultRecord
 {
-    int id;
+    Key id;
     std::vector<std::string> fields;
 
-    ResultRecord() = delete;
-    ResultRecord(size_t n) : id(0), fields(n) {}
+    BasicResultRecord() = delete;
+    BasicResultRecord(size_t n) : id(), fields(n) {}
 
-    friend bool operator<(const ResultRecord& l, const ResultRecord& r) {
+    friend bool operator<(const BasicResultRecord& l, const BasicResultRecord& r) {
         return l.id < r.id;
     }
 };
 
+using Record = BasicRecord<int>;
+using ResultRecord = BasicResultRecord<int>;
+
+/**
+ * @brief Rows of a join whatever the key type is.
+ */
+class IResultTable
+{
+    public:
+        virtual ~IResultTable() {}
+
+        virtual size_t size() const = 0;
+        /// Appends an "id,a,b" line per row.
+        virtual void print(std::string& out) const = 0;
+        /// Appends the rows [begin, end) as {"id":..,"a":..,"b":..} objects,
+        /// comma separated as in a JSON array or one per line for NDJSON.
+        /// A missing name is null.
+        virtual void print_json(std::string& out, size_t begin, size_t end,
+                                bool ndjson) const = 0;
+};
+
+template <typename Key>
+class ResultTable : public IResultTable
+{
+    public:
+        /// In the order of the join, see JoinOrder.
+        using rows_t = std::vector<BasicResultRecord<Key>>;
+
+        size_t size() const override { return rows_.size(); }
+        void print(std::string& out) const override;
+        void print_json(std::string& out, size_t begin, size_t end,
+                        bool ndjson) const override;
+
+        rows_t& rows() { return rows_; }
+        const rows_t& rows() const { return rows_; }
+
+    private:
+        rows_t rows_;
+};
+
+template <typename Key>
+using table_t = Table<Key>;
+using result_table_t = std::shared_ptr<const IResultTable>;
+/// Dense index of a table, resolved from its name once per command.
+using table_handle_t = size_t;
+const table_handle_t no_table = std::numeric_limits<table_handle_t>::max();
+using lock_t = std::lock_guard<std::mutex>;
+/// Per table counters bumped by every change.
+using versions_t = std::vector<uint64_t>;
+
+/// Order of the rows of a join, Any lets the storage join partitions
+/// in parallel and return their rows as they finish.
+enum class JoinOrder { Asc, Desc, Any };
+
+/**
+ * @brief Slice of a join: ids in [from, to), at most limit rows after
+ *        skipping offset of them, offset counts from the end for Desc.
+ */
+struct JoinRange
+{
+    int64_t from = std::numeric_limits<int64_t>::min();
+    int64_t to = std::numeric_limits<int64_t>::max();
+    /// Without TO the ids are not bounded above.
+    bool has_to = false;
+    size_t limit = std::numeric_limits<size_t>::max();
+    size_t offset = 0;
+    JoinOrder order = JoinOrder::Asc;
+};
+
+enum class JoinKind { Intersection, SymmetricDifference };
+
+/// Rows added by LOAD and rows skipped as duplicates.
+struct LoadResult
+{
+    size_t loaded;
+    size_t duplicates;
+};
+
+/// Change buffered by a transaction, an INSERT or a TRUNCATE.
+struct Write
+{
+    table_handle_t table;
+    bool truncate;
+    std::string id;
+    std::string name;
+};
+
+/// Changes of a transaction in the order they were made.
+using WriteSet = std::vector<Write>;
+
+/**
+ * @brief Snapshot of the tables as the commands that rebuild them: per
+ *        table a "TRUNCATE table" line and an "INSERT table id name" line
+ *        per row, a piece at a time.
+ */
+class IDump
+{
+    public:
+        virtual ~IDump() {}
+
+        /// Appends lines until out holds about max_bytes, false when
+        /// nothing is left.
+        virtual bool next(std::string& out, size_t max_bytes) = 0;
+};
+
+using DumpUPtr = std::unique_ptr<IDump>;
+
+class Subscription;
+using SubscriptionPtr = std::shared_ptr<Subscription>;
+using SubscriptionNotify = std::function<void()>;
+
+/**
+ * @brief Names of the tables and their handles. The tables are fixed
+ *        when the storage is built, the lookups need no lock.
+ */
+class TableCatalog
+{
+    public:
+        /// The handle of the new table.
+        table_handle_t add(const std::string& name);
+        /// no_table when there is no such table.
+        table_handle_t find(const std::string& name) const;
+        const std::string& name(table_handle_t table) const { return names_[table]; }
+        size_t size() const { return names_.size(); }
+
+    private:
+        std::vector<std::string> names_;
+};
+
 class IStorage
 {
     public:
         virtual ~IStorage() {}
 
         virtual size_t n_tables() const = 0;
+        virtual versions_t versions() const = 0;
+        /// The tables are in other processes, every command may wait on
+        /// the network.
+        virtual bool remote() const { return false; }
 
+        /// The id parses as the key type of the tables.
+        virtual bool valid_key(const std::string& id) const = 0;
+        /// Handle of the table for insert() and truncate(), no_table when
+        /// there is none.
+        virtual table_handle_t find_table(const std::string& name) const = 0;
         // INSERT table id name
-        virtual bool insert(const std::string& table,
-                            int id, const std::string& name) = 0;
+        virtual bool insert(table_handle_t table,
+                            const std::string& id, const std::string& name) = 0;
         // TRUNCATE table
-        virtual bool truncate(const std::string& table) = 0;
-        // INTERSECTION
-        virtual result_table_t intersection() const = 0;
-        // SYMMETRIC_DIFFERENCE
-        virtual result_table_t symmetric_difference() const = 0;
+        virtual bool truncate(table_handle_t table) = 0;
+        /// @name By the name of the table, false for an unknown one
+        /// @{
+        bool insert(const std::string& table, const std::string& id, const std::string& name)
+        {
+            return insert(find_table(table), id, name);
+        }
+        bool truncate(const std::string& table) { return truncate(find_table(table)); }
+        /// @}
+        // COMMIT
+        /// Makes the changes in order under one lock, the joins see none
+        /// or all of them. The rows of the ids already taken count as
+        /// duplicates.
+        virtual LoadResult apply(const WriteSet& writes) = 0;
+        // LOAD table path [FORMAT csv|bin]
+        virtual LoadResult load(const std::string& table, const std::string& path,
+                                FileFormat format) = 0;
+        // EXPORT INTERSECTION|SYMMETRIC_DIFFERENCE path [FORMAT csv|bin]
+        virtual size_t export_join(JoinKind kind, const std::string& path,
+                                   FileFormat format) const = 0;
+        // EXPORT TABLE table path [FORMAT csv|bin]
+        virtual size_t export_table(const std::string& table, const std::string& path,
+                                    FileFormat format) const = 0;
+        /// Every change is appended to the log from now on, none when
+        /// the log is null.
+        virtual void set_log(MutationLog* log) = 0;
+        /// Snapshot of the tables, lsn is the last entry of the log that
+        /// it includes.
+        virtual DumpUPtr dump(uint64_t& lsn) const = 0;
+        // SUBSCRIBE INTERSECTION|SYMMETRIC_DIFFERENCE
+        /// The rows of the join as "+" lines, then its changes, see
+        /// Subscription. The storage forgets the subscription once it is
+        /// released.
+        virtual SubscriptionPtr subscribe(JoinKind kind, size_t max_queued,
+                                          SubscriptionNotify notify) = 0;
+        // INTERSECTION [FROM lo] [TO hi] [LIMIT n] [OFFSET m]
+        virtual result_table_t intersection(const JoinRange& range) const = 0;
+        // SYMMETRIC_DIFFERENCE [FROM lo] [TO hi] [LIMIT n] [OFFSET m]
+        virtual result_table_t symmetric_difference(const JoinRange& range) const = 0;
+        // INTERSECTION ... COUNT
+        virtual size_t intersection_count(const JoinRange& range) const = 0;
+        // SYMMETRIC_DIFFERENCE ... COUNT
+        virtual size_t symmetric_difference_count(const JoinRange& range) const = 0;
+        // INTERSECTION ESTIMATE
+        virtual Estimate intersection_estimate() const = 0;
+        // SYMMETRIC_DIFFERENCE ESTIMATE
+        virtual Estimate symmetric_difference_estimate() const = 0;
 };
 
-class Storage : public IStorage
+using StorageUPtr = std::unique_ptr<IStorage>;
+
+/**
+ * @brief Tables A and B keyed by Key.
+ *
+ * Instantiated for int32_t, int64_t and std::string, the joins are
+ * specialized per key type. Both tables share the key type so that
+ * they can be joined.
+ */
+template <typename Key>
+class BasicStorage : public IStorage
 {
     public:
-        Storage();
+        /// LOAD and EXPORT use files of data_dir only, none when it is empty.
+        explicit BasicStorage(const std::string& data_dir = std::string());
 
         size_t n_tables() const override { return tables_.size(); }
+        versions_t versions() const override;
 
-        bool insert(const std::string& table,
-                    int id, const std::string& name) override;
-        bool truncate(const std::string& table) override;
-        result_table_t intersection() const override;
-        result_table_t symmetric_difference() const override;
+        bool valid_key(const std::string& id) const override;
+        table_handle_t find_table(const std::string& name) const override
+        {
+            return catalog_.find(name);
+        }
+        using IStorage::insert;
+        using IStorage::truncate;
+        bool insert(table_handle_t table,
+                    const std::string& id, const std::string& name) override;
+        template <typename K>
+        bool insert(const std::string& table, const K& id, const std::string& name)
+        {
+            return insert_key(catalog_.find(table), Key(id), name);
+        }
+        bool truncate(table_handle_t table) override;
+        LoadResult apply(const WriteSet& writes) override;
+        LoadResult load(const std::string& table, const std::string& path,
+                        FileFormat format) override;
+        /// Exports write a snapshot of the tables, the lock is held only
+        /// while the tables are copied.
+        size_t export_join(JoinKind kind, const std::string& path,
+                           FileFormat format) const override;
+        size_t export_table(const std::string& table, const std::string& path,
+                            FileFormat format) const override;
+        void set_log(MutationLog* log) override;
+        DumpUPtr dump(uint64_t& lsn) const override;
+        SubscriptionPtr subscribe(JoinKind kind, size_t max_queued,
+                                  SubscriptionNotify notify) override;
+        result_table_t intersection(const JoinRange& range) const override;
+        result_table_t symmetric_difference(const JoinRange& range) const override;
+        size_t intersection_count(const JoinRange& range) const override;
+        size_t symmetric_difference_count(const JoinRange& range) const override;
+        Estimate intersection_estimate() const override;
+        Estimate symmetric_difference_estimate() const override;
 
     private:
-        tables_t tables_;
-        names_t names_;
+        const std::string data_dir_;
+        std::vector<Table<Key>> tables_;
+        TableCatalog catalog_;
+        versions_t versions_;
+        /// Sketch of the ids of every table, the joins are estimated
+        /// from the union of the sketches and the exact table sizes.
+        std::vector<HyperLogLog> sketches_;
         mutable std::mutex m_;
+        /// Frees truncated tables outside of the lock.
+        Reclaimer reclaimer_;
+        MutationLog* log_ = nullptr;
+        /// Released subscriptions are dropped by the next change.
+        std::vector<std::weak_ptr<Subscription>> subscribers_;
 
+        bool insert_key(table_handle_t table, const Key& id, const std::string& name);
+        /// @name Changes under the lock, the caller bumps the version
+        /// @{
+        bool insert_locked(table_handle_t table, const Key& id, const std::string& name);
+        /// The old rows, for the reclaimer once the lock is released.
+        std::shared_ptr<Table<Key>> truncate_locked(table_handle_t table);
+        /// @}
+        /// The path within data_dir_, throws for paths that leave it.
+        std::string data_path(const std::string& path) const;
+        /// Copy of the tables, the chunks are shared until they change.
+        std::vector<Table<Key>> snapshot() const;
+        /// f(tables) on a snapshot when copies are cheap, so that the joins
+        /// run outside of the lock, and under the lock otherwise.
+        template <typename F>
+        auto read_tables(F f) const;
+        /// Logs "INSERT table id name" when there is a log.
+        void log_insert(table_handle_t table, const Key& id, const std::string& name);
+        /// Pushes the changes of the joins when the id goes into the table.
+        void publish_insert(size_t index, const Key& id, const std::string& name);
+        /// Pushes the changes of the joins when the table is emptied, old
+        /// holds its rows.
+        void publish_truncate(size_t index, const std::shared_ptr<const Table<Key>>& old);
         void add_table(const char* name);
-        std::tuple<std::string, bool> find_name(const table_t& data, int key) const;
-        void extract_keys(keys_tables_t& table_keys) const;
-        void fill_result(keys_table_t& keys_ab, result_table_t& result) const;
+        /// |A | B| with its error, clamped to what the sizes allow.
+        Estimate union_estimate() const;
 };
+
+using Storage = BasicStorage<int32_t>;
+
+StorageUPtr make_storage(KeyType key_type, const std::string& data_dir = std::string());
+
+namespace detail {
+
+inline void append_key(std::string& out, const std::string& id) { out.append(id); }
+inline void append_key(std::string& out, int64_t id) { out.append(std::to_string(id)); }
+
+/// The text as a quoted JSON string.
+void append_json(std::string& out, const std::string& text);
+inline void append_json_key(std::string& out, const std::string& id) { append_json(out, id); }
+inline void append_json_key(std::string& out, int64_t id) { append_key(out, id); }
+
+} // namespace detail
+
+template <typename Key>
+void ResultTable<Key>::print(std::string& out) const
+{
+    for (const auto& r : rows_) {
+        detail::append_key(out, r.id);
+        for (const auto& field : r.fields) {
+            out.push_back(',');
+            out.append(field);
+        }
+        out.push_back('\n');
+    }
+}
+
+template <typename Key>
+void ResultTable<Key>::print_json(std::string& out, size_t begin, size_t end,
+                                  bool ndjson) const
+{
+    static const char* const columns[] = { ",\"a\":", ",\"b\":" };
+    for (size_t i = begin; i < end && i < rows_.size(); ++i) {
+        if (i > 0 && !ndjson) {
+            out.push_back(',');
+        }
+        out.append("{\"id\":");
+        detail::append_json_key(out, rows_[i].id);
+        for (size_t f = 0; f < rows_[i].fields.size() && f < 2; ++f) {
+            out.append(columns[f]);
+            if (rows_[i].fields[f].empty()) {
+                out.append("null");
+            }
+            else {
+                detail::append_json(out, rows_[i].fields[f]);
+            }
+        }
+        out.push_back('}');
+        if (ndjson) {
+            out.push_back('\n');
+        }
+    }
+}
@@ -0,0 +1,71 @@
+/**
+ * @file subscription.h
+ * @brief Changes of a join pushed to a subscriber
+ */
+
+#pragma once
+
+#include "storage.h"
+#include <deque>
+
+/**
+ * @brief Bounded queue of the changes of a join for one subscriber:
+ *        "+id,a,b" when a row enters the join or changes, "-id" when it
+ *        leaves.
+ *
+ * The first item holds the rows of the join at the time of the
+ * subscription, as "+" lines, so that a subscriber holds the join by
+ * applying the lines in order. After "ERR slow subscriber" it subscribes
+ * again and starts over.
+ *
+ * The storage pushes under its own lock, in the order of the changes.
+ * The changes of a TRUNCATE are pushed as one item and written out when
+ * they are taken. A subscriber that lets max_queued items pile up is
+ * dropped, take() tells it once.
+ */
+class Subscription
+{
+    public:
+        /// Called on the thread of the change when the queue stops being
+        /// empty, and on overflow.
+        using Notify = SubscriptionNotify;
+
+        Subscription(JoinKind kind, size_t max_queued, Notify notify);
+
+        Subscription(const Subscription&) = delete;
+        Subscription& operator=(const Subscription&) = delete;
+
+        JoinKind kind() const { return kind_; }
+
+        /// @name Called by the storage
+        /// @{
+        void push(std::string line);
+        void push(DumpUPtr lines);
+        /// @}
+
+        /**
+         * @brief Appends the queued lines until out holds about max_bytes,
+         *        one consumer at a time.
+         * @return False once the queue overflowed, nothing is queued then.
+         */
+        bool take(std::string& out, size_t max_bytes);
+
+    private:
+        struct Item
+        {
+            std::string line;
+            DumpUPtr lines;
+        };
+
+        void push(Item item);
+
+        const JoinKind kind_;
+        const size_t max_queued_;
+        const Notify notify_;
+
+        std::mutex m_;
+        std::deque<Item> queue_;
+        bool overflow_ = false;
+        /// The consumer was told about the queued items.
+        bool notified_ = false;
+};
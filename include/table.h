@@ -0,0 +1,167 @@
+/**
+ * @file table.h
+ * @brief Tables of unique ids with a name each
+ */
+
+#pragma once
+
+#include "roaring.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Unsigned 32-bit ids split into 64K chunks by their high 16
+ *        bits, each chunk keeps the low bits in a Roaring container.
+ *
+ * The names of a chunk are stored in insertion order, slots maps the
+ * rank of an id in the container to its name.
+ *
+ * Chunks are shared between copies of a table and copied on the first
+ * write, so that a copy is a cheap snapshot.
+ */
+class IdTable
+{
+    public:
+        struct Chunk
+        {
+            uint16_t key;
+            RoaringContainer ids;
+            std::vector<uint16_t> slots;
+            std::vector<std::string> names;
+
+            uint32_t base() const { return uint32_t(key) << 16; }
+            const std::string& name_at(size_t rank) const { return names[slots[rank]]; }
+        };
+        using ChunkPtr = std::shared_ptr<Chunk>;
+        using chunks_t = std::vector<ChunkPtr>;
+
+        /// False when the id is already there.
+        bool insert(uint32_t id, const std::string& name);
+        /// Bulk insert, the id is above every id of the table.
+        void append(uint32_t id, std::string name);
+        void clear();
+        /// Null when there is no such id.
+        const std::string* find(uint32_t id) const;
+
+        size_t size() const { return size_; }
+        /// Bytes used by the ids and the slots, without the names.
+        size_t id_memory() const;
+
+        /// Converts the chunks to runs where they are smaller.
+        void run_optimize();
+
+        const chunks_t& chunks() const { return chunks_; }
+
+    private:
+        chunks_t::iterator chunk(uint16_t key);
+        /// The chunk, copied first when a snapshot shares it.
+        Chunk& writable(ChunkPtr& c);
+
+        chunks_t chunks_;
+        size_t size_ = 0;
+};
+
+enum class KeyType { Int32, Int64, String };
+
+/**
+ * @brief Table keyed by Key, the joins are specialized per key type.
+ *
+ * append() is the bulk insert of LOAD, the ids come in ascending order
+ * into an empty table and run_optimize() follows.
+ */
+template <typename Key>
+class Table;
+
+/**
+ * @brief 32-bit ids, the sign bit is flipped so that the negative ids
+ *        come first in the IdTable.
+ */
+template <>
+class Table<int32_t>
+{
+    public:
+        /// Copies share the chunks until they change.
+        static const bool cheap_copy = true;
+
+        bool insert(int32_t id, const std::string& name) { return ids_.insert(encode(id), name); }
+        void append(int32_t id, std::string name) { ids_.append(encode(id), std::move(name)); }
+        void run_optimize() { ids_.run_optimize(); }
+        void clear() { ids_.clear(); }
+        const std::string* find(int32_t id) const { return ids_.find(encode(id)); }
+        size_t size() const { return ids_.size(); }
+
+        const IdTable& ids() const { return ids_; }
+
+        static uint32_t encode(int32_t id) { return uint32_t(id) ^ 0x80000000u; }
+        static int32_t decode(uint32_t u) { return static_cast<int32_t>(u ^ 0x80000000u); }
+
+    private:
+        IdTable ids_;
+};
+
+/**
+ * @brief 64-bit ids, one IdTable of the low halves per high half.
+ */
+template <>
+class Table<int64_t>
+{
+    public:
+        struct Part
+        {
+            uint32_t high;
+            IdTable ids;
+        };
+
+        /// Copies share the chunks until they change.
+        static const bool cheap_copy = true;
+
+        bool insert(int64_t id, const std::string& name);
+        void append(int64_t id, std::string name);
+        void run_optimize();
+        void clear();
+        const std::string* find(int64_t id) const;
+        size_t size() const { return size_; }
+
+        const std::vector<Part>& parts() const { return parts_; }
+
+        static uint64_t encode(int64_t id) { return uint64_t(id) ^ (uint64_t(1) << 63); }
+        static int64_t decode(uint64_t u) { return static_cast<int64_t>(u ^ (uint64_t(1) << 63)); }
+
+    private:
+        std::vector<Part> parts_;
+        size_t size_ = 0;
+};
+
+/**
+ * @brief String ids in byte order.
+ */
+template <>
+class Table<std::string>
+{
+    public:
+        using rows_t = std::map<std::string, std::string>;
+
+        /// A copy copies every row.
+        static const bool cheap_copy = false;
+
+        bool insert(const std::string& id, const std::string& name)
+        {
+            return rows_.emplace(id, name).second;
+        }
+        void append(const std::string& id, std::string name)
+        {
+            rows_.emplace_hint(rows_.end(), id, std::move(name));
+        }
+        void run_optimize() {}
+        void clear() { rows_.clear(); }
+        const std::string* find(const std::string& id) const;
+        size_t size() const { return rows_.size(); }
+
+        const rows_t& rows() const { return rows_; }
+
+    private:
+        rows_t rows_;
+};
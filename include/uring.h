@@ -0,0 +1,120 @@
+/**
+ * @file uring.h
+ * @brief Thin io_uring reactor on the raw system calls
+ *
+ * Only what the uring transport needs: one ring, provided buffers
+ * for receives and helpers that fill submission entries.
+ * Entries prepared with get_sqe() reach the kernel together on the
+ * next submit_and_wait().
+ */
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Uring
+{
+    public:
+        /// Throws std::system_error when the kernel refuses the ring.
+        explicit Uring(unsigned entries);
+        ~Uring();
+
+        Uring(const Uring&) = delete;
+        Uring& operator=(const Uring&) = delete;
+
+        /// Free zeroed entry, submits pending ones when the queue is full.
+        io_uring_sqe* get_sqe();
+        /// Hand prepared entries to the kernel, wait for wait_nr completions.
+        int submit_and_wait(unsigned wait_nr);
+
+        /// Calls f(const io_uring_cqe&) for every ready completion.
+        template <typename F>
+        unsigned for_each_cqe(F f)
+        {
+            unsigned head = *cq_head_;
+            const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            unsigned n = 0;
+            for (; head != tail; ++head, ++n) {
+                f(cqes_[head & cq_mask_]);
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            return n;
+        }
+
+        /// True when the kernel implements the opcode.
+        bool supports(unsigned opcode) const;
+
+        int fd() const { return fd_; }
+
+    private:
+        void release();
+
+        int fd_ = -1;
+
+        void* sq_ring_ = nullptr;
+        size_t sq_ring_size_ = 0;
+        void* cq_ring_ = nullptr;
+        size_t cq_ring_size_ = 0;
+        io_uring_sqe* sqes_ = nullptr;
+        size_t sqes_size_ = 0;
+
+        unsigned* sq_head_ = nullptr;
+        unsigned* sq_tail_ = nullptr;
+        unsigned sq_mask_ = 0;
+        unsigned sq_entries_ = 0;
+        /// Local tail, published to the kernel on submit.
+        unsigned sqe_tail_ = 0;
+
+        unsigned* cq_head_ = nullptr;
+        unsigned* cq_tail_ = nullptr;
+        unsigned cq_mask_ = 0;
+        io_uring_cqe* cqes_ = nullptr;
+};
+
+/**
+ * @brief Receive buffers handed to the kernel as a provided buffer
+ *        group, the kernel picks one per completed receive.
+ */
+class ProvidedBuffers
+{
+    public:
+        /// Throws std::system_error when the kernel refuses the buffers.
+        ProvidedBuffers(Uring& ring, uint16_t group, unsigned count, unsigned size,
+                        uint64_t user_data);
+
+        ProvidedBuffers(const ProvidedBuffers&) = delete;
+        ProvidedBuffers& operator=(const ProvidedBuffers&) = delete;
+
+        uint16_t group() const { return group_; }
+        const char* data(uint16_t id) const { return buffers_.get() + size_t(id) * size_; }
+
+        /// Give the buffer back, the kernel sees it after publish().
+        void recycle(uint16_t id) { recycled_.push_back(id); }
+        /// One entry per run of adjacent recycled buffers.
+        void publish();
+
+    private:
+        void provide(uint16_t first, unsigned count);
+
+        Uring& ring_;
+        const uint16_t group_;
+        const unsigned size_;
+        const uint64_t user_data_;
+        std::unique_ptr<char[]> buffers_;
+        std::vector<uint16_t> recycled_;
+};
+
+/// @name Submission entry helpers
+/// @{
+void prep_multishot_accept(io_uring_sqe* sqe, int fd, uint64_t user_data);
+void prep_recv_select(io_uring_sqe* sqe, int fd, uint16_t group, uint64_t user_data);
+void prep_send(io_uring_sqe* sqe, int fd, const void* data, size_t size,
+               uint64_t user_data);
+void prep_read(io_uring_sqe* sqe, int fd, void* data, size_t size, uint64_t user_data);
+void prep_timeout(io_uring_sqe* sqe, __kernel_timespec* ts, uint64_t user_data);
+void prep_cancel(io_uring_sqe* sqe, uint64_t target, uint64_t user_data);
+/// @}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "server.h"
+#include "uring.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief The kernel can not run the io_uring transport.
+ */
+class UringUnavailable : public std::runtime_error
+{
+    public:
+        using std::runtime_error::runtime_error;
+};
+
+/**
+ * @brief io_uring transport, serves the line protocol like Server.
+ *
+ * One thread runs the loop: a multishot accept, receives into the
+ * provided buffers and sends, all the entries prepared while handling
+ * a batch of completions are submitted with one system call.
+ */
+class UringServer : public IServer
+{
+    public:
+        /// Throws UringUnavailable when io_uring can not be used.
+        UringServer(unsigned short port, const ProcessorContext& context,
+                    const ServerConfig& config = ServerConfig());
+        ~UringServer();
+
+        UringServer(const UringServer&) = delete;
+        UringServer& operator=(const UringServer&) = delete;
+
+        /// Runs the loop until stopped or drained.
+        void run();
+
+        /// Thread safe, wakes the loop up.
+        void drain(std::function<void()> on_drained) override;
+        void stop() override;
+
+        /// The port listened on, chosen by the system for port 0.
+        unsigned short port() const;
+
+    private:
+        enum { queue_depth = 4096, buffer_count = 1024, buffer_size = 4096 };
+        /// Longest command line, as on the asio transport.
+        enum { max_line = 8192 };
+        enum class Op : uint8_t { Accept = 1, Recv, Send, Wake, Tick, Cancel, Provide };
+        enum class Request { None, Drain, Stop };
+
+        struct Connection
+        {
+            int fd;
+            ProcessorUPtr processor;
+            /// Received and not yet executed, commands wait here while
+            /// a heavy one runs.
+            std::string input;
+            std::deque<std::string> output;
+            size_t sent = 0;
+            /// Bytes of output not sent yet.
+            size_t queued = 0;
+            bool receiving = false;
+            bool sending = false;
+            bool closing = false;
+            bool busy = false;
+            bool executing = false;
+            /// The rest of a line that was too long is dropped.
+            bool skipping = false;
+            /// Nothing is received until the client reads its replies.
+            bool output_full = false;
+            std::chrono::steady_clock::time_point last_activity;
+        };
+
+        static uint64_t tag(Op op, int fd);
+        void wake();
+        /// Thread safe, the task runs on the loop thread.
+        void post(std::function<void()> task);
+
+        void dispatch(const io_uring_cqe& cqe);
+        void on_accept(const io_uring_cqe& cqe);
+        void on_recv(Connection& c, const io_uring_cqe& cqe);
+        void on_send(Connection& c, const io_uring_cqe& cqe);
+        void on_wake();
+        void on_tick();
+
+        void arm_accept();
+        void arm_recv(Connection& c);
+        void arm_wake();
+        void arm_tick();
+
+        void consume(Connection& c, const char* data, size_t size);
+        void process_input(Connection& c);
+        /// Processes the waiting input and receives more unless a command
+        /// runs or the output is full.
+        void resume(Connection& c);
+        void deliver(Connection& c, std::string reply);
+        void start_send(Connection& c);
+        void close(Connection& c);
+        void release_if_idle(Connection& c);
+
+        io_uring_sqe* sqe();
+
+        std::unique_ptr<Uring> ring_;
+        std::unique_ptr<ProvidedBuffers> buffers_;
+        int listen_fd_ = -1;
+        int wake_fd_ = -1;
+        uint64_t wake_value_ = 0;
+        __kernel_timespec tick_ {};
+
+        std::unordered_map<int, std::shared_ptr<Connection>> connections_;
+        const ProcessorContext context_;
+        const ServerConfig config_;
+
+        std::mutex m_;
+        Request request_ = Request::None;
+        std::function<void()> on_drained_;
+        std::vector<std::function<void()>> posted_;
+
+        bool accept_armed_ = false;
+        bool draining_ = false;
+        bool stopped_ = false;
+};
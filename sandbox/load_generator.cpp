@@ -0,0 +1,146 @@
+// Request/response load generator for join_server.
+//
+// Every connection sends one INSERT, waits for the reply and sends the
+// next one. Run it against servers started with --transport epoll and
+// --transport uring to compare the two:
+//
+//   join_server 9000 --transport epoll &
+//   join_server 9001 --transport uring &
+//   load_generator 1000 100 9000 9001
+
+#include <asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+using asio::ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+class Client : public std::enable_shared_from_this<Client>
+{
+    public:
+        Client(asio::io_service& io_service, size_t id, size_t requests,
+               std::vector<double>& latencies)
+            : socket_(io_service)
+            , id_(id)
+            , requests_(requests)
+            , latencies_(latencies) {}
+
+        void start(const tcp::endpoint& endpoint)
+        {
+            auto self(shared_from_this());
+            socket_.async_connect(endpoint, [this, self](const std::error_code& ec)
+            {
+                if (!ec) {
+                    socket_.set_option(tcp::no_delay(true));
+                    send();
+                }
+            });
+        }
+
+    private:
+        void send()
+        {
+            if (sent_ == requests_) {
+                return;
+            }
+            request_ = "INSERT A " + std::to_string(id_ * requests_ + sent_)
+                       + " load\n";
+            ++sent_;
+            started_ = clock_type::now();
+
+            auto self(shared_from_this());
+            asio::async_write(socket_, asio::buffer(request_),
+                              [this, self](const std::error_code& ec, std::size_t)
+            {
+                if (!ec) {
+                    receive();
+                }
+            });
+        }
+
+        void receive()
+        {
+            auto self(shared_from_this());
+            asio::async_read_until(socket_, reply_, '\n',
+                                   [this, self](const std::error_code& ec,
+                                                std::size_t bytes)
+            {
+                if (ec) {
+                    return;
+                }
+                reply_.consume(bytes);
+                const std::chrono::duration<double, std::micro> elapsed =
+                        clock_type::now() - started_;
+                latencies_.push_back(elapsed.count());
+                send();
+            });
+        }
+
+        tcp::socket socket_;
+        const size_t id_;
+        const size_t requests_;
+        size_t sent_ = 0;
+        std::string request_;
+        asio::streambuf reply_;
+        clock_type::time_point started_;
+        std::vector<double>& latencies_;
+};
+
+void run(unsigned short port, size_t connections, size_t requests)
+{
+    asio::io_service io_service;
+    const tcp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+
+    // One latency vector per client, no locking on the hot path.
+    std::vector<std::vector<double>> latencies(connections);
+    for (size_t i = 0; i < connections; ++i) {
+        latencies[i].reserve(requests);
+        std::make_shared<Client>(io_service, i, requests, latencies[i])->start(endpoint);
+    }
+
+    const auto started = clock_type::now();
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < std::max(1u, std::thread::hardware_concurrency()); ++i) {
+        threads.emplace_back([&io_service]() { io_service.run(); });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    const std::chrono::duration<double> elapsed = clock_type::now() - started;
+
+    std::vector<double> all;
+    for (const auto& l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) {
+        return all.empty() ? 0.0 : all[static_cast<size_t>(p * (all.size() - 1))];
+    };
+
+    std::cout << port << ", " << all.size() << ", "
+              << static_cast<size_t>(all.size() / elapsed.count()) << ", "
+              << percentile(0.5) << ", " << percentile(0.99) << ", "
+              << percentile(0.999) << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 4) {
+        std::cerr << "usage: load_generator <connections> <requests> <port> [port...]\n";
+        return 1;
+    }
+
+    const size_t connections = std::stoul(argv[1]);
+    const size_t requests = std::stoul(argv[2]);
+
+    std::cout << "port, requests, requests/s, p50 us, p99 us, p99.9 us\n";
+    for (int i = 3; i < argc; ++i) {
+        run(static_cast<unsigned short>(std::stoul(argv[i])), connections, requests);
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Connection churn soak test for join_server.
+//
+// Opens and closes connections in batches and prints the server RSS,
+// which should stay flat once the allocator has warmed up.
+//
+// usage: soak <port> <server pid> [connections] [batch]
+
+#include <asio.hpp>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using asio::ip::tcp;
+
+long rss_kb(const std::string& pid)
+{
+    std::ifstream status("/proc/" + pid + "/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, 6, "VmRSS:") == 0) {
+            return std::stol(line.substr(6));
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3) {
+        std::cerr << "usage: soak <port> <server pid> [connections] [batch]\n";
+        return 1;
+    }
+
+    const auto port = static_cast<unsigned short>(std::stoul(argv[1]));
+    const std::string pid = argv[2];
+    const size_t total = argc > 3 ? std::stoul(argv[3]) : 1000000;
+    const size_t batch = argc > 4 ? std::stoul(argv[4]) : 100;
+    const size_t report_every = std::max<size_t>(total / 20, batch);
+
+    asio::io_service io_service;
+    const tcp::endpoint endpoint(asio::ip::address_v4::loopback(), port);
+    const std::string command = "INTERSECTION\n";
+
+    std::cout << "connections, rss_kb\n"
+              << 0 << ", " << rss_kb(pid) << std::endl;
+
+    size_t done = 0;
+    size_t next_report = report_every;
+    while (done < total) {
+        std::vector<tcp::socket> sockets;
+        for (size_t i = 0; i < batch && done + i < total; ++i) {
+            sockets.emplace_back(io_service);
+            sockets.back().connect(endpoint);
+            // Reset instead of FIN, the client side must not run out
+            // of ports sitting in TIME_WAIT.
+            sockets.back().set_option(asio::socket_base::linger(true, 0));
+            asio::write(sockets.back(), asio::buffer(command));
+        }
+        for (auto& s : sockets) {
+            std::array<char, 256> reply;
+            s.read_some(asio::buffer(reply));
+            s.close();
+        }
+        done += sockets.size();
+
+        if (done >= next_report) {
+            std::cout << done << ", " << rss_kb(pid) << std::endl;
+            next_report += report_every;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include "bufferpool.h"
+
+namespace {
+
+/// min_size, 2 * min_size, ..., max_size.
+const size_t n_sizes = 7;
+
+/// Index of the smallest size that holds size bytes, the largest one
+/// when none does.
+size_t size_class(size_t size)
+{
+    size_t n = 0;
+    while (n + 1 < n_sizes && (size_t(BufferPool::min_size) << n) < size) {
+        ++n;
+    }
+    return n;
+}
+
+} // namespace
+
+BufferPool::BufferPool(size_t max_idle)
+    : max_idle_(max_idle)
+    , free_(n_sizes)
+{
+}
+
+BufferPool::Buffer BufferPool::acquire(size_t size)
+{
+    const size_t n = size_class(size);
+    Buffer buffer;
+    buffer.size_ = size_t(min_size) << n;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        if (!free_[n].empty()) {
+            buffer.data_ = std::move(free_[n].back());
+            free_[n].pop_back();
+            idle_ -= buffer.size_;
+            return buffer;
+        }
+    }
+    buffer.data_.reset(new char[buffer.size_]);
+    return buffer;
+}
+
+void BufferPool::release(Buffer& buffer)
+{
+    if (buffer.empty()) {
+        return;
+    }
+    const size_t size = buffer.size_;
+    // Freed after the lock is released when the pool keeps enough.
+    std::unique_ptr<char[]> data = std::move(buffer.data_);
+    buffer.size_ = 0;
+
+    std::lock_guard<std::mutex> lock(m_);
+    if (idle_ + size <= max_idle_) {
+        free_[size_class(size)].push_back(std::move(data));
+        idle_ += size;
+    }
+}
+
+size_t BufferPool::idle() const
+{
+    std::lock_guard<std::mutex> lock(m_);
+    return idle_;
+}
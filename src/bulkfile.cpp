@@ -0,0 +1,709 @@
+#include "bulkfile.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+const char bin_magic[4] = { 'J', 'S', 'C', '1' };
+
+MappedFile::MappedFile(const std::string& path)
+{
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(), path);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::system_category(), path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > 0) {
+        void* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (p == MAP_FAILED) {
+            const int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::system_category(), path);
+        }
+        ::madvise(p, size_, MADV_SEQUENTIAL);
+        data_ = static_cast<const char*>(p);
+    }
+    ::close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data_) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+}
+
+namespace {
+
+/// Decimal digits with an optional '-', no more than int64_t holds.
+bool parse_integer(const char* begin, const char* end, int64_t& value)
+{
+    const bool negative = begin != end && *begin == '-';
+    begin += negative;
+    if (begin == end || end - begin > 19) {
+        return false;
+    }
+
+    uint64_t n = 0;
+    for (const char* p = begin; p != end; ++p) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        n = n * 10 + uint64_t(*p - '0');
+    }
+    const uint64_t max = uint64_t(std::numeric_limits<int64_t>::max()) + negative;
+    if (n > max) {
+        return false;
+    }
+    value = negative ? static_cast<int64_t>(0 - n) : static_cast<int64_t>(n);
+    return true;
+}
+
+} // namespace
+
+bool valid_token(const char* begin, const char* end)
+{
+    return begin != end && std::all_of(begin, end, [](unsigned char c) {
+        return c > ' ' && c != 0x7f;
+    });
+}
+
+bool parse_id(const char* begin, const char* end, int32_t& id)
+{
+    int64_t value;
+    if (!parse_integer(begin, end, value)
+        || value < std::numeric_limits<int32_t>::min()
+        || value > std::numeric_limits<int32_t>::max()) {
+        return false;
+    }
+    id = static_cast<int32_t>(value);
+    return true;
+}
+
+bool parse_id(const char* begin, const char* end, int64_t& id)
+{
+    return parse_integer(begin, end, id);
+}
+
+bool parse_id(const char* begin, const char* end, std::string& id)
+{
+    if (!valid_token(begin, end)) {
+        return false;
+    }
+    id.assign(begin, end);
+    return true;
+}
+
+namespace {
+
+/// Input of one CSV parsing thread.
+const size_t csv_part_size = 4 << 20;
+
+KeyType key_type_of(int32_t) { return KeyType::Int32; }
+KeyType key_type_of(int64_t) { return KeyType::Int64; }
+KeyType key_type_of(const std::string&) { return KeyType::String; }
+
+std::runtime_error malformed(const char* begin, const char* end)
+{
+    const size_t shown = std::min<size_t>(size_t(end - begin), 40);
+    return std::runtime_error("malformed row: " + std::string(begin, shown));
+}
+
+template <typename Key>
+bool id_less(const std::pair<Key, std::string>& l, const std::pair<Key, std::string>& r)
+{
+    return l.first < r.first;
+}
+
+/// Rows of the lines of [begin, end), sorted, equal ids in file order.
+template <typename Key>
+void parse_csv(const char* begin, const char* end, file_rows_t<Key>& rows)
+{
+    rows.reserve(size_t(end - begin) / 16);
+    while (begin != end) {
+        const char* eol = static_cast<const char*>(std::memchr(begin, '\n', size_t(end - begin)));
+        if (!eol) {
+            eol = end;
+        }
+        const char* line_end = eol != begin && eol[-1] == '\r' ? eol - 1 : eol;
+        if (line_end != begin) {
+            const char* comma = static_cast<const char*>(
+                        std::memchr(begin, ',', size_t(line_end - begin)));
+            Key id;
+            if (!comma || !parse_id(begin, comma, id) || !valid_token(comma + 1, line_end)) {
+                throw malformed(begin, line_end);
+            }
+            rows.emplace_back(std::move(id), std::string(comma + 1, line_end));
+        }
+        begin = eol == end ? end : eol + 1;
+    }
+    // Dumps and exports come sorted already.
+    if (!std::is_sorted(rows.begin(), rows.end(), id_less<Key>)) {
+        std::stable_sort(rows.begin(), rows.end(), id_less<Key>);
+    }
+}
+
+template <typename Key>
+void read_csv(const MappedFile& file, file_rows_t<Key>& rows)
+{
+    const char* const data = file.data();
+    const size_t size = file.size();
+    const size_t n = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(),
+                                                          size / csv_part_size));
+
+    // Part p starts after the first line end at or past p * size / n.
+    std::vector<size_t> starts { 0 };
+    for (size_t p = 1; p < n; ++p) {
+        const size_t from = std::max(starts.back(), p * size / n);
+        const void* eol = from < size ? std::memchr(data + from, '\n', size - from) : nullptr;
+        starts.push_back(eol ? size_t(static_cast<const char*>(eol) - data) + 1 : size);
+    }
+    starts.push_back(size);
+
+    std::vector<file_rows_t<Key>> parts(n);
+    std::vector<std::thread> workers;
+    std::mutex m;
+    std::exception_ptr error;
+    for (size_t p = 1; p < n; ++p) {
+        workers.emplace_back([&, p]() {
+            try {
+                parse_csv(data + starts[p], data + starts[p + 1], parts[p]);
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(m);
+                error = std::current_exception();
+            }
+        });
+    }
+    try {
+        parse_csv(data, data + starts[1], parts[0]);
+    }
+    catch (...) {
+        std::lock_guard<std::mutex> lock(m);
+        error = std::current_exception();
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    size_t total = 0;
+    for (const auto& part : parts) {
+        total += part.size();
+    }
+    rows.reserve(total);
+    for (auto& part : parts) {
+        const bool ordered = rows.empty() || part.empty()
+                             || !id_less(part.front(), rows.back());
+        const auto middle = rows.size();
+        rows.insert(rows.end(), std::make_move_iterator(part.begin()),
+                    std::make_move_iterator(part.end()));
+        file_rows_t<Key>().swap(part);
+        if (!ordered) {
+            // Stable, the rows of the earlier parts stay first.
+            std::inplace_merge(rows.begin(), rows.begin() + static_cast<std::ptrdiff_t>(middle),
+                               rows.end(), id_less<Key>);
+        }
+    }
+}
+
+/**
+ * @brief Bounds checked reads of the columns of a binary file.
+ */
+class BinReader
+{
+    public:
+        BinReader(const MappedFile& file) : p_(file.data()), end_(file.data() + file.size()) {}
+
+        const char* take(uint64_t bytes)
+        {
+            if (bytes > uint64_t(end_ - p_)) {
+                throw std::runtime_error("truncated binary file");
+            }
+            const char* p = p_;
+            p_ += bytes;
+            return p;
+        }
+
+        template <typename T>
+        T value()
+        {
+            T v;
+            std::memcpy(&v, take(sizeof(T)), sizeof(T));
+            return v;
+        }
+
+        /// Calls f(index, string) for every string of a column of rows.
+        template <typename F>
+        void strings(uint64_t rows, F f)
+        {
+            if (rows > uint64_t(end_ - p_) / sizeof(uint64_t)) {
+                throw std::runtime_error("truncated binary file");
+            }
+            const char* offsets = take((rows + 1) * sizeof(uint64_t));
+            auto offset = [offsets](uint64_t i) {
+                uint64_t v;
+                std::memcpy(&v, offsets + i * sizeof(uint64_t), sizeof(v));
+                return v;
+            };
+            const uint64_t bytes = offset(rows);
+            const char* base = take(bytes);
+            for (uint64_t i = 0; i < rows; ++i) {
+                const uint64_t b = offset(i);
+                const uint64_t e = offset(i + 1);
+                if (b > e || e > bytes) {
+                    throw std::runtime_error("bad offsets in binary file");
+                }
+                f(i, std::string(base + b, base + e));
+            }
+        }
+
+    private:
+        const char* p_;
+        const char* const end_;
+};
+
+template <typename Key>
+void read_ids(BinReader& in, uint64_t n, file_rows_t<Key>& rows)
+{
+    const char* ids = in.take(n * sizeof(Key));
+    for (uint64_t i = 0; i < n; ++i) {
+        Key id;
+        std::memcpy(&id, ids + i * sizeof(Key), sizeof(Key));
+        rows[i].first = id;
+    }
+}
+
+void read_ids(BinReader& in, uint64_t n, file_rows_t<std::string>& rows)
+{
+    in.strings(n, [&rows](uint64_t i, std::string id) {
+        if (!valid_token(id)) {
+            throw malformed(id.data(), id.data() + id.size());
+        }
+        rows[i].first = std::move(id);
+    });
+}
+
+template <typename Key>
+void read_bin(const MappedFile& file, file_rows_t<Key>& rows)
+{
+    BinReader in(file);
+    const auto header = in.value<BinHeader>();
+    if (std::memcmp(header.magic, bin_magic, sizeof(bin_magic)) != 0) {
+        throw std::runtime_error("not a binary table file");
+    }
+    if (header.key_type != static_cast<uint8_t>(key_type_of(Key()))) {
+        throw std::runtime_error("ids of the file are of another type");
+    }
+    if (header.columns != 1) {
+        throw std::runtime_error("binary file is not a table");
+    }
+    if (header.rows > file.size()) {
+        throw std::runtime_error("truncated binary file");
+    }
+
+    rows.resize(header.rows);
+    read_ids(in, header.rows, rows);
+    // The names go to the log and the snapshots like those of INSERT.
+    in.strings(header.rows, [&rows](uint64_t i, std::string name) {
+        if (!valid_token(name)) {
+            throw malformed(name.data(), name.data() + name.size());
+        }
+        rows[i].second = std::move(name);
+    });
+    if (!std::is_sorted(rows.begin(), rows.end(), id_less<Key>)) {
+        std::stable_sort(rows.begin(), rows.end(), id_less<Key>);
+    }
+}
+
+} // namespace
+
+template <typename Key>
+size_t read_rows(const std::string& path, FileFormat format, file_rows_t<Key>& rows)
+{
+    const MappedFile file(path);
+    if (format == FileFormat::Bin) {
+        read_bin(file, rows);
+    }
+    else {
+        read_csv(file, rows);
+    }
+
+    const auto last = std::unique(rows.begin(), rows.end(),
+                                  [](const std::pair<Key, std::string>& l,
+                                     const std::pair<Key, std::string>& r) {
+        return l.first == r.first;
+    });
+    const size_t duplicates = static_cast<size_t>(rows.end() - last);
+    rows.erase(last, rows.end());
+    return duplicates;
+}
+
+template size_t read_rows(const std::string&, FileFormat, file_rows_t<int32_t>&);
+template size_t read_rows(const std::string&, FileFormat, file_rows_t<int64_t>&);
+template size_t read_rows(const std::string&, FileFormat, file_rows_t<std::string>&);
+
+namespace {
+
+/// Buffer of every region writer, a multiple of the page size.
+const size_t write_buffer_size = 1 << 20;
+
+/**
+ * @brief Buffered writes to a region of a file that starts at offset.
+ */
+class RegionWriter
+{
+    public:
+        RegionWriter(int fd, uint64_t offset)
+            : fd_(fd), offset_(offset), buffer_(nullptr, &std::free)
+        {
+            void* p = nullptr;
+            if (::posix_memalign(&p, 4096, write_buffer_size) != 0) {
+                throw std::bad_alloc();
+            }
+            buffer_.reset(static_cast<char*>(p));
+        }
+
+        void write(const char* data, size_t n)
+        {
+            while (n > 0) {
+                if (used_ == write_buffer_size) {
+                    flush();
+                }
+                const size_t chunk = std::min(n, write_buffer_size - used_);
+                std::memcpy(buffer_.get() + used_, data, chunk);
+                used_ += chunk;
+                data += chunk;
+                n -= chunk;
+            }
+        }
+
+        template <typename T>
+        void write(const T& value)
+        {
+            write(reinterpret_cast<const char*>(&value), sizeof(value));
+        }
+
+        void flush()
+        {
+            size_t done = 0;
+            while (done < used_) {
+                const ssize_t rc = ::pwrite(fd_, buffer_.get() + done, used_ - done,
+                                            static_cast<off_t>(offset_ + done));
+                if (rc < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::system_category(), "export");
+                }
+                done += size_t(rc);
+            }
+            offset_ += used_;
+            used_ = 0;
+        }
+
+    private:
+        const int fd_;
+        uint64_t offset_;
+        std::unique_ptr<char, decltype(&std::free)> buffer_;
+        size_t used_ = 0;
+};
+
+size_t text_size(int64_t id)
+{
+    size_t n = id < 0 ? 2 : 1;
+    for (uint64_t u = id < 0 ? 0 - uint64_t(id) : uint64_t(id); u >= 10; u /= 10) {
+        ++n;
+    }
+    return n;
+}
+
+size_t text_size(const std::string& id) { return id.size(); }
+
+void write_text(RegionWriter& out, int64_t id)
+{
+    char text[24];
+    char* end = text + sizeof(text);
+    char* p = end;
+    uint64_t u = id < 0 ? 0 - uint64_t(id) : uint64_t(id);
+    do {
+        *--p = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (id < 0) {
+        *--p = '-';
+    }
+    out.write(p, size_t(end - p));
+}
+
+void write_text(RegionWriter& out, const std::string& id) { out.write(id.data(), id.size()); }
+
+template <typename Key>
+uint64_t csv_size(const ExportRow<Key>& row, unsigned columns)
+{
+    uint64_t n = text_size(row.id) + 1;
+    for (unsigned c = 0; c < columns; ++c) {
+        n += 1 + row.names[c]->size();
+    }
+    return n;
+}
+
+/// Bytes of a string column of the part, the ids when column is -1.
+template <typename Key>
+uint64_t string_bytes(const export_part_t<Key>& part, int column)
+{
+    uint64_t n = 0;
+    for (const auto& row : part) {
+        n += column < 0 ? text_size(row.id) : row.names[column]->size();
+    }
+    return n;
+}
+
+/**
+ * @brief Where every part goes: the start of each region of the file.
+ */
+struct Layout
+{
+    /// [part][region] offsets in the file.
+    std::vector<std::vector<uint64_t>> starts;
+    /// [part] first row and the first byte of every string column.
+    std::vector<uint64_t> first_row;
+    std::vector<std::vector<uint64_t>> first_byte;
+    uint64_t size = 0;
+};
+
+template <typename Key>
+Layout csv_layout(const std::vector<export_part_t<Key>>& parts, unsigned columns)
+{
+    Layout layout;
+    for (const auto& part : parts) {
+        layout.starts.push_back({ layout.size });
+        for (const auto& row : part) {
+            layout.size += csv_size(row, columns);
+        }
+    }
+    return layout;
+}
+
+/**
+ * Regions of a part: the ids, then offsets and bytes of every string
+ * column. String ids are the first string column.
+ */
+template <typename Key>
+Layout bin_layout(const std::vector<export_part_t<Key>>& parts, unsigned columns)
+{
+    const bool string_ids = key_type_of(Key()) == KeyType::String;
+    const unsigned strings = columns + string_ids;
+
+    uint64_t rows = 0;
+    std::vector<uint64_t> bytes(strings, 0);
+    Layout layout;
+    for (const auto& part : parts) {
+        layout.first_row.push_back(rows);
+        layout.first_byte.emplace_back(bytes);
+        rows += part.size();
+        for (unsigned s = 0; s < strings; ++s) {
+            bytes[s] += string_bytes(part, int(s) - int(string_ids));
+        }
+    }
+
+    // Column starts, then the part regions within the columns.
+    uint64_t offset = sizeof(BinHeader);
+    const uint64_t ids = offset;
+    if (!string_ids) {
+        offset += rows * sizeof(Key);
+    }
+    std::vector<uint64_t> offsets(strings);
+    std::vector<uint64_t> data(strings);
+    for (unsigned s = 0; s < strings; ++s) {
+        offsets[s] = offset;
+        data[s] = offset + (rows + 1) * sizeof(uint64_t);
+        offset = data[s] + bytes[s];
+    }
+    layout.size = offset;
+
+    for (size_t p = 0; p < parts.size(); ++p) {
+        std::vector<uint64_t> starts;
+        if (!string_ids) {
+            starts.push_back(ids + layout.first_row[p] * sizeof(Key));
+        }
+        for (unsigned s = 0; s < strings; ++s) {
+            starts.push_back(offsets[s] + layout.first_row[p] * sizeof(uint64_t));
+            starts.push_back(data[s] + layout.first_byte[p][s]);
+        }
+        layout.starts.push_back(std::move(starts));
+    }
+    // The closing offset of every string column follows the last part.
+    std::vector<uint64_t> last;
+    for (unsigned s = 0; s < strings; ++s) {
+        last.push_back(offsets[s] + rows * sizeof(uint64_t));
+        last.push_back(bytes[s]);
+    }
+    layout.starts.push_back(std::move(last));
+    return layout;
+}
+
+template <typename Key>
+void write_csv_part(int fd, const export_part_t<Key>& part, unsigned columns,
+                    const std::vector<uint64_t>& starts)
+{
+    RegionWriter out(fd, starts[0]);
+    for (const auto& row : part) {
+        write_text(out, row.id);
+        for (unsigned c = 0; c < columns; ++c) {
+            out.write(",", 1);
+            out.write(row.names[c]->data(), row.names[c]->size());
+        }
+        out.write("\n", 1);
+    }
+    out.flush();
+}
+
+template <typename Key>
+void write_bin_part(int fd, const export_part_t<Key>& part, unsigned columns,
+                    const std::vector<uint64_t>& starts, const std::vector<uint64_t>& first_byte)
+{
+    const bool string_ids = key_type_of(Key()) == KeyType::String;
+    size_t region = 0;
+    if (!string_ids) {
+        RegionWriter out(fd, starts[region++]);
+        for (const auto& row : part) {
+            out.write(row.id);
+        }
+        out.flush();
+    }
+    for (unsigned s = 0; s < columns + string_ids; ++s) {
+        const int column = int(s) - int(string_ids);
+        RegionWriter offsets(fd, starts[region++]);
+        RegionWriter data(fd, starts[region++]);
+        uint64_t offset = first_byte[s];
+        for (const auto& row : part) {
+            offsets.write(offset);
+            if (column < 0) {
+                write_text(data, row.id);
+                offset += text_size(row.id);
+            }
+            else {
+                data.write(row.names[column]->data(), row.names[column]->size());
+                offset += row.names[column]->size();
+            }
+        }
+        offsets.flush();
+        data.flush();
+    }
+}
+
+} // namespace
+
+template <typename Key>
+size_t write_rows(const std::string& path, FileFormat format, unsigned columns,
+                  const std::vector<export_part_t<Key>>& parts)
+{
+    const Layout layout = format == FileFormat::Bin ? bin_layout(parts, columns)
+                                                    : csv_layout(parts, columns);
+    size_t rows = 0;
+    for (const auto& part : parts) {
+        rows += part.size();
+    }
+
+    const std::string temporary = path + ".tmp";
+    const int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(), path);
+    }
+    try {
+        if (::ftruncate(fd, static_cast<off_t>(layout.size)) < 0) {
+            throw std::system_error(errno, std::system_category(), path);
+        }
+        if (format == FileFormat::Bin) {
+            RegionWriter out(fd, 0);
+            BinHeader header;
+            std::memcpy(header.magic, bin_magic, sizeof(bin_magic));
+            header.key_type = static_cast<uint8_t>(key_type_of(Key()));
+            header.columns = static_cast<uint8_t>(columns);
+            header.reserved = 0;
+            header.rows = rows;
+            out.write(header);
+            out.flush();
+
+            const auto& last = layout.starts.back();
+            for (size_t s = 0; s < last.size(); s += 2) {
+                RegionWriter closing(fd, last[s]);
+                closing.write(last[s + 1]);
+                closing.flush();
+            }
+        }
+
+        std::mutex m;
+        std::exception_ptr error;
+        auto write_part = [&](size_t p) {
+            try {
+                if (format == FileFormat::Bin) {
+                    write_bin_part(fd, parts[p], columns, layout.starts[p],
+                                   layout.first_byte[p]);
+                }
+                else {
+                    write_csv_part(fd, parts[p], columns, layout.starts[p]);
+                }
+            }
+            catch (...) {
+                std::lock_guard<std::mutex> lock(m);
+                error = std::current_exception();
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t p = 1; p < parts.size(); ++p) {
+            workers.emplace_back(write_part, p);
+        }
+        if (!parts.empty()) {
+            write_part(0);
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (::fsync(fd) < 0) {
+            throw std::system_error(errno, std::system_category(), path);
+        }
+    }
+    catch (...) {
+        ::close(fd);
+        ::unlink(temporary.c_str());
+        throw;
+    }
+    if (::close(fd) < 0 || ::rename(temporary.c_str(), path.c_str()) < 0) {
+        const int error = errno;
+        ::unlink(temporary.c_str());
+        throw std::system_error(error, std::system_category(), path);
+    }
+    return rows;
+}
+
+template size_t write_rows(const std::string&, FileFormat, unsigned,
+                           const std::vector<export_part_t<int32_t>>&);
+template size_t write_rows(const std::string&, FileFormat, unsigned,
+                           const std::vector<export_part_t<int64_t>>&);
+template size_t write_rows(const std::string&, FileFormat, unsigned,
+                           const std::vector<export_part_t<std::string>>&);
@@ -0,0 +1,154 @@
+#include "commandparser.h"
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+/// Bytes a token may hold, the space and the line ends separate them.
+bool is_token_byte(unsigned char c)
+{
+    return c > ' ' && c != 0x7f;
+}
+
+} // namespace
+
+CommandParser::Result CommandParser::parse(const char* line, size_t size)
+{
+    if (state_ == State::Done) {
+        state_ = State::Start;
+        start_ = 0;
+        pos_ = 0;
+        count_ = 0;
+    }
+    line_ = line;
+    consumed_ = 0;
+
+    if (state_ == State::Skip) {
+        const void* eol = std::memchr(line, '\n', size);
+        if (!eol) {
+            consumed_ = size;
+            return Result::Indeterminate;
+        }
+        // The rest of the buffer starts a new line.
+        const size_t skipped = static_cast<size_t>(static_cast<const char*>(eol) - line) + 1;
+        state_ = State::Done;
+        const Result result = parse(line + skipped, size - skipped);
+        consumed_ += skipped;
+        return result;
+    }
+
+    for (; pos_ < size; ++pos_) {
+        if (pos_ - start_ == max_line_) {
+            return overflow();
+        }
+        const unsigned char c = static_cast<unsigned char>(line[pos_]);
+        switch (state_) {
+            case State::Start:
+                if (c == '\n') {
+                    start_ = pos_ + 1;
+                }
+                else if (c == '\r') {
+                    state_ = State::Return;
+                }
+                else if (is_token_byte(c)) {
+                    tokens_[0] = Token { pos_, 1 };
+                    count_ = 1;
+                    state_ = State::Token;
+                }
+                else {
+                    return fail(c == ' ' ? "empty token" : "unexpected byte");
+                }
+                break;
+
+            case State::Token:
+                if (is_token_byte(c)) {
+                    ++tokens_[count_ - 1].size;
+                }
+                else if (c == ' ') {
+                    state_ = State::Space;
+                }
+                else if (c == '\n') {
+                    consumed_ = pos_ + 1;
+                    state_ = State::Done;
+                    return Result::Good;
+                }
+                else if (c == '\r') {
+                    state_ = State::Return;
+                }
+                else {
+                    return fail("unexpected byte");
+                }
+                break;
+
+            case State::Space:
+                if (!is_token_byte(c)) {
+                    return fail(c == ' ' || c == '\r' || c == '\n' ? "empty token"
+                                                                   : "unexpected byte");
+                }
+                if (count_ == max_tokens) {
+                    return fail("too many tokens");
+                }
+                tokens_[count_++] = Token { pos_, 1 };
+                state_ = State::Token;
+                break;
+
+            case State::Return:
+                if (c != '\n') {
+                    return fail("unexpected byte");
+                }
+                if (count_ == 0) {
+                    // An empty "\r\n" line.
+                    start_ = pos_ + 1;
+                    state_ = State::Start;
+                    break;
+                }
+                consumed_ = pos_ + 1;
+                state_ = State::Done;
+                return Result::Good;
+
+            default:
+                break;
+        }
+    }
+
+    if (pos_ - start_ == max_line_) {
+        return overflow();
+    }
+
+    // The empty lines are dropped, the tokens move with the line.
+    consumed_ = start_;
+    for (size_t i = 0; i < count_; ++i) {
+        tokens_[i].begin -= start_;
+    }
+    pos_ -= start_;
+    start_ = 0;
+    return Result::Indeterminate;
+}
+
+CommandParser::Result CommandParser::fail(const char* what)
+{
+    const unsigned char c = static_cast<unsigned char>(line_[pos_]);
+    error_ = what;
+    if (is_token_byte(c) || c == ' ' || c == '\r' || c == '\n') {
+        error_ += " at ";
+    }
+    else {
+        char byte[16];
+        std::snprintf(byte, sizeof(byte), " 0x%02x at ", c);
+        error_ += byte;
+    }
+    error_ += std::to_string(pos_ - start_);
+
+    // The rest of the line is skipped unless the bad byte ends it.
+    consumed_ = pos_ + 1;
+    state_ = c == '\n' ? State::Done : State::Skip;
+    return Result::Bad;
+}
+
+CommandParser::Result CommandParser::overflow()
+{
+    error_ = "line longer than " + std::to_string(max_line_) + " bytes";
+    consumed_ = pos_;
+    state_ = State::Skip;
+    return Result::Bad;
+}
@@ -1,4 +1,31 @@
 #include "commands.h"
+#include "interpreter.h"
+#include "storage.h"
+
+namespace {
+
+/// Optional "FORMAT csv|bin" at args[at], false for anything else.
+bool parse_format(const arguments_t& args, size_t at, FileFormat& format)
+{
+    if (args.size() == at) {
+        return true;
+    }
+    if (args.size() != at + 2 || args[at] != "FORMAT") {
+        return false;
+    }
+    if (args[at + 1] == "csv") {
+        format = FileFormat::Csv;
+    }
+    else if (args[at + 1] == "bin") {
+        format = FileFormat::Bin;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+} // namespace
 
 Command::Command(const std::string& command_name, IStorage& storage)
     : name_(command_name)
@@ -6,3 +33,218 @@ Command::Command(const std::string& command_name, IStorage& storage)
     , storage_(storage)
 {
 }
+
+bool Command::prepare(const arguments_t& args)
+{
+    prepared_ = args;
+    params_.clear();
+    for (size_t i = 0; i < args.size(); ++i) {
+        if (args[i] == "?") {
+            params_.push_back(i);
+        }
+    }
+    return true;
+}
+
+bool Command::bind(const arguments_t& args, size_t first)
+{
+    if (args.size() - first != params_.size()) {
+        valid_ = false;
+        return valid_;
+    }
+    arguments_t bound = prepared_;
+    for (size_t i = 0; i < params_.size(); ++i) {
+        bound[params_[i]] = args[first + i];
+    }
+    return parse(bound);
+}
+
+bool Insert::parse(const arguments_t& args)
+{
+    // The table is resolved to its handle here, not by every insert.
+    const table_handle_t table = args.size() == 3 ? storage_.find_table(args[0]) : no_table;
+    valid_ = table != no_table
+             && storage_.valid_key(args[1])
+             && Grammar::name_field()->interpret(args[2]);
+    if (valid_) {
+        setId(args[1]);
+        setTable(table);
+        setValue(args[2]);
+    }
+    return valid_;
+}
+
+bool Insert::prepare(const arguments_t& args)
+{
+    Command::prepare(args);
+    valid_ = args.size() == 3
+             && (args[0] == "?" || storage_.find_table(args[0]) != no_table)
+             && (args[1] == "?" || storage_.valid_key(args[1]))
+             && (args[2] == "?" || Grammar::name_field()->interpret(args[2]));
+    if (valid_) {
+        setTable(storage_.find_table(args[0]));
+        setId(args[1]);
+        setValue(args[2]);
+    }
+    return valid_;
+}
+
+bool Insert::bind(const arguments_t& args, size_t first)
+{
+    valid_ = args.size() - first == params_.size();
+    for (size_t i = 0; i < params_.size() && valid_; ++i) {
+        const std::string& value = args[first + i];
+        switch (params_[i]) {
+            case 0:
+                table_ = storage_.find_table(value);
+                valid_ = table_ != no_table;
+                break;
+            case 1:
+                valid_ = storage_.valid_key(value);
+                id_ = value;
+                break;
+            default:
+                // The rule of name_field without the regex.
+                valid_ = valid_token(value);
+                value_ = value;
+                break;
+        }
+    }
+    return valid_;
+}
+
+bool Insert::stage(WriteSet& writes) const
+{
+    writes.push_back(Write { table_, false, id_, value_ });
+    return true;
+}
+
+bool Insert::heavy() const
+{
+    // On a coordinator the row goes over the network to its shard.
+    return storage_.remote();
+}
+
+ResultPrinterUPtr Insert::run()
+{
+    return std::make_unique<InsertPrinter>(storage_.insert(table_, id_, value_), id_);
+}
+
+bool Truncate::parse(const arguments_t& args)
+{
+    const table_handle_t table = args.size() == 1 ? storage_.find_table(args[0]) : no_table;
+    valid_ = table != no_table;
+    if (valid_) {
+        setTable(table);
+    }
+    return valid_;
+}
+
+bool Truncate::stage(WriteSet& writes) const
+{
+    writes.push_back(Write { table_, true, std::string(), std::string() });
+    return true;
+}
+
+bool Truncate::heavy() const
+{
+    return storage_.remote();
+}
+
+ResultPrinterUPtr Truncate::run()
+{
+    return std::make_unique<TruncatePrinter>(storage_.truncate(table_));
+}
+
+ResultPrinterUPtr Commit::run()
+{
+    return std::make_unique<LoadPrinter>(storage_.apply(writes_));
+}
+
+bool Load::parse(const arguments_t& args)
+{
+    valid_ = args.size() >= 2
+             && Grammar::table_name()->interpret(args[0])
+             && Grammar::name_field()->interpret(args[1])
+             && parse_format(args, 2, format_);
+    if (valid_) {
+        table_ = args[0];
+        path_ = args[1];
+    }
+    return valid_;
+}
+
+ResultPrinterUPtr Load::run()
+{
+    return std::make_unique<LoadPrinter>(storage_.load(table_, path_, format_));
+}
+
+bool Export::parse(const arguments_t& args)
+{
+    valid_ = false;
+    if (args.size() >= 3 && args[0] == "TABLE") {
+        valid_ = Grammar::table_name()->interpret(args[1])
+                 && Grammar::name_field()->interpret(args[2])
+                 && parse_format(args, 3, format_);
+        table_ = args[1];
+        path_ = args[2];
+    }
+    else if (args.size() >= 2
+             && (args[0] == "INTERSECTION" || args[0] == "SYMMETRIC_DIFFERENCE")) {
+        valid_ = Grammar::name_field()->interpret(args[1])
+                 && parse_format(args, 2, format_);
+        kind_ = args[0] == "INTERSECTION" ? JoinKind::Intersection
+                                          : JoinKind::SymmetricDifference;
+        path_ = args[1];
+    }
+    return valid_;
+}
+
+ResultPrinterUPtr Export::run()
+{
+    const size_t rows = table_.empty() ? storage_.export_join(kind_, path_, format_)
+                                       : storage_.export_table(table_, path_, format_);
+    return std::make_unique<CountPrinter>(rows);
+}
+
+bool Join::parse(const arguments_t& args)
+{
+    // A prepared join is parsed again on every EXEC, drop the last clauses.
+    range_ = JoinRange();
+    output_ = JoinOutput::Rows;
+    valid_ = parse_join(args, range_, output_);
+    return valid_;
+}
+
+std::string Join::cache_key() const
+{
+    return name() + " " + std::to_string(range_.from)
+            + " " + (range_.has_to ? std::to_string(range_.to) : "-")
+            + " " + std::to_string(range_.limit) + " " + std::to_string(range_.offset)
+            + " " + std::to_string(static_cast<int>(range_.order))
+            + (output_ == JoinOutput::Count ? " COUNT" : "");
+}
+
+ResultPrinterUPtr Intersection::run()
+{
+    if (output_ == JoinOutput::Count) {
+        return std::make_unique<CountPrinter>(storage_.intersection_count(range_));
+    }
+    if (output_ == JoinOutput::Estimate) {
+        return std::make_unique<EstimatePrinter>(storage_.intersection_estimate());
+    }
+    return std::make_unique<IntersectionPrinter>(storage_.intersection(range_));
+}
+
+ResultPrinterUPtr SymmetricDifference::run()
+{
+    if (output_ == JoinOutput::Count) {
+        return std::make_unique<CountPrinter>(storage_.symmetric_difference_count(range_));
+    }
+    if (output_ == JoinOutput::Estimate) {
+        return std::make_unique<EstimatePrinter>(
+                    storage_.symmetric_difference_estimate());
+    }
+    return std::make_unique<SymmetricDifferencePrinter>(
+                storage_.symmetric_difference(range_));
+}
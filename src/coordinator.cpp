@@ -0,0 +1,437 @@
+#include "coordinator.h"
+#include <poll.h>
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+
+using asio::ip::tcp;
+
+namespace {
+
+size_t slice(size_t n, const JoinRange& range)
+{
+    return n > range.offset ? std::min(n - range.offset, range.limit) : 0;
+}
+
+/// Rows that may be in [offset, offset + limit), saturated.
+size_t head(const JoinRange& range)
+{
+    return range.limit > std::numeric_limits<size_t>::max() - range.offset
+           ? std::numeric_limits<size_t>::max() : range.offset + range.limit;
+}
+
+} // namespace
+
+Shard parse_shard(const std::string& text)
+{
+    Shard shard;
+    std::string address = text;
+    const size_t at = text.find('@');
+    if (at != std::string::npos) {
+        const std::string from = text.substr(0, at);
+        if (!parse_id(from.data(), from.data() + from.size(), shard.from)) {
+            throw std::invalid_argument("bad shard id: " + from);
+        }
+        address = text.substr(at + 1);
+    }
+    const size_t colon = address.rfind(':');
+    if (colon == 0 || colon == std::string::npos || colon + 1 == address.size()
+        || address.find_first_not_of("0123456789", colon + 1) != std::string::npos) {
+        throw std::invalid_argument("bad shard address: " + address);
+    }
+    shard.host = address.substr(0, colon);
+    shard.port = address.substr(colon + 1);
+    return shard;
+}
+
+ShardClient::ShardClient(const Shard& shard, std::chrono::milliseconds reply_timeout)
+    : shard_(shard)
+    , reply_timeout_(reply_timeout)
+{
+}
+
+bool ShardClient::call(const std::string& command, std::string& out, size_t& rows)
+{
+    SocketUPtr socket;
+    {
+        lock_t lock(m_);
+        if (!idle_.empty()) {
+            socket = std::move(idle_.back());
+            idle_.pop_back();
+        }
+    }
+
+    bool ok = false;
+    try {
+        // A kept connection may have been closed by the idle timeout of
+        // the shard, the command is sent again on a new one.
+        if (!socket || !exchange(*socket, command, out, rows, ok)) {
+            socket = std::make_unique<tcp::socket>(io_service_);
+            tcp::resolver resolver(io_service_);
+            asio::connect(*socket, resolver.resolve(tcp::resolver::query(shard_.host,
+                                                                         shard_.port)));
+            socket->set_option(tcp::no_delay(true));
+            if (!exchange(*socket, command, out, rows, ok)) {
+                throw std::runtime_error("connection closed");
+            }
+        }
+    }
+    catch (const std::exception& e) {
+        throw std::runtime_error("shard " + shard_.address() + ": " + e.what());
+    }
+
+    lock_t lock(m_);
+    idle_.push_back(std::move(socket));
+    return ok;
+}
+
+bool ShardClient::exchange(tcp::socket& socket, const std::string& command,
+                           std::string& out, size_t& rows, bool& ok)
+{
+    out.clear();
+    rows = 0;
+    asio::error_code ec;
+    asio::write(socket, asio::buffer(command + "\n"), ec);
+    if (ec) {
+        return false;
+    }
+
+    // Rows start with the id, the reply ends with the first OK or ERR line.
+    std::array<char, 65536> buffer;
+    size_t line = 0;
+    for (;;) {
+        // The blocking read has no deadline of its own, a hung shard
+        // would hold the worker forever.
+        pollfd ready { socket.native_handle(), POLLIN, 0 };
+        int polled;
+        do {
+            polled = ::poll(&ready, 1, static_cast<int>(reply_timeout_.count()));
+        } while (polled < 0 && errno == EINTR);
+        if (polled == 0) {
+            throw std::runtime_error("no reply in time");
+        }
+        const size_t n = socket.read_some(asio::buffer(buffer), ec);
+        if (ec) {
+            if (out.empty()) {
+                return false;
+            }
+            throw std::runtime_error(ec.message());
+        }
+        size_t scan = out.size();
+        out.append(buffer.data(), n);
+        for (size_t end; (end = out.find('\n', scan)) != std::string::npos; scan = end + 1) {
+            if (out[line] == 'O' || out[line] == 'E') {
+                ok = out[line] == 'O';
+                if (ok) {
+                    out.erase(line);
+                }
+                else {
+                    out = out.substr(line + 4, end - line - 4);
+                }
+                return true;
+            }
+            ++rows;
+            line = end + 1;
+        }
+    }
+}
+
+void ShardRows::append(const std::string& text, size_t skip, size_t limit)
+{
+    size_t row = 0;
+    for (size_t begin = 0; begin < text.size() && (row < skip || row - skip < limit); ++row) {
+        const size_t end = text.find('\n', begin) + 1;
+        if (row >= skip) {
+            starts_.push_back(text_.size());
+            text_.append(text, begin, end - begin);
+        }
+        begin = end;
+    }
+}
+
+void ShardRows::print_json(std::string& out, size_t begin, size_t end, bool ndjson) const
+{
+    for (size_t i = begin; i < end && i < starts_.size(); ++i) {
+        if (i > 0 && !ndjson) {
+            out.push_back(',');
+        }
+        // "id,a,b\n" where one of the names may be empty.
+        const size_t first = text_.find(',', starts_[i]);
+        const size_t last = (i + 1 < starts_.size() ? starts_[i + 1] : text_.size()) - 1;
+        size_t comma = text_.find(',', first + 1);
+        if (text_[last - 1] == ',') {
+            comma = last - 1;
+        }
+        const std::string a = text_.substr(first + 1, comma - first - 1);
+        const std::string b = text_.substr(comma + 1, last - comma - 1);
+
+        out.append("{\"id\":").append(text_, starts_[i], first - starts_[i]);
+        for (const std::string* name : { &a, &b }) {
+            out.append(name == &a ? ",\"a\":" : ",\"b\":");
+            if (name->empty()) {
+                out.append("null");
+            }
+            else {
+                detail::append_json(out, *name);
+            }
+        }
+        out.push_back('}');
+        if (ndjson) {
+            out.push_back('\n');
+        }
+    }
+}
+
+ShardedStorage::ShardedStorage(KeyType key_type, const std::vector<Shard>& shards)
+    : key_type_(key_type)
+{
+    if (key_type == KeyType::String) {
+        throw std::invalid_argument("shards need integer ids");
+    }
+    catalog_.add("A");
+    catalog_.add("B");
+    if (shards.empty() || shards.front().from != Shard().from) {
+        throw std::invalid_argument("the first shard starts at the lowest id");
+    }
+    for (const auto& shard : shards) {
+        if (!shards_.empty() && shard.from <= shards_.back()->shard().from) {
+            throw std::invalid_argument("the shards must go up by id");
+        }
+        shards_.push_back(std::make_unique<ShardClient>(shard));
+    }
+}
+
+bool ShardedStorage::valid_key(const std::string& id) const
+{
+    int32_t id32;
+    int64_t id64;
+    return key_type_ == KeyType::Int32 ? parse_id(id.data(), id.data() + id.size(), id32)
+                                       : parse_id(id.data(), id.data() + id.size(), id64);
+}
+
+bool ShardedStorage::insert(table_handle_t table, const std::string& id,
+                            const std::string& name)
+{
+    int64_t key;
+    if (table >= catalog_.size() || !valid_key(id)
+        || !parse_id(id.data(), id.data() + id.size(), key)) {
+        return false;
+    }
+    size_t i = shards_.size() - 1;
+    while (shards_[i]->shard().from > key) {
+        --i;
+    }
+
+    std::string reply;
+    size_t rows;
+    if (shards_[i]->call("INSERT " + catalog_.name(table) + " " + id + " " + name,
+                         reply, rows)) {
+        return true;
+    }
+    if (reply.compare(0, 9, "duplicate") == 0) {
+        return false;
+    }
+    throw std::runtime_error(reply);
+}
+
+bool ShardedStorage::truncate(table_handle_t table)
+{
+    if (table >= catalog_.size()) {
+        return false;
+    }
+    const auto replies = scatter(std::vector<std::string>(shards_.size(),
+                                                          "TRUNCATE " + catalog_.name(table)));
+    for (const auto& reply : replies) {
+        if (!reply.ok) {
+            throw std::runtime_error(reply.text);
+        }
+    }
+    return true;
+}
+
+LoadResult ShardedStorage::apply(const WriteSet&)
+{
+    throw std::invalid_argument("transactions on the shards");
+}
+
+LoadResult ShardedStorage::load(const std::string&, const std::string&, FileFormat)
+{
+    throw std::invalid_argument("LOAD the files on the shards");
+}
+
+size_t ShardedStorage::export_join(JoinKind, const std::string&, FileFormat) const
+{
+    throw std::invalid_argument("EXPORT on the shards");
+}
+
+size_t ShardedStorage::export_table(const std::string&, const std::string&, FileFormat) const
+{
+    throw std::invalid_argument("EXPORT on the shards");
+}
+
+DumpUPtr ShardedStorage::dump(uint64_t&) const
+{
+    throw std::logic_error("a coordinator has no rows to dump");
+}
+
+SubscriptionPtr ShardedStorage::subscribe(JoinKind, size_t, SubscriptionNotify)
+{
+    throw std::invalid_argument("SUBSCRIBE on the shards");
+}
+
+std::vector<ShardedStorage::Reply> ShardedStorage::scatter(
+        const std::vector<std::string>& commands) const
+{
+    std::vector<Reply> replies(shards_.size());
+    std::vector<std::string> errors(shards_.size());
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        if (commands[i].empty()) {
+            continue;
+        }
+        workers.emplace_back([&, i]() {
+            try {
+                Reply& r = replies[i];
+                r.ok = shards_[i]->call(commands[i], r.text, r.rows);
+                r.sent = true;
+            }
+            catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    for (const auto& error : errors) {
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+    return replies;
+}
+
+std::vector<std::string> ShardedStorage::split(const char* verb, const JoinRange& range,
+                                               bool count) const
+{
+    std::vector<std::string> commands(shards_.size());
+    for (size_t i = 0; i < shards_.size(); ++i) {
+        const bool last = i + 1 == shards_.size();
+        const int64_t from = std::max(range.from, shards_[i]->shard().from);
+        const bool has_to = range.has_to || !last;
+        int64_t to = range.has_to ? range.to : std::numeric_limits<int64_t>::max();
+        if (!last) {
+            to = std::min(to, shards_[i + 1]->shard().from);
+        }
+        if (has_to && from >= to) {
+            continue;
+        }
+
+        std::string& c = commands[i];
+        c = verb;
+        if (from != JoinRange().from) {
+            c += " FROM " + std::to_string(from);
+        }
+        if (has_to) {
+            c += " TO " + std::to_string(to);
+        }
+        if (count) {
+            // The shards count all their rows, the slice is cut here.
+            c += " COUNT";
+            continue;
+        }
+        if (range.order == JoinOrder::Desc) {
+            c += " ORDER DESC";
+        }
+        if (range.limit != JoinRange().limit) {
+            c += " LIMIT " + std::to_string(head(range));
+        }
+        if (range.order == JoinOrder::Any) {
+            c += " UNORDERED";
+        }
+    }
+    return commands;
+}
+
+result_table_t ShardedStorage::join(const char* verb, const JoinRange& range) const
+{
+    const auto replies = scatter(split(verb, range, false));
+    auto result = std::make_shared<ShardRows>();
+    size_t skip = range.offset;
+    size_t limit = range.limit;
+    for (size_t n = 0; n < replies.size() && limit > 0; ++n) {
+        // Descending joins take the shards from the last one.
+        const Reply& r = replies[range.order == JoinOrder::Desc ? replies.size() - 1 - n : n];
+        if (!r.sent) {
+            continue;
+        }
+        if (!r.ok) {
+            throw std::runtime_error(r.text);
+        }
+        const size_t taken = r.rows > skip ? std::min(r.rows - skip, limit) : 0;
+        result->append(r.text, skip, limit);
+        skip -= std::min(skip, r.rows);
+        limit -= taken;
+    }
+    return result;
+}
+
+size_t ShardedStorage::count(const char* verb, const JoinRange& range) const
+{
+    size_t total = 0;
+    for (const auto& r : scatter(split(verb, range, true))) {
+        if (r.sent && !r.ok) {
+            throw std::runtime_error(r.text);
+        }
+        total += r.sent ? std::strtoull(r.text.c_str(), nullptr, 10) : 0;
+    }
+    return slice(total, range);
+}
+
+Estimate ShardedStorage::estimate(const char* verb) const
+{
+    // The shards have disjoint ids, the values and the errors add up.
+    Estimate e { 0, 0 };
+    const std::string command = std::string(verb) + " ESTIMATE";
+    for (const auto& r : scatter(std::vector<std::string>(shards_.size(), command))) {
+        if (!r.ok) {
+            throw std::runtime_error(r.text);
+        }
+        char* end = nullptr;
+        e.value += std::strtod(r.text.c_str(), &end);
+        e.error += std::strtod(end + 1, nullptr);
+    }
+    return e;
+}
+
+result_table_t ShardedStorage::intersection(const JoinRange& range) const
+{
+    return join("INTERSECTION", range);
+}
+
+result_table_t ShardedStorage::symmetric_difference(const JoinRange& range) const
+{
+    return join("SYMMETRIC_DIFFERENCE", range);
+}
+
+size_t ShardedStorage::intersection_count(const JoinRange& range) const
+{
+    return count("INTERSECTION", range);
+}
+
+size_t ShardedStorage::symmetric_difference_count(const JoinRange& range) const
+{
+    return count("SYMMETRIC_DIFFERENCE", range);
+}
+
+Estimate ShardedStorage::intersection_estimate() const
+{
+    return estimate("INTERSECTION");
+}
+
+Estimate ShardedStorage::symmetric_difference_estimate() const
+{
+    return estimate("SYMMETRIC_DIFFERENCE");
+}
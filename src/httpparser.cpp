@@ -0,0 +1,278 @@
+#include "httpparser.h"
+#include <algorithm>
+#include <cctype>
+
+namespace {
+
+std::string lower(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) {
+        return static_cast<char>(std::tolower(c));
+    });
+    return text;
+}
+
+bool is_ctl(char c)
+{
+    return static_cast<unsigned char>(c) < 0x20 || c == 0x7f;
+}
+
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool decode(const std::string& text, size_t begin, size_t end, std::string& out)
+{
+    out.clear();
+    for (size_t i = begin; i < end; ++i) {
+        if (text[i] == '+') {
+            out.push_back(' ');
+        }
+        else if (text[i] != '%') {
+            out.push_back(text[i]);
+        }
+        else {
+            const int high = i + 2 < end ? hex_value(text[i + 1]) : -1;
+            const int low = high < 0 ? -1 : hex_value(text[i + 2]);
+            if (low < 0) {
+                return false;
+            }
+            out.push_back(static_cast<char>(high << 4 | low));
+            i += 2;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+bool parse_form(const std::string& text, std::map<std::string, std::string>& params)
+{
+    size_t begin = 0;
+    while (begin < text.size()) {
+        size_t end = text.find('&', begin);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        const size_t eq = std::min(text.find('=', begin), end);
+        std::string name;
+        std::string value;
+        if (!decode(text, begin, eq, name)
+            || !decode(text, std::min(eq + 1, end), end, value)) {
+            return false;
+        }
+        if (!name.empty()) {
+            params[name] = value;
+        }
+        begin = end + 1;
+    }
+    return true;
+}
+
+HttpParser::Result HttpParser::parse(HttpRequest& request, const char* data, size_t size)
+{
+    if (state_ == State::Done) {
+        state_ = State::Method;
+        size_ = 0;
+        target_.clear();
+        version_.clear();
+        body_.clear();
+        content_length_ = 0;
+        form_ = false;
+        close_ = false;
+        keep_alive_ = false;
+        request = HttpRequest();
+    }
+
+    consumed_ = 0;
+    while (consumed_ < size) {
+        if (state_ == State::Body) {
+            // The body is copied as a whole, not byte by byte.
+            const size_t n = std::min(content_length_ - body_.size(), size - consumed_);
+            body_.append(data + consumed_, n);
+            consumed_ += n;
+            if (body_.size() == content_length_) {
+                return finish(request);
+            }
+            continue;
+        }
+        if (++size_ > max_size_) {
+            return fail("request too large");
+        }
+        const Result result = consume(request, data[consumed_++]);
+        if (result != Result::Indeterminate) {
+            return result;
+        }
+    }
+    return Result::Indeterminate;
+}
+
+HttpParser::Result HttpParser::consume(HttpRequest& request, char c)
+{
+    switch (state_) {
+        case State::Method:
+            if (c == ' ' && !request.method.empty()) {
+                state_ = State::Target;
+            }
+            else if (c >= 'A' && c <= 'Z') {
+                request.method.push_back(c);
+            }
+            else {
+                return fail("bad method");
+            }
+            break;
+
+        case State::Target:
+            if (c == ' ' && !target_.empty()) {
+                state_ = State::Version;
+            }
+            else if (c == ' ' || is_ctl(c)) {
+                return fail("bad target");
+            }
+            else {
+                target_.push_back(c);
+            }
+            break;
+
+        case State::Version:
+            if (c != '\r') {
+                version_.push_back(c);
+                break;
+            }
+            if (version_ != "HTTP/1.1" && version_ != "HTTP/1.0") {
+                return fail("unsupported version");
+            }
+            request.version_minor = version_.back() - '0';
+            state_ = State::RequestLineEnd;
+            break;
+
+        case State::RequestLineEnd:
+        case State::HeaderLineEnd:
+            if (c != '\n') {
+                return fail("bad line end");
+            }
+            state_ = State::HeaderStart;
+            break;
+
+        case State::HeaderStart:
+            if (c == '\r') {
+                state_ = State::HeadersEnd;
+                break;
+            }
+            name_.clear();
+            value_.clear();
+            state_ = State::HeaderName;
+            // fall through
+        case State::HeaderName:
+            if (c == ':' && !name_.empty()) {
+                state_ = State::HeaderValue;
+            }
+            else if (c == ':' || c == ' ' || is_ctl(c)) {
+                return fail("bad header");
+            }
+            else {
+                name_.push_back(c);
+            }
+            break;
+
+        case State::HeaderValue:
+            if (c == '\r') {
+                if (!header(request)) {
+                    return Result::Bad;
+                }
+                state_ = State::HeaderLineEnd;
+            }
+            else if (c == '\t' || !is_ctl(c)) {
+                if ((c != ' ' && c != '\t') || !value_.empty()) {
+                    value_.push_back(c);
+                }
+            }
+            else {
+                return fail("bad header");
+            }
+            break;
+
+        case State::HeadersEnd:
+            if (c != '\n') {
+                return fail("bad line end");
+            }
+            if (content_length_ == 0) {
+                return finish(request);
+            }
+            if (size_ + content_length_ > max_size_) {
+                return fail("request too large");
+            }
+            state_ = State::Body;
+            break;
+
+        default:
+            break;
+    }
+    return Result::Indeterminate;
+}
+
+bool HttpParser::header(HttpRequest& request)
+{
+    while (!value_.empty() && (value_.back() == ' ' || value_.back() == '\t')) {
+        value_.pop_back();
+    }
+    const std::string name = lower(name_);
+    const std::string value = lower(value_);
+
+    if (name == "content-length") {
+        if (value.empty() || value.size() > 18
+            || !std::all_of(value.begin(), value.end(), ::isdigit)) {
+            fail("bad content-length");
+            return false;
+        }
+        content_length_ = std::stoul(value);
+    }
+    else if (name == "transfer-encoding") {
+        fail("request bodies need a content-length");
+        return false;
+    }
+    else if (name == "connection") {
+        close_ = value.find("close") != std::string::npos;
+        keep_alive_ = value.find("keep-alive") != std::string::npos;
+    }
+    else if (name == "accept") {
+        request.ndjson = value.find("application/x-ndjson") != std::string::npos;
+    }
+    else if (name == "content-type") {
+        form_ = value.compare(0, 33, "application/x-www-form-urlencoded") == 0;
+    }
+    return true;
+}
+
+HttpParser::Result HttpParser::finish(HttpRequest& request)
+{
+    state_ = State::Done;
+    request.keep_alive = request.version_minor == 1 ? !close_ : keep_alive_;
+
+    const size_t query = target_.find('?');
+    request.path = target_.substr(0, query);
+    if (query != std::string::npos && !parse_form(target_.substr(query + 1), request.params)) {
+        return fail("bad query string");
+    }
+    if (form_ && !parse_form(body_, request.params)) {
+        return fail("bad form");
+    }
+    return Result::Good;
+}
+
+HttpParser::Result HttpParser::fail(const std::string& what)
+{
+    state_ = State::Done;
+    error_ = what;
+    return Result::Bad;
+}
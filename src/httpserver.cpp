@@ -0,0 +1,452 @@
+#include "httpserver.h"
+#include "interpreter.h"
+#include "logger.h"
+#include "storage.h"
+#include <spdlog/fmt/ostr.h>
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using asio::ip::tcp;
+
+namespace {
+
+/// Rows per chunk of a streamed join.
+const size_t chunk_rows = 4096;
+
+const char* const json_type = "application/json";
+const char* const ndjson_type = "application/x-ndjson";
+
+const char* status_text(int status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 409: return "Conflict";
+        case 503: return "Service Unavailable";
+        default: return "Internal Server Error";
+    }
+}
+
+std::string error_body(const std::string& message)
+{
+    std::string body = "{\"error\":";
+    detail::append_json(body, message);
+    body.push_back('}');
+    return body;
+}
+
+std::string upper(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) {
+        return static_cast<char>(std::toupper(c));
+    });
+    return text;
+}
+
+/**
+ * @brief The join parameters as the clauses of the line protocol, in the
+ *        order parse_join() wants them. False for an unknown parameter.
+ */
+bool join_arguments(const std::map<std::string, std::string>& params, arguments_t& args)
+{
+    static const char* const clauses[] = { "from", "to", "order", "limit", "offset" };
+    static const char* const flags[] = { "unordered", "count", "estimate" };
+
+    size_t known = 0;
+    for (const char* clause : clauses) {
+        auto found = params.find(clause);
+        if (found != params.end()) {
+            args.push_back(upper(clause));
+            args.push_back(found->first == "order" ? upper(found->second) : found->second);
+            ++known;
+        }
+    }
+    for (const char* flag : flags) {
+        auto found = params.find(flag);
+        if (found != params.end() && found->second != "0" && found->second != "false") {
+            args.push_back(upper(flag));
+        }
+        known += found != params.end();
+    }
+    return known == params.size();
+}
+
+} // namespace
+
+HttpSession::HttpSession(tcp::socket socket, const ProcessorContext& context,
+                         SessionManager& manager, const ServerConfig& config)
+    : socket_(std::move(socket))
+    , timer_(socket_.get_io_service())
+    , context_(context)
+    , processor_(std::make_unique<Processor>(context, [this](std::function<void()> task)
+    {
+        socket_.get_io_service().post(std::move(task));
+    }))
+    , client_(context.scheduler ? context.scheduler->add_client() : nullptr)
+    , manager_(manager)
+    , config_(config)
+{
+}
+
+void HttpSession::start()
+{
+    LOG_DEBUG("START: http session = {}", static_cast<void*>(this));
+    do_read();
+}
+
+void HttpSession::stop()
+{
+    asio::error_code ignored;
+    timer_.cancel(ignored);
+    socket_.shutdown(tcp::socket::shutdown_both, ignored);
+    socket_.close(ignored);
+}
+
+void HttpSession::drain()
+{
+    draining_ = true;
+    if (write_queue_.empty() && !busy_) {
+        manager_.stop(shared_from_this());
+    }
+}
+
+void HttpSession::arm_timer()
+{
+    timer_.expires_from_now(begin_ == end_ ? config_.idle_timeout : config_.read_timeout);
+    auto self(shared_from_this());
+    timer_.async_wait(make_custom_alloc_handler(timer_memory_,
+                                                [this, self](const std::error_code& ec)
+    {
+        if (ec == asio::error::operation_aborted
+            || timer_.expires_at() > asio::steady_timer::clock_type::now()) {
+            return;
+        }
+        LOG_DEBUG("timeout: http session = {}", static_cast<void*>(this));
+        manager_.stop(self);
+    }));
+}
+
+void HttpSession::do_read()
+{
+    auto self(shared_from_this());
+    if (begin_ > 0) {
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+
+    arm_timer();
+    socket_.async_read_some(asio::buffer(buffer_.data() + end_, max_length - end_),
+                            make_custom_alloc_handler(read_memory_,
+                                                      [this, self](const std::error_code& ec,
+                                                                   std::size_t bytes)
+    {
+        if (ec) {
+            LOG_DEBUG("read failed: http session = {} ec = {}",
+                      static_cast<void*>(this), ec);
+            manager_.stop(self);
+            return;
+        }
+        end_ += bytes;
+        process_input();
+    }));
+}
+
+void HttpSession::process_input()
+{
+    if (draining_) {
+        manager_.stop(shared_from_this());
+        return;
+    }
+
+    const auto result = parser_.parse(request_, buffer_.data() + begin_, end_ - begin_);
+    begin_ += parser_.consumed();
+    if (result == HttpParser::Result::Indeterminate) {
+        // The parser keeps what it has seen, the whole buffer is free.
+        do_read();
+        return;
+    }
+
+    busy_ = true;
+    if (result == HttpParser::Result::Bad) {
+        keep_alive_ = false;
+        reply(400, error_body(parser_.error()));
+        return;
+    }
+    keep_alive_ = request_.keep_alive;
+    LOG_SAMPLED("http session = {} {} {}", static_cast<void*>(this),
+                request_.method, request_.path);
+    handle();
+}
+
+void HttpSession::handle()
+{
+    const std::string& path = request_.path;
+    const bool post = request_.method == "POST";
+    const bool get = request_.method == "GET";
+    auto param = [this](const char* name) {
+        auto found = request_.params.find(name);
+        return found == request_.params.end() ? std::string() : found->second;
+    };
+
+    if (path == "/insert" || path == "/truncate") {
+        if (!post) {
+            reply(405, error_body("use POST"));
+        }
+        else if (path == "/insert") {
+            update("INSERT", { param("table"), param("id"), param("name") });
+        }
+        else {
+            update("TRUNCATE", { param("table") });
+        }
+    }
+    else if (path == "/intersection" || path == "/symmetric_difference") {
+        if (!get) {
+            reply(405, error_body("use GET"));
+        }
+        else {
+            join(path == "/intersection" ? JoinKind::Intersection
+                                         : JoinKind::SymmetricDifference);
+        }
+    }
+    else {
+        reply(404, error_body("unknown path"));
+    }
+}
+
+void HttpSession::update(const std::string& verb, const arguments_t& args)
+{
+    // Light commands reply before execute() returns, on a coordinator
+    // the reply is posted once the shard answered.
+    auto self(shared_from_this());
+    processor_->execute(verb, args, [this, self](std::string result)
+    {
+        if (result == "OK") {
+            reply(200, "{\"ok\":true}");
+        }
+        else {
+            const std::string message = result.compare(0, 4, "ERR ") == 0 ? result.substr(4)
+                                                                           : result;
+            reply(message.compare(0, 9, "duplicate") == 0 ? 409 : 400, error_body(message));
+        }
+    });
+}
+
+void HttpSession::join(JoinKind kind)
+{
+    arguments_t args;
+    JoinRange range;
+    JoinOutput output = JoinOutput::Rows;
+    if (!join_arguments(request_.params, args) || !parse_join(args, range, output)) {
+        reply(400, error_body("wrong arguments"));
+        return;
+    }
+
+    IStorage& storage = context_.storage;
+    const bool intersection = kind == JoinKind::Intersection;
+    // The join runs on a worker, the response is sent from the io_service.
+    auto self(shared_from_this());
+    auto job = [this, self, &storage, intersection, range, output]()
+    {
+        result_table_t rows;
+        std::string body;
+        int status = 200;
+        try {
+            if (output == JoinOutput::Estimate) {
+                const Estimate e = intersection ? storage.intersection_estimate()
+                                                : storage.symmetric_difference_estimate();
+                body = "{\"estimate\":" + std::to_string(std::llround(e.value))
+                       + ",\"error\":" + std::to_string(std::llround(e.error)) + "}";
+            }
+            else if (output == JoinOutput::Count) {
+                const size_t n = intersection ? storage.intersection_count(range)
+                                              : storage.symmetric_difference_count(range);
+                body = "{\"count\":" + std::to_string(n) + "}";
+            }
+            else {
+                rows = intersection ? storage.intersection(range)
+                                    : storage.symmetric_difference(range);
+            }
+        }
+        catch (const std::exception& e) {
+            status = 400;
+            body = error_body(e.what());
+        }
+        socket_.get_io_service().post([this, self, rows, body, status]()
+        {
+            if (rows) {
+                send_rows(rows);
+            }
+            else {
+                reply(status, body);
+            }
+        });
+    };
+
+    // The rule of Join::heavy(): the estimates read the sketches only,
+    // unless they are on the shards.
+    if (!context_.scheduler || (output == JoinOutput::Estimate && !storage.remote())) {
+        job();
+    }
+    else if (!context_.scheduler->submit(client_, job)) {
+        reply(503, error_body("busy"));
+    }
+}
+
+std::string HttpSession::head(int status, const char* content_type) const
+{
+    std::string out = "HTTP/1.1 " + std::to_string(status) + " " + status_text(status)
+                      + "\r\nContent-Type: " + content_type
+                      + "\r\nConnection: " + (keep_alive_ ? "keep-alive" : "close") + "\r\n";
+    return out;
+}
+
+void HttpSession::reply(int status, const std::string& body)
+{
+    busy_ = false;
+    deliver(head(status, json_type) + "Content-Length: " + std::to_string(body.size())
+            + "\r\n\r\n" + body);
+}
+
+void HttpSession::send_rows(result_table_t rows)
+{
+    const bool ndjson = request_.ndjson;
+    if (rows->size() <= chunk_rows || request_.version_minor == 0) {
+        std::string body = ndjson ? "" : "[";
+        rows->print_json(body, 0, rows->size(), ndjson);
+        if (!ndjson) {
+            body.push_back(']');
+        }
+        busy_ = false;
+        deliver(head(200, ndjson ? ndjson_type : json_type) + "Content-Length: "
+                + std::to_string(body.size()) + "\r\n\r\n" + body);
+        return;
+    }
+
+    stream_ = rows;
+    next_row_ = 0;
+    deliver(head(200, ndjson ? ndjson_type : json_type)
+            + "Transfer-Encoding: chunked\r\n\r\n");
+}
+
+void HttpSession::next_chunk()
+{
+    const bool ndjson = request_.ndjson;
+    std::string data = !ndjson && next_row_ == 0 ? "[" : "";
+    const size_t end = std::min(next_row_ + chunk_rows, stream_->size());
+    stream_->print_json(data, next_row_, end, ndjson);
+    next_row_ = end;
+
+    const bool last = next_row_ == stream_->size();
+    if (last && !ndjson) {
+        data.push_back(']');
+    }
+
+    char size[24];
+    std::snprintf(size, sizeof(size), "%zx\r\n", data.size());
+    data.insert(0, size);
+    data.append("\r\n");
+    if (last) {
+        data.append("0\r\n\r\n");
+        stream_.reset();
+        busy_ = false;
+    }
+    deliver(std::move(data));
+}
+
+void HttpSession::deliver(std::string data)
+{
+    const bool write_in_progress = !write_queue_.empty();
+    write_queue_.push_back(std::move(data));
+    if (!write_in_progress) {
+        do_write();
+    }
+}
+
+void HttpSession::do_write()
+{
+    auto self(shared_from_this());
+    asio::async_write(socket_, asio::buffer(write_queue_.front()),
+                      make_custom_alloc_handler(write_memory_,
+                                                [this, self](std::error_code ec, std::size_t)
+    {
+        if (ec) {
+            manager_.stop(self);
+            return;
+        }
+        write_queue_.pop_front();
+        if (!write_queue_.empty()) {
+            do_write();
+        }
+        else if (stream_) {
+            next_chunk();
+        }
+        else if (!busy_) {
+            response_done();
+        }
+    }));
+}
+
+void HttpSession::response_done()
+{
+    if (!keep_alive_ || draining_) {
+        manager_.stop(shared_from_this());
+        return;
+    }
+    process_input();
+}
+
+HttpServer::HttpServer(asio::io_service& io_service, unsigned short port,
+                       const ProcessorContext& context, const ServerConfig& config)
+    : acceptor_(io_service, tcp::endpoint(tcp::v4(), port))
+    , socket_(io_service)
+    , context_(context)
+    , config_(config)
+{
+    do_accept();
+}
+
+void HttpServer::drain(std::function<void()> on_drained)
+{
+    asio::error_code ignored;
+    acceptor_.close(ignored);
+    manager_.drain_all(std::move(on_drained));
+}
+
+void HttpServer::stop()
+{
+    asio::error_code ignored;
+    acceptor_.close(ignored);
+    manager_.stop_all();
+}
+
+void HttpServer::do_accept()
+{
+    acceptor_.async_accept(socket_, [this](std::error_code ec)
+    {
+        if (!acceptor_.is_open()) {
+            return;
+        }
+
+        if (!ec) {
+            if (manager_.size() >= config_.max_connections) {
+                const std::string message = "HTTP/1.1 503 Service Unavailable\r\n"
+                                            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+                asio::error_code ignored;
+                asio::write(socket_, asio::buffer(message), ignored);
+                socket_.close(ignored);
+            }
+            else {
+                manager_.start(std::make_shared<HttpSession>(std::move(socket_), context_,
+                                                             manager_, config_));
+            }
+        }
+
+        do_accept();
+    });
+}
@@ -10,3 +10,85 @@ bool TerminalExpression::interpret(const std::string& input)
 {
     return std::regex_match(input, reg_exp_);
 }
+
+const expr_t& Grammar::table_name()
+{
+    static const expr_t expr = std::make_shared<term_t>("[AB]");
+    return expr;
+}
+
+const expr_t& Grammar::id_field()
+{
+    static const expr_t expr = std::make_shared<term_t>("-?[0-9]+");
+    return expr;
+}
+
+const expr_t& Grammar::name_field()
+{
+    static const expr_t expr = std::make_shared<term_t>("[^\\x00-\\x20\\x7f]+");
+    return expr;
+}
+
+const expr_t& Grammar::count_field()
+{
+    static const expr_t expr = std::make_shared<term_t>("[0-9]+");
+    return expr;
+}
+
+bool parse_join(std::vector<std::string> args, JoinRange& range, JoinOutput& output)
+{
+    static const char* const clauses[] = { "FROM", "TO", "ORDER", "LIMIT", "OFFSET" };
+    const size_t n_clauses = sizeof(clauses) / sizeof(clauses[0]);
+
+    output = JoinOutput::Rows;
+    if (args.size() == 1 && args.front() == "ESTIMATE") {
+        output = JoinOutput::Estimate;
+        return true;
+    }
+    if (!args.empty() && args.back() == "COUNT") {
+        output = JoinOutput::Count;
+        args.pop_back();
+    }
+    const bool unordered = !args.empty() && args.back() == "UNORDERED";
+    if (unordered) {
+        range.order = JoinOrder::Any;
+        args.pop_back();
+    }
+
+    size_t clause = 0;
+    for (size_t i = 0; i < args.size(); i += 2) {
+        while (clause < n_clauses && args[i] != clauses[clause]) {
+            ++clause;
+        }
+        if (clause == n_clauses || i + 1 == args.size()) {
+            return false;
+        }
+
+        const std::string& value = args[i + 1];
+        if (clause == 2) {
+            if (unordered || (value != "ASC" && value != "DESC")) {
+                return false;
+            }
+            range.order = value == "ASC" ? JoinOrder::Asc : JoinOrder::Desc;
+            ++clause;
+            continue;
+        }
+        const bool is_id = clause < 2;
+        if (!(is_id ? Grammar::id_field() : Grammar::count_field())->interpret(value)) {
+            return false;
+        }
+        try {
+            switch (clause) {
+            case 0: range.from = std::stoll(value); break;
+            case 1: range.to = std::stoll(value); range.has_to = true; break;
+            case 3: range.limit = std::stoull(value); break;
+            case 4: range.offset = std::stoull(value); break;
+            }
+        }
+        catch (const std::out_of_range&) {
+            return false;
+        }
+        ++clause;
+    }
+    return true;
+}
@@ -1,3 +1,22 @@
 #include "logger.h"
 
 LoggerPtr gLogger = spdlog::stdout_color_mt("console");
+LogSampler gLogSampler;
+
+void init_logger(const LogConfig& config)
+{
+    if (config.async) {
+        // The async queue is a bounded lock-free queue, with discard
+        // policy the session threads never wait for the console.
+        spdlog::drop("console");
+        spdlog::set_async_mode(config.async_queue_size,
+                               spdlog::async_overflow_policy::discard_log_msg);
+        gLogger = spdlog::stdout_color_mt("console");
+    }
+
+    if (config.debug) {
+        gLogger->set_level(spdlog::level::debug);
+    }
+
+    gLogSampler.set_rate(config.sample_rate);
+}
@@ -1,59 +1,202 @@
+#include "coordinator.h"
+#include "httpserver.h"
 #include "logger.h"
+#include "options.h"
+#include "replication.h"
+#include "resultcache.h"
+#include "scheduler.h"
 #include "server.h"
 #include "storage.h"
+#ifdef JOIN_SERVER_HAS_IO_URING
+#include "uringserver.h"
+#endif
 
+#include <atomic>
 #include <iostream>
 #include <string>
 #include <thread>
 
 /**
  * @brief Terminates io service
+ *
+ * SIGINT stops at once, SIGTERM drains the sessions first and stops
+ * when they are gone or the drain timeout expires.
  */
 class SignalHandler
 {
     public:
-        SignalHandler(asio::io_service& io_service)
-            : io_service_(io_service) {}
+        SignalHandler(asio::io_service& io_service, asio::signal_set& signals,
+                      asio::steady_timer& timer, std::vector<IServer*> servers,
+                      std::chrono::seconds drain_timeout)
+            : io_service_(io_service)
+            , signals_(signals)
+            , timer_(timer)
+            , servers_(std::move(servers))
+            , drain_timeout_(drain_timeout) {}
 
-        void operator()(const std::error_code&, int signum)
+        void operator()(const std::error_code& ec, int signum)
         {
-            gLogger->debug("End of service requested by user. {}.", signum);
-            io_service_.stop();
+            if (ec) {
+                return;
+            }
+
+            if (signum != SIGTERM || draining_) {
+                gLogger->debug("End of service requested by user. {}.", signum);
+                io_service_.stop();
+                return;
+            }
+
+            gLogger->info("Draining sessions, {} seconds left.",
+                          drain_timeout_.count());
+            draining_ = true;
+            // The last server to drain stops the service.
+            auto& io_service = io_service_;
+            auto left = std::make_shared<std::atomic<size_t>>(servers_.size());
+            for (auto* server : servers_) {
+                server->drain([&io_service, left]()
+                {
+                    if (--*left == 0) {
+                        io_service.stop();
+                    }
+                });
+            }
+
+            timer_.expires_from_now(drain_timeout_);
+            timer_.async_wait([&io_service](const std::error_code& ec)
+            {
+                if (!ec) {
+                    io_service.stop();
+                }
+            });
+            // A second signal stops without waiting.
+            signals_.async_wait(*this);
         }
 
     private:
         asio::io_service& io_service_;
+        asio::signal_set& signals_;
+        asio::steady_timer& timer_;
+        std::vector<IServer*> servers_;
+        std::chrono::seconds drain_timeout_;
+        bool draining_ = false;
 };
 
 int main(int argc, char const** argv)
 {
+    const std::string program =
+            std::string(argv[0]).substr(std::string(argv[0]).rfind("/") + 1);
+    Options options;
     try {
-        if (argc < 2) {
-            std::cout << "usage: "
-                      << std::string(argv[0]).substr(std::string(argv[0]).rfind("/") + 1)
-                      << " <port> [d]\n"
-                         "where:\n"
-                         "  port - tcp port for incomming connections\n"
-                         "  d - print debug info\n"
-                         "\nUse Ctrl-C to stop the service.\n";
-            exit(1);
+        options = parse_options(argc, argv);
+    }
+    catch (const std::invalid_argument& e) {
+        if (argc > 1) {
+            std::cerr << e.what() << "\n";
         }
+        std::cout << usage(program);
+        exit(1);
+    }
 
-        if (argc > 2) {
-            gLogger->set_level(spdlog::level::debug);
-        }
+    try {
+        init_logger(options.log);
 
         asio::io_service io_service;
 
+        // The log outlives the storage that appends to it.
+        MutationLog log;
+        StorageUPtr db = options.shards.empty()
+                         ? make_storage(options.key_type, options.data_dir)
+                         : std::make_unique<ShardedStorage>(options.key_type, options.shards);
+        Scheduler scheduler(options.scheduler);
+        ResultCache cache(options.cache_size);
+        // The shards change without the coordinator knowing.
+        const bool cached = options.cache_size && options.shards.empty();
+
+        std::unique_ptr<ReplicationServer> primary;
+        std::unique_ptr<ReplicaClient> replica;
+        const IReplication* replication = nullptr;
+        if (options.replication_port) {
+            primary = std::make_unique<ReplicationServer>(io_service, options.replication_port,
+                                                          *db, log);
+            replication = primary.get();
+        }
+        else if (!options.replica_of.empty()) {
+            replica = std::make_unique<ReplicaClient>(io_service, options.replica_of, *db);
+            replication = replica.get();
+        }
+
+        const ProcessorContext context { *db, &scheduler, cached ? &cache : nullptr,
+                                         replication };
+        std::unique_ptr<IServer> server;
+        std::thread uring_thread;
+
+        if (options.transport == Transport::Uring) {
+#ifdef JOIN_SERVER_HAS_IO_URING
+            try {
+                auto uring = std::make_unique<UringServer>(options.port, context,
+                                                           options.server);
+                uring_thread = std::thread([&io_service, u = uring.get()]()
+                {
+                    try {
+                        u->run();
+                    }
+                    catch (const std::exception& e) {
+                        gLogger->error("uring transport failed: {}", e.what());
+                    }
+                    io_service.stop();
+                });
+                server = std::move(uring);
+            }
+            catch (const UringUnavailable& e) {
+                gLogger->warn("io_uring is not available ({}), using epoll.",
+                              e.what());
+            }
+#else
+            gLogger->warn("Built without io_uring support, using epoll.");
+#endif
+        }
+        if (!server) {
+            server = std::make_unique<Server>(io_service, options.port, context,
+                                              options.server);
+        }
+
+        std::unique_ptr<HttpServer> http;
+        std::vector<IServer*> servers { server.get() };
+        if (options.http_port) {
+            http = std::make_unique<HttpServer>(io_service, options.http_port, context,
+                                                options.server);
+            servers.push_back(http.get());
+        }
+        if (primary) {
+            servers.push_back(primary.get());
+        }
+
         asio::signal_set signals(io_service, SIGINT, SIGTERM);
-        SignalHandler sh(io_service);
+        asio::steady_timer drain_timer(io_service);
+        SignalHandler sh(io_service, signals, drain_timer, servers,
+                         options.server.drain_timeout);
         signals.async_wait(sh);
 
-        Storage db;
-        Server s(io_service, std::atoi(argv[1]), db);
-
         io_service.run();
 
+        server->stop();
+        if (http) {
+            http->stop();
+        }
+        if (primary) {
+            primary->stop();
+        }
+        if (replica) {
+            replica->stop();
+        }
+        if (uring_thread.joinable()) {
+            uring_thread.join();
+        }
+        // The workers post the replies to the server, stop them first.
+        scheduler.stop();
+        gLogger->info("Result cache: {} hits, {} misses.",
+                      cache.hits(), cache.misses());
+
         std::cout << "\n";
     }
     catch (const std::exception& e) {
@@ -0,0 +1,62 @@
+#include "mutationlog.h"
+#include <random>
+
+MutationLog::MutationLog(size_t max_bytes)
+    : max_bytes_(max_bytes)
+    , epoch_((uint64_t(std::random_device()()) << 32) | std::random_device()())
+{
+}
+
+uint64_t MutationLog::append(std::string command)
+{
+    std::vector<Waiter> waiters;
+    uint64_t lsn;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        bytes_ += command.size();
+        entries_.push_back(std::move(command));
+        while (bytes_ > max_bytes_ && entries_.size() > 1) {
+            bytes_ -= entries_.front().size();
+            entries_.pop_front();
+            ++first_lsn_;
+        }
+        lsn = first_lsn_ + entries_.size() - 1;
+        waiters.swap(waiters_);
+    }
+    for (auto& w : waiters) {
+        w();
+    }
+    return lsn;
+}
+
+uint64_t MutationLog::last_lsn() const
+{
+    std::lock_guard<std::mutex> lock(m_);
+    return first_lsn_ + entries_.size() - 1;
+}
+
+bool MutationLog::read(uint64_t& lsn, std::string& out, size_t max_bytes) const
+{
+    std::lock_guard<std::mutex> lock(m_);
+    if (lsn + 1 < first_lsn_) {
+        return false;
+    }
+    for (uint64_t i = lsn + 1 - first_lsn_; i < entries_.size() && out.size() < max_bytes; ++i) {
+        lsn = first_lsn_ + i;
+        out.append(std::to_string(lsn));
+        out.push_back(' ');
+        out.append(entries_[i]);
+        out.push_back('\n');
+    }
+    return true;
+}
+
+bool MutationLog::wait(uint64_t lsn, Waiter waiter)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    if (lsn < first_lsn_ + entries_.size() - 1) {
+        return false;
+    }
+    waiters_.push_back(std::move(waiter));
+    return true;
+}
@@ -0,0 +1,230 @@
+#include "options.h"
+#include <limits>
+#include <stdexcept>
+
+namespace {
+
+/// Highest weight of a client in the options.
+const size_t max_weight = 1000000;
+
+size_t to_number(const std::string& option, const std::string& value)
+{
+    try {
+        size_t pos = 0;
+        const unsigned long n = std::stoul(value, &pos);
+        if (pos == value.size()) {
+            return n;
+        }
+    }
+    catch (const std::logic_error&) {
+    }
+    throw std::invalid_argument("bad value for " + option + ": " + value);
+}
+
+unsigned short to_port(const std::string& option, const std::string& value)
+{
+    const size_t port = to_number(option, value);
+    if (port > std::numeric_limits<unsigned short>::max()) {
+        throw std::invalid_argument("bad value for " + option + ": " + value);
+    }
+    return static_cast<unsigned short>(port);
+}
+
+bool to_switch(const std::string& option, const std::string& value)
+{
+    if (value == "on" || value == "off") {
+        return value == "on";
+    }
+    throw std::invalid_argument("bad value for " + option + ": " + value);
+}
+
+} // namespace
+
+Options parse_options(int argc, char const** argv)
+{
+    if (argc < 2) {
+        throw std::invalid_argument("port is required");
+    }
+
+    Options options;
+    options.port = to_port("port", argv[1]);
+
+    for (int i = 2; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument(arg + " requires a value");
+            }
+            return argv[++i];
+        };
+
+        if (arg == "d") {
+            options.log.debug = true;
+        }
+        else if (arg == "--async-log") {
+            options.log.async = true;
+        }
+        else if (arg == "--log-sample") {
+            options.log.sample_rate = to_number(arg, value());
+        }
+        else if (arg == "--idle-timeout") {
+            options.server.idle_timeout = std::chrono::seconds(to_number(arg, value()));
+        }
+        else if (arg == "--read-timeout") {
+            options.server.read_timeout = std::chrono::seconds(to_number(arg, value()));
+        }
+        else if (arg == "--max-connections") {
+            options.server.max_connections = to_number(arg, value());
+        }
+        else if (arg == "--subscriber-queue") {
+            options.server.subscriber_queue = to_number(arg, value());
+            if (options.server.subscriber_queue == 0) {
+                throw std::invalid_argument("--subscriber-queue must be positive");
+            }
+        }
+        else if (arg == "--output-limit") {
+            options.server.output_high_water = to_number(arg, value()) * 1024;
+            if (options.server.output_high_water == 0) {
+                throw std::invalid_argument("--output-limit must be positive");
+            }
+        }
+        else if (arg == "--tcp-nodelay") {
+            options.server.no_delay = to_switch(arg, value());
+        }
+        else if (arg == "--tcp-cork") {
+            options.server.cork = to_switch(arg, value());
+        }
+        else if (arg == "--drain-timeout") {
+            options.server.drain_timeout = std::chrono::seconds(to_number(arg, value()));
+        }
+        else if (arg == "--max-heavy") {
+            options.scheduler.max_running = to_number(arg, value());
+        }
+        else if (arg == "--max-queued") {
+            options.scheduler.max_queued = to_number(arg, value());
+        }
+        else if (arg == "--client-quota") {
+            options.scheduler.max_per_client = to_number(arg, value());
+        }
+        else if (arg == "--client-weight" || arg == "--max-client-weight") {
+            const size_t weight = to_number(arg, value());
+            if (weight == 0 || weight > max_weight) {
+                throw std::invalid_argument(arg + " goes from 1 to "
+                                            + std::to_string(max_weight));
+            }
+            (arg == "--client-weight" ? options.scheduler.client_weight
+                                      : options.scheduler.max_weight) = unsigned(weight);
+        }
+        else if (arg == "--cache-size") {
+            options.cache_size = to_number(arg, value()) << 20;
+        }
+        else if (arg == "--http-port") {
+            options.http_port = to_port(arg, value());
+        }
+        else if (arg == "--data-dir") {
+            options.data_dir = value();
+        }
+        else if (arg == "--replication-port") {
+            options.replication_port = to_port(arg, value());
+        }
+        else if (arg == "--replica-of") {
+            options.replica_of = value();
+            const size_t colon = options.replica_of.rfind(':');
+            if (colon == 0 || colon == std::string::npos) {
+                throw std::invalid_argument("bad value for " + arg + ": " + options.replica_of);
+            }
+            to_port(arg, options.replica_of.substr(colon + 1));
+        }
+        else if (arg == "--shard") {
+            options.shards.push_back(parse_shard(value()));
+        }
+        else if (arg == "--key-type") {
+            const std::string key_type = value();
+            if (key_type == "int32") {
+                options.key_type = KeyType::Int32;
+            }
+            else if (key_type == "int64") {
+                options.key_type = KeyType::Int64;
+            }
+            else if (key_type == "string") {
+                options.key_type = KeyType::String;
+            }
+            else {
+                throw std::invalid_argument("bad value for " + arg + ": " + key_type);
+            }
+        }
+        else if (arg == "--transport") {
+            const std::string transport = value();
+            if (transport == "epoll") {
+                options.transport = Transport::Epoll;
+            }
+            else if (transport == "uring") {
+                options.transport = Transport::Uring;
+            }
+            else {
+                throw std::invalid_argument("bad value for " + arg + ": " + transport);
+            }
+        }
+        else {
+            throw std::invalid_argument("unknown option " + arg);
+        }
+    }
+    if (options.scheduler.client_weight > options.scheduler.max_weight) {
+        throw std::invalid_argument("--client-weight is above --max-client-weight");
+    }
+    if (options.replication_port && !options.replica_of.empty()) {
+        throw std::invalid_argument("a replica cannot be a primary");
+    }
+    if (!options.shards.empty()) {
+        if (options.replication_port || !options.replica_of.empty()) {
+            throw std::invalid_argument("a coordinator does not replicate");
+        }
+        if (options.key_type == KeyType::String) {
+            throw std::invalid_argument("shards need integer ids");
+        }
+        for (size_t i = 0; i < options.shards.size(); ++i) {
+            const bool from = options.shards[i].from != Shard().from;
+            if (from != (i > 0)
+                || (i > 0 && options.shards[i].from <= options.shards[i - 1].from)) {
+                throw std::invalid_argument("shards go up by id, all but the first "
+                                            "with FROM@");
+            }
+        }
+    }
+    return options;
+}
+
+std::string usage(const std::string& program)
+{
+    return "usage: " + program + " <port> [d] [options]\n"
+           "where:\n"
+           "  port - tcp port for incomming connections\n"
+           "  d - print debug info\n"
+           "options:\n"
+           "  --async-log - write the log from a background thread\n"
+           "  --log-sample N - log one of every N commands\n"
+           "  --idle-timeout SEC - close sessions idle for SEC seconds\n"
+           "  --read-timeout SEC - close sessions stuck in a command for SEC seconds\n"
+           "  --max-connections N - refuse connections above N\n"
+           "  --subscriber-queue N - changes a SUBSCRIBE client may fall behind\n"
+           "  --output-limit KB - replies queued for a client before its commands wait\n"
+           "  --tcp-nodelay on|off - send replies without delay, on by default\n"
+           "  --tcp-cork on|off - hold partial segments while replies are queued\n"
+           "  --drain-timeout SEC - time given to sessions on SIGTERM\n"
+           "  --max-heavy N - joins running at the same time\n"
+           "  --max-queued N - joins waiting, above it the client gets ERR busy\n"
+           "  --client-quota N - joins one client may have waiting or running\n"
+           "  --client-weight N - share of the joins of a new client, 1 by default\n"
+           "  --max-client-weight N - highest share a client may ask for with WEIGHT\n"
+           "  --cache-size MB - memory for cached join replies, 0 disables\n"
+           "  --http-port PORT - also serve HTTP/JSON queries on PORT\n"
+           "  --data-dir DIR - directory of the files of LOAD\n"
+           "  --replication-port PORT - be a primary, replicas connect to PORT\n"
+           "  --replica-of HOST:PORT - be a read-only replica of that primary\n"
+           "  --shard [FROM@]HOST:PORT - be a coordinator, the shard owns the ids\n"
+           "                             from FROM up to the FROM of the next one\n"
+           "  --key-type int32|int64|string - type of the ids of both tables\n"
+           "  --transport epoll|uring - socket backend, uring falls back to epoll\n"
+           "                            when the kernel does not support it\n"
+           "\nUse Ctrl-C to stop the service, SIGTERM to drain it.\n";
+}
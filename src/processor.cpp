@@ -1,14 +1,236 @@
 #include "processor.h"
 #include "commands.h"
+#include "logger.h"
+#include "resultcache.h"
 
-Processor::Processor(IStorage& storage)
-    : IProcessor(storage)
+Processor::Processor(const ProcessorContext& context, Post post)
+    : IProcessor(context.storage)
+    , context_(context)
+    , client_(context.scheduler ? context.scheduler->add_client() : nullptr)
+    , post_(std::move(post))
 {
 
 }
 
-ResultPrinterUPtr Processor::execute(const std::string& command)
+void Processor::execute(const std::string& command, Reply done)
 {
-    CommandUPtr cmd = CommandFactory::create(command, storage_);
-    return cmd->run();
+    // Exactly one space between the tokens.
+    arguments_t tokens;
+    std::string::size_type begin = 0;
+    for (;;) {
+        const auto end = command.find(' ', begin);
+        tokens.emplace_back(command, begin, end - begin);
+        if (end == std::string::npos) {
+            break;
+        }
+        begin = end + 1;
+    }
+
+    const std::string verb = std::move(tokens.front());
+    tokens.erase(tokens.begin());
+    execute(verb, tokens, std::move(done));
+}
+
+void Processor::execute(const std::string& verb, const arguments_t& args, Reply done)
+{
+    if (verb == "REPLICATION") {
+        done(replication(args));
+        return;
+    }
+    if (verb == "SUBSCRIBE" || verb == "UNSUBSCRIBE") {
+        // The stream of changes is kept by the sessions of the line protocol.
+        done(ErrorPrinter("SUBSCRIBE needs the asio transport").print());
+        return;
+    }
+
+    if (verb == "WEIGHT") {
+        done(weight(args));
+        return;
+    }
+    if (verb == "PREPARE") {
+        done(prepare(args));
+        return;
+    }
+    if (verb == "EXEC") {
+        exec(args, std::move(done));
+        return;
+    }
+    if (verb == "BEGIN" || verb == "COMMIT" || verb == "ROLLBACK") {
+        transaction(verb, args, std::move(done));
+        return;
+    }
+
+    std::shared_ptr<Command> cmd = CommandFactory::create(verb, storage_);
+    cmd->parse(args);
+    dispatch(std::move(cmd), std::move(done));
+}
+
+std::string Processor::weight(const arguments_t& args)
+{
+    if (!client_) {
+        return ErrorPrinter("WEIGHT needs the scheduler").print();
+    }
+    if (args.size() != 1 || !Grammar::count_field()->interpret(args[0]) || args[0].size() > 9
+        || !context_.scheduler->set_weight(client_, static_cast<unsigned>(std::stoul(args[0])))) {
+        return ErrorPrinter("wrong arguments").print();
+    }
+    return "OK";
+}
+
+std::string Processor::prepare(const arguments_t& args)
+{
+    if (args.size() < 2 || args[0] == "?") {
+        return ErrorPrinter("wrong arguments").print();
+    }
+    if (prepared_.size() >= max_prepared && prepared_.count(args[0]) == 0) {
+        return ErrorPrinter("too many prepared commands").print();
+    }
+    std::shared_ptr<Command> cmd = CommandFactory::create(args[1], storage_);
+    if (!cmd->prepare(arguments_t(args.begin() + 2, args.end()))) {
+        return ErrorPrinter("wrong arguments").print();
+    }
+    prepared_[args[0]] = std::move(cmd);
+    return "OK";
+}
+
+void Processor::exec(const arguments_t& args, Reply done)
+{
+    auto found = args.empty() ? prepared_.end() : prepared_.find(args[0]);
+    if (found == prepared_.end()) {
+        done(ErrorPrinter("unknown prepared command").print());
+        return;
+    }
+    found->second->bind(args, 1);
+    dispatch(found->second, std::move(done));
+}
+
+void Processor::transaction(const std::string& verb, const arguments_t& args, Reply done)
+{
+    if (!args.empty()) {
+        done(ErrorPrinter("wrong arguments").print());
+        return;
+    }
+    if (verb == "BEGIN") {
+        if (writes_) {
+            done(ErrorPrinter("transaction already open").print());
+        }
+        else if (storage_.remote()) {
+            done(ErrorPrinter("transactions on the shards").print());
+        }
+        else {
+            writes_ = std::make_unique<WriteSet>();
+            done("OK");
+        }
+        return;
+    }
+    if (!writes_) {
+        done(ErrorPrinter("no transaction").print());
+        return;
+    }
+    WriteSet writes = std::move(*writes_);
+    writes_.reset();
+    if (verb == "ROLLBACK") {
+        done("OK");
+        return;
+    }
+    dispatch(std::make_shared<Commit>(storage_, std::move(writes)), std::move(done));
+}
+
+void Processor::dispatch(std::shared_ptr<Command> cmd, Reply done)
+{
+    if (!cmd->valid()) {
+        done(ErrorPrinter("wrong arguments").print());
+        return;
+    }
+    if (cmd->mutates() && context_.replication && context_.replication->read_only()) {
+        done(ErrorPrinter("read-only replica").print());
+        return;
+    }
+    if (writes_ && cmd->mutates()) {
+        // Nothing is visible before COMMIT, the joins read the tables as
+        // they were.
+        if (!cmd->stage(*writes_)) {
+            done(ErrorPrinter("not allowed in a transaction").print());
+        }
+        else if (writes_->size() > max_writes) {
+            writes_.reset();
+            done(ErrorPrinter("transaction too large, rolled back").print());
+        }
+        else {
+            done("OK");
+        }
+        return;
+    }
+
+    if (!cmd->heavy()) {
+        done(run(*cmd));
+        return;
+    }
+
+    if (context_.cache && !cmd->cache_key().empty()) {
+        auto hit = context_.cache->find(cmd->cache_key(), storage_.versions());
+        if (hit) {
+            done(*hit);
+            return;
+        }
+    }
+
+    if (!context_.scheduler) {
+        done(run_cached(context_, *cmd));
+        return;
+    }
+
+    auto post = post_;
+    auto context = context_;
+    const bool accepted = context_.scheduler->submit(client_, [cmd, done, post, context]()
+    {
+        std::string reply = run_cached(context, *cmd);
+        if (!post) {
+            done(std::move(reply));
+            return;
+        }
+        post([done, reply = std::move(reply)]() mutable
+        {
+            done(std::move(reply));
+        });
+    });
+    if (!accepted) {
+        done(ErrorPrinter("busy").print());
+    }
+}
+
+std::string Processor::replication(const arguments_t& args) const
+{
+    if (!args.empty()) {
+        return ErrorPrinter("wrong arguments").print();
+    }
+    if (!context_.replication) {
+        return "standalone\nOK";
+    }
+    return context_.replication->status() + "\nOK";
+}
+
+std::string Processor::run(Command& cmd)
+{
+    try {
+        return cmd.run()->print();
+    }
+    catch (const std::exception& e) {
+        gLogger->error("{} failed: {}", cmd.name(), e.what());
+        return ErrorPrinter(e.what()).print();
+    }
+}
+
+std::string Processor::run_cached(const ProcessorContext& context, Command& cmd)
+{
+    if (!context.cache || cmd.cache_key().empty()) {
+        return run(cmd);
+    }
+
+    const versions_t before = context.storage.versions();
+    std::string reply = run(cmd);
+    if (context.storage.versions() == before) {
+        context.cache->insert(cmd.cache_key(), before, reply);
+    }
+    return reply;
 }
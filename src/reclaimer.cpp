@@ -0,0 +1,42 @@
+#include "reclaimer.h"
+
+Reclaimer::Reclaimer()
+    : thread_([this]() { run(); })
+{
+}
+
+Reclaimer::~Reclaimer()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+}
+
+void Reclaimer::retire(std::shared_ptr<void> object)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        retired_.push_back(std::move(object));
+    }
+    cv_.notify_one();
+}
+
+void Reclaimer::run()
+{
+    std::unique_lock<std::mutex> lock(m_);
+    for (;;) {
+        cv_.wait(lock, [this]() { return stop_ || !retired_.empty(); });
+        if (retired_.empty()) {
+            return;
+        }
+        std::shared_ptr<void> object = std::move(retired_.front());
+        retired_.pop_front();
+
+        lock.unlock();
+        object.reset();
+        lock.lock();
+    }
+}
@@ -0,0 +1,537 @@
+#include "replication.h"
+#include "logger.h"
+#include <spdlog/fmt/ostr.h>
+#include <sstream>
+
+using asio::ip::tcp;
+
+namespace {
+
+/// Bytes of the snapshot or of the log per write.
+const size_t piece_bytes = 64 << 10;
+
+const std::chrono::seconds heartbeat_interval { 1 };
+const std::chrono::seconds retry_interval { 1 };
+
+bool parse_lsn(const std::string& text, uint64_t& lsn)
+{
+    if (text.empty() || text.size() > 20
+        || text.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    lsn = std::stoull(text);
+    return true;
+}
+
+} // namespace
+
+ReplicaFeed::ReplicaFeed(asio::io_service& io_service, tcp::socket socket,
+                         IStorage& storage, MutationLog& log, ReplicationServer& server)
+    : io_service_(io_service)
+    , socket_(std::move(socket))
+    , heartbeat_(io_service)
+    , storage_(storage)
+    , log_(log)
+    , server_(server)
+{
+}
+
+void ReplicaFeed::start()
+{
+    asio::error_code ec;
+    const tcp::endpoint remote = socket_.remote_endpoint(ec);
+    endpoint_ = remote.address().to_string(ec) + ":" + std::to_string(remote.port());
+    LOG_DEBUG("START: replica {}", endpoint_);
+    do_read();
+}
+
+void ReplicaFeed::stop()
+{
+    asio::error_code ignored;
+    heartbeat_.cancel(ignored);
+    socket_.shutdown(tcp::socket::shutdown_both, ignored);
+    socket_.close(ignored);
+}
+
+void ReplicaFeed::drain()
+{
+    server_.remove(shared_from_this());
+}
+
+void ReplicaFeed::do_read()
+{
+    auto self(shared_from_this());
+    asio::async_read_until(socket_, input_, '\n',
+                           [this, self](const std::error_code& ec, std::size_t)
+    {
+        if (ec) {
+            LOG_DEBUG("replica {} is gone: {}", endpoint_, ec);
+            server_.remove(self);
+            return;
+        }
+
+        std::string line;
+        std::istream in(&input_);
+        std::getline(in, line);
+        uint64_t lsn = 0;
+        if (!streaming_) {
+            handshake(line);
+        }
+        else if (line.compare(0, 4, "ACK ") == 0 && parse_lsn(line.substr(4), lsn)) {
+            server_.acked(this, lsn);
+        }
+        else {
+            gLogger->warn("replica {} sent a bad line, dropped", endpoint_);
+            server_.remove(self);
+        }
+        if (socket_.is_open()) {
+            do_read();
+        }
+    });
+}
+
+void ReplicaFeed::handshake(const std::string& line)
+{
+    std::istringstream in(line);
+    std::string verb;
+    std::string epoch;
+    std::string lsn;
+    uint64_t their_epoch = 0;
+    uint64_t their_lsn = 0;
+    in >> verb >> epoch >> lsn;
+    if (verb != "REPLICATE" || !parse_lsn(epoch, their_epoch) || !parse_lsn(lsn, their_lsn)) {
+        gLogger->warn("replica {} sent a bad handshake, dropped", endpoint_);
+        server_.remove(shared_from_this());
+        return;
+    }
+
+    // Nothing is read with max_bytes 0, only whether the entries are kept.
+    std::string none;
+    uint64_t from = their_lsn;
+    if (their_epoch == log_.epoch() && their_lsn <= log_.last_lsn()
+        && log_.read(from, none, 0)) {
+        gLogger->info("Replica {} resumes after {}.", endpoint_, their_lsn);
+        sent_ = their_lsn;
+    }
+    else {
+        dump_ = storage_.dump(sent_);
+        gLogger->info("Replica {} gets a snapshot at {}.", endpoint_, sent_);
+    }
+    streaming_ = true;
+    server_.acked(this, dump_ ? 0 : sent_);
+    arm_heartbeat();
+    if (dump_) {
+        do_write("SNAPSHOT " + std::to_string(log_.epoch()) + " " + std::to_string(sent_) + "\n");
+    }
+    else {
+        pump();
+    }
+}
+
+void ReplicaFeed::pump()
+{
+    if (writing_ || !socket_.is_open()) {
+        return;
+    }
+
+    std::string out;
+    if (dump_) {
+        if (!dump_->next(out, piece_bytes)) {
+            dump_.reset();
+            out = "END\n";
+        }
+        do_write(std::move(out));
+        return;
+    }
+
+    if (!log_.read(sent_, out, piece_bytes)) {
+        gLogger->warn("replica {} fell behind the log, dropped", endpoint_);
+        server_.remove(shared_from_this());
+        return;
+    }
+    if (!out.empty()) {
+        do_write(std::move(out));
+        return;
+    }
+
+    if (!waiting_) {
+        // The log calls the waiter on the thread that appends.
+        std::weak_ptr<ReplicaFeed> weak = shared_from_this();
+        asio::io_service& io_service = io_service_;
+        waiting_ = log_.wait(sent_, [weak, &io_service]()
+        {
+            io_service.post([weak]()
+            {
+                if (auto self = weak.lock()) {
+                    self->waiting_ = false;
+                    self->pump();
+                }
+            });
+        });
+        if (!waiting_) {
+            pump();
+        }
+    }
+}
+
+void ReplicaFeed::do_write(std::string data)
+{
+    writing_ = true;
+    output_ = std::move(data);
+    auto self(shared_from_this());
+    asio::async_write(socket_, asio::buffer(output_),
+                      [this, self](const std::error_code& ec, std::size_t)
+    {
+        writing_ = false;
+        if (ec) {
+            server_.remove(self);
+            return;
+        }
+        pump();
+    });
+}
+
+void ReplicaFeed::arm_heartbeat()
+{
+    heartbeat_.expires_from_now(heartbeat_interval);
+    auto self(shared_from_this());
+    heartbeat_.async_wait([this, self](const std::error_code& ec)
+    {
+        if (ec || !socket_.is_open()) {
+            return;
+        }
+        if (!writing_ && !dump_) {
+            do_write("HEARTBEAT " + std::to_string(log_.last_lsn()) + "\n");
+        }
+        arm_heartbeat();
+    });
+}
+
+ReplicationServer::ReplicationServer(asio::io_service& io_service, unsigned short port,
+                                     IStorage& storage, MutationLog& log)
+    : io_service_(io_service)
+    , acceptor_(io_service, tcp::endpoint(tcp::v4(), port))
+    , socket_(io_service)
+    , storage_(storage)
+    , log_(log)
+{
+    storage_.set_log(&log_);
+    do_accept();
+}
+
+ReplicationServer::~ReplicationServer()
+{
+    storage_.set_log(nullptr);
+}
+
+void ReplicationServer::drain(std::function<void()> on_drained)
+{
+    asio::error_code ignored;
+    acceptor_.close(ignored);
+    manager_.drain_all(std::move(on_drained));
+}
+
+void ReplicationServer::stop()
+{
+    asio::error_code ignored;
+    acceptor_.close(ignored);
+    manager_.stop_all();
+}
+
+std::string ReplicationServer::status() const
+{
+    const uint64_t last = log_.last_lsn();
+    lock_t lock(m_);
+    std::string out = "primary," + std::to_string(last) + "," + std::to_string(acked_.size());
+    for (const auto& feed : acked_) {
+        const uint64_t acked = feed.second.second;
+        out += "\n" + feed.second.first + "," + std::to_string(acked) + ","
+               + std::to_string(last > acked ? last - acked : 0);
+    }
+    return out;
+}
+
+void ReplicationServer::acked(const ReplicaFeed* feed, uint64_t lsn)
+{
+    lock_t lock(m_);
+    acked_[feed] = std::make_pair(feed->endpoint(), lsn);
+}
+
+void ReplicationServer::remove(std::shared_ptr<ReplicaFeed> feed)
+{
+    {
+        lock_t lock(m_);
+        acked_.erase(feed.get());
+    }
+    manager_.stop(feed);
+}
+
+void ReplicationServer::do_accept()
+{
+    acceptor_.async_accept(socket_, [this](std::error_code ec)
+    {
+        if (!acceptor_.is_open()) {
+            return;
+        }
+        if (!ec) {
+            manager_.start(std::make_shared<ReplicaFeed>(io_service_, std::move(socket_),
+                                                         storage_, log_, *this));
+        }
+        do_accept();
+    });
+}
+
+ReplicaClient::ReplicaClient(asio::io_service& io_service, const std::string& primary,
+                             IStorage& storage)
+    : resolver_(io_service)
+    , socket_(io_service)
+    , timer_(io_service)
+    , host_(primary.substr(0, primary.rfind(':')))
+    , port_(primary.substr(primary.rfind(':') + 1))
+    , storage_(storage)
+{
+    connect();
+}
+
+void ReplicaClient::stop()
+{
+    stopped_ = true;
+    asio::error_code ignored;
+    timer_.cancel(ignored);
+    resolver_.cancel();
+    socket_.close(ignored);
+}
+
+std::string ReplicaClient::status() const
+{
+    static const char* const states[] = { "connecting", "snapshot", "streaming" };
+    lock_t lock(m_);
+    return std::string("replica,") + states[static_cast<int>(state_)] + ","
+           + std::to_string(applied_) + "," + std::to_string(primary_lsn_) + ","
+           + std::to_string(primary_lsn_ > applied_ ? primary_lsn_ - applied_ : 0);
+}
+
+void ReplicaClient::connect()
+{
+    resolver_.async_resolve(tcp::resolver::query(host_, port_),
+                            [this](const std::error_code& ec, tcp::resolver::iterator it)
+    {
+        if (stopped_) {
+            return;
+        }
+        if (ec) {
+            gLogger->warn("Cannot resolve the primary {}: {}", host_, ec.message());
+            retry();
+            return;
+        }
+        asio::async_connect(socket_, it, [this](const std::error_code& ec,
+                                                tcp::resolver::iterator)
+        {
+            if (stopped_) {
+                return;
+            }
+            if (ec) {
+                LOG_DEBUG("cannot connect to the primary: {}", ec);
+                retry();
+                return;
+            }
+            uint64_t epoch;
+            uint64_t applied;
+            {
+                lock_t lock(m_);
+                epoch = epoch_;
+                applied = applied_;
+            }
+            gLogger->info("Connected to the primary {}:{} at {}.", host_, port_, applied);
+            ack_sent_ = applied;
+            write("REPLICATE " + std::to_string(epoch) + " " + std::to_string(applied) + "\n");
+            do_read();
+        });
+    });
+}
+
+void ReplicaClient::retry()
+{
+    asio::error_code ignored;
+    socket_.close(ignored);
+    pending_.clear();
+    writing_ = false;
+    ack_pending_ = false;
+    {
+        lock_t lock(m_);
+        state_ = State::Connecting;
+    }
+    timer_.expires_from_now(retry_interval);
+    timer_.async_wait([this](const std::error_code& ec)
+    {
+        if (!ec && !stopped_) {
+            connect();
+        }
+    });
+}
+
+void ReplicaClient::do_read()
+{
+    socket_.async_read_some(asio::buffer(buffer_), [this](const std::error_code& ec,
+                                                          std::size_t bytes)
+    {
+        if (stopped_) {
+            return;
+        }
+        if (ec) {
+            gLogger->warn("Lost the primary: {}", ec.message());
+            retry();
+            return;
+        }
+
+        pending_.append(buffer_.data(), bytes);
+        size_t begin = 0;
+        for (;;) {
+            const size_t end = pending_.find('\n', begin);
+            if (end == std::string::npos) {
+                break;
+            }
+            if (!handle(pending_.substr(begin, end - begin))) {
+                gLogger->error("Bad line from the primary, reconnecting.");
+                retry();
+                return;
+            }
+            begin = end + 1;
+        }
+        pending_.erase(0, begin);
+        if (pending_.size() > max_length) {
+            gLogger->error("Line too long from the primary, reconnecting.");
+            retry();
+            return;
+        }
+        send_ack();
+        do_read();
+    });
+}
+
+bool ReplicaClient::handle(const std::string& line)
+{
+    State state;
+    {
+        lock_t lock(m_);
+        state = state_;
+    }
+
+    if (state == State::Snapshot) {
+        if (line != "END") {
+            return apply(line);
+        }
+        lock_t lock(m_);
+        epoch_ = snapshot_epoch_;
+        applied_ = snapshot_lsn_;
+        state_ = State::Streaming;
+        gLogger->info("Snapshot at {} applied.", applied_);
+        return true;
+    }
+
+    const size_t space = line.find(' ');
+    const std::string head = line.substr(0, space);
+    const std::string rest = space == std::string::npos ? std::string() : line.substr(space + 1);
+    uint64_t lsn = 0;
+
+    if (head == "SNAPSHOT") {
+        std::istringstream in(rest);
+        std::string epoch;
+        std::string at;
+        in >> epoch >> at;
+        lock_t lock(m_);
+        if (!parse_lsn(epoch, snapshot_epoch_) || !parse_lsn(at, snapshot_lsn_)) {
+            return false;
+        }
+        // Until END the tables are neither the old ones nor the new ones.
+        epoch_ = 0;
+        applied_ = 0;
+        primary_lsn_ = snapshot_lsn_;
+        state_ = State::Snapshot;
+        return true;
+    }
+    if (head == "HEARTBEAT") {
+        if (!parse_lsn(rest, lsn)) {
+            return false;
+        }
+        lock_t lock(m_);
+        primary_lsn_ = std::max(primary_lsn_, lsn);
+        state_ = State::Streaming;
+        return true;
+    }
+    if (!parse_lsn(head, lsn)) {
+        return false;
+    }
+    {
+        lock_t lock(m_);
+        if (lsn != applied_ + 1) {
+            return false;
+        }
+    }
+    if (!apply(rest)) {
+        return false;
+    }
+    lock_t lock(m_);
+    applied_ = lsn;
+    primary_lsn_ = std::max(primary_lsn_, lsn);
+    state_ = State::Streaming;
+    return true;
+}
+
+bool ReplicaClient::apply(const std::string& command)
+{
+    if (command.compare(0, 9, "TRUNCATE ") == 0) {
+        storage_.truncate(command.substr(9));
+        return true;
+    }
+    if (command.compare(0, 7, "INSERT ") != 0) {
+        return false;
+    }
+    // The name is the rest of the line.
+    const size_t table_end = command.find(' ', 7);
+    const size_t id_end = table_end == std::string::npos ? table_end
+                                                         : command.find(' ', table_end + 1);
+    if (id_end == std::string::npos) {
+        return false;
+    }
+    if (!storage_.insert(command.substr(7, table_end - 7),
+                         command.substr(table_end + 1, id_end - table_end - 1),
+                         command.substr(id_end + 1))) {
+        LOG_DEBUG("replicated insert not applied: {}", command);
+    }
+    return true;
+}
+
+void ReplicaClient::write(std::string data)
+{
+    writing_ = true;
+    output_ = std::move(data);
+    asio::async_write(socket_, asio::buffer(output_),
+                      [this](const std::error_code& ec, std::size_t)
+    {
+        // A failed write also fails the read, which reconnects.
+        writing_ = false;
+        if (!ec && ack_pending_) {
+            send_ack();
+        }
+    });
+}
+
+void ReplicaClient::send_ack()
+{
+    uint64_t applied;
+    {
+        lock_t lock(m_);
+        applied = applied_;
+    }
+    if (applied == ack_sent_) {
+        return;
+    }
+    if (writing_) {
+        ack_pending_ = true;
+        return;
+    }
+    ack_pending_ = false;
+    ack_sent_ = applied;
+    write("ACK " + std::to_string(applied) + "\n");
+}
@@ -0,0 +1,60 @@
+#include "resultcache.h"
+
+ResultCache::ResultCache(size_t capacity)
+    : capacity_(capacity)
+{
+}
+
+ResultCache::Bytes ResultCache::find(const std::string& query,
+                                     const versions_t& versions)
+{
+    std::lock_guard<std::mutex> lock(m_);
+    auto found = index_.find(query);
+    if (found == index_.end() || found->second->versions != versions) {
+        ++misses_;
+        return nullptr;
+    }
+    ++hits_;
+    lru_.splice(lru_.begin(), lru_, found->second);
+    return found->second->reply;
+}
+
+void ResultCache::insert(const std::string& query, const versions_t& versions,
+                         std::string reply)
+{
+    if (reply.size() > capacity_) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_);
+    auto found = index_.find(query);
+    if (found != index_.end()) {
+        if (found->second->versions > versions) {
+            // A newer reply made it first.
+            return;
+        }
+        erase(found->second);
+    }
+
+    size_ += reply.size();
+    lru_.push_front(Entry { query, versions,
+                            std::make_shared<const std::string>(std::move(reply)) });
+    index_.emplace(query, lru_.begin());
+
+    while (size_ > capacity_) {
+        erase(std::prev(lru_.end()));
+    }
+}
+
+size_t ResultCache::size() const
+{
+    std::lock_guard<std::mutex> lock(m_);
+    return size_;
+}
+
+void ResultCache::erase(lru_t::iterator entry)
+{
+    size_ -= entry->reply->size();
+    index_.erase(entry->query);
+    lru_.erase(entry);
+}
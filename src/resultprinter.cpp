@@ -1 +1,31 @@
 #include "resultprinter.h"
+#include <cmath>
+
+std::string InsertPrinter::print() const
+{
+    if (inserted_) {
+        return "OK";
+    }
+    return "ERR duplicate " + id_;
+}
+
+std::string TruncatePrinter::print() const
+{
+    return truncated_ ? "OK" : "ERR unknown table";
+}
+
+std::string TablePrinter::print() const
+{
+    std::string out;
+    if (result_) {
+        result_->print(out);
+    }
+    out.append("OK");
+    return out;
+}
+
+std::string EstimatePrinter::print() const
+{
+    return std::to_string(std::llround(estimate_.value)) + ","
+            + std::to_string(std::llround(estimate_.error)) + "\nOK";
+}
@@ -0,0 +1,335 @@
+#include "roaring.h"
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+size_t popcount(uint64_t word)
+{
+    return static_cast<size_t>(__builtin_popcountll(word));
+}
+
+} // namespace
+
+bool RoaringContainer::add(uint16_t value)
+{
+    switch (type_) {
+    case Type::Array: {
+        auto pos = std::lower_bound(values_.begin(), values_.end(), value);
+        if (pos != values_.end() && *pos == value) {
+            return false;
+        }
+        if (values_.size() < array_max) {
+            values_.insert(pos, value);
+            ++cardinality_;
+            return true;
+        }
+        to_bitmap();
+        break;
+    }
+    case Type::Run:
+        return add_run(value);
+    case Type::Bitmap:
+        break;
+    }
+
+    uint64_t& word = bitmap_[value >> 6];
+    const uint64_t bit = uint64_t(1) << (value & 63);
+    if (word & bit) {
+        return false;
+    }
+    word |= bit;
+    if (++cardinality_ == 65536) {
+        // A full chunk is a single run.
+        run_optimize();
+    }
+    return true;
+}
+
+bool RoaringContainer::contains(uint16_t value) const
+{
+    switch (type_) {
+    case Type::Array:
+        return std::binary_search(values_.begin(), values_.end(), value);
+    case Type::Bitmap:
+        return (bitmap_[value >> 6] >> (value & 63)) & 1;
+    case Type::Run: {
+        const size_t n = runs_before(value);
+        return n > 0 && size_t(value - values_[2 * n - 2]) <= values_[2 * n - 1];
+    }
+    }
+    return false;
+}
+
+size_t RoaringContainer::runs_before(uint16_t value) const
+{
+    size_t lo = 0;
+    size_t hi = values_.size() / 2;
+    while (lo < hi) {
+        const size_t mid = (lo + hi) / 2;
+        if (values_[2 * mid] <= value) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool RoaringContainer::add_run(uint16_t value)
+{
+    const size_t n = runs_before(value);
+    const size_t runs = values_.size() / 2;
+    if (n > 0 && size_t(value - values_[2 * n - 2]) <= values_[2 * n - 1]) {
+        return false;
+    }
+    const bool extends_last = n > 0
+                              && size_t(value - values_[2 * n - 2]) == values_[2 * n - 1] + 1u;
+    const bool extends_next = n < runs && uint32_t(value) + 1 == values_[2 * n];
+    if (extends_last && extends_next) {
+        values_[2 * n - 1] = static_cast<uint16_t>(values_[2 * n - 1] + values_[2 * n + 1] + 2);
+        values_.erase(values_.begin() + 2 * n, values_.begin() + 2 * n + 2);
+    }
+    else if (extends_last) {
+        ++values_[2 * n - 1];
+    }
+    else if (extends_next) {
+        values_[2 * n] = value;
+        ++values_[2 * n + 1];
+    }
+    else {
+        const uint16_t run[] = { value, 0 };
+        values_.insert(values_.begin() + 2 * n, std::begin(run), std::end(run));
+    }
+    ++cardinality_;
+
+    // A new run takes 4 bytes, the containers stay runs while they are
+    // the smallest.
+    if (values_.size() > cardinality_ && cardinality_ <= array_max) {
+        to_array();
+    }
+    else if (values_.size() * sizeof(uint16_t) > bitmap_words * sizeof(uint64_t)) {
+        to_bitmap();
+    }
+    return true;
+}
+
+size_t RoaringContainer::rank(uint16_t value) const
+{
+    switch (type_) {
+    case Type::Array:
+        return static_cast<size_t>(std::lower_bound(values_.begin(), values_.end(), value)
+                                   - values_.begin());
+    case Type::Bitmap: {
+        size_t n = 0;
+        const size_t word = value >> 6;
+        for (size_t i = 0; i < word; ++i) {
+            n += popcount(bitmap_[i]);
+        }
+        return n + popcount(bitmap_[word] & ((uint64_t(1) << (value & 63)) - 1));
+    }
+    case Type::Run: {
+        size_t n = 0;
+        for (size_t i = 0; i < values_.size() && values_[i] < value; i += 2) {
+            n += std::min<size_t>(values_[i + 1] + 1u, size_t(value - values_[i]));
+        }
+        return n;
+    }
+    }
+    return 0;
+}
+
+size_t RoaringContainer::memory() const
+{
+    return values_.capacity() * sizeof(uint16_t) + bitmap_.capacity() * sizeof(uint64_t);
+}
+
+void RoaringContainer::run_optimize()
+{
+    if (type_ == Type::Run) {
+        return;
+    }
+
+    std::vector<uint16_t> runs;
+    for_each([&runs](uint16_t v) {
+        if (!runs.empty() && uint32_t(runs[runs.size() - 2]) + runs.back() + 1 == v) {
+            ++runs.back();
+        }
+        else {
+            runs.push_back(v);
+            runs.push_back(0);
+        }
+        return true;
+    });
+
+    if (runs.size() * sizeof(uint16_t) < memory()) {
+        type_ = Type::Run;
+        values_ = std::move(runs);
+        values_.shrink_to_fit();
+        bitmap_.clear();
+        bitmap_.shrink_to_fit();
+    }
+}
+
+void RoaringContainer::to_words(uint64_t* words) const
+{
+    if (type_ == Type::Bitmap) {
+        std::copy(bitmap_.begin(), bitmap_.end(), words);
+        return;
+    }
+    std::fill(words, words + bitmap_words, 0);
+    for_each([words](uint16_t v) {
+        words[v >> 6] |= uint64_t(1) << (v & 63);
+        return true;
+    });
+}
+
+RoaringContainer RoaringContainer::from_words(const uint64_t* words)
+{
+    RoaringContainer c;
+    size_t n = 0;
+    for (size_t i = 0; i < bitmap_words; ++i) {
+        n += popcount(words[i]);
+    }
+    c.cardinality_ = static_cast<uint32_t>(n);
+    if (n > array_max) {
+        c.type_ = Type::Bitmap;
+        c.bitmap_.assign(words, words + bitmap_words);
+        return c;
+    }
+
+    c.values_.reserve(n);
+    for (size_t i = 0; i < bitmap_words; ++i) {
+        for (uint64_t word = words[i]; word; word &= word - 1) {
+            c.values_.push_back(static_cast<uint16_t>(i * 64 + __builtin_ctzll(word)));
+        }
+    }
+    return c;
+}
+
+void RoaringContainer::to_array()
+{
+    std::vector<uint16_t> values;
+    values.reserve(cardinality_);
+    for_each([&values](uint16_t v) {
+        values.push_back(v);
+        return true;
+    });
+    type_ = Type::Array;
+    values_ = std::move(values);
+    bitmap_.clear();
+    bitmap_.shrink_to_fit();
+}
+
+void RoaringContainer::to_bitmap()
+{
+    std::vector<uint64_t> words(bitmap_words);
+    to_words(words.data());
+    type_ = Type::Bitmap;
+    bitmap_ = std::move(words);
+    values_.clear();
+    values_.shrink_to_fit();
+}
+
+RoaringContainer RoaringContainer::intersect(const RoaringContainer& a,
+                                             const RoaringContainer& b)
+{
+    if (a.type_ == Type::Array || b.type_ == Type::Array) {
+        const RoaringContainer& small = a.type_ == Type::Array ? a : b;
+        const RoaringContainer& other = a.type_ == Type::Array ? b : a;
+        RoaringContainer c;
+        if (other.type_ == Type::Array) {
+            std::set_intersection(small.values_.begin(), small.values_.end(),
+                                  other.values_.begin(), other.values_.end(),
+                                  std::back_inserter(c.values_));
+        }
+        else {
+            std::copy_if(small.values_.begin(), small.values_.end(),
+                         std::back_inserter(c.values_),
+                         [&other](uint16_t v) { return other.contains(v); });
+        }
+        c.cardinality_ = static_cast<uint32_t>(c.values_.size());
+        return c;
+    }
+
+    uint64_t wa[bitmap_words];
+    uint64_t wb[bitmap_words];
+    a.to_words(wa);
+    b.to_words(wb);
+    for (size_t i = 0; i < bitmap_words; ++i) {
+        wa[i] &= wb[i];
+    }
+    return from_words(wa);
+}
+
+RoaringContainer RoaringContainer::symmetric_difference(const RoaringContainer& a,
+                                                        const RoaringContainer& b)
+{
+    if (a.type_ == Type::Array && b.type_ == Type::Array) {
+        RoaringContainer c;
+        std::set_symmetric_difference(a.values_.begin(), a.values_.end(),
+                                      b.values_.begin(), b.values_.end(),
+                                      std::back_inserter(c.values_));
+        c.cardinality_ = static_cast<uint32_t>(c.values_.size());
+        if (c.cardinality_ > array_max) {
+            c.to_bitmap();
+        }
+        return c;
+    }
+
+    uint64_t wa[bitmap_words];
+    uint64_t wb[bitmap_words];
+    a.to_words(wa);
+    b.to_words(wb);
+    for (size_t i = 0; i < bitmap_words; ++i) {
+        wa[i] ^= wb[i];
+    }
+    return from_words(wa);
+}
+
+size_t RoaringContainer::intersect_cardinality(const RoaringContainer& a,
+                                               const RoaringContainer& b)
+{
+    if (a.type_ == Type::Bitmap && b.type_ == Type::Bitmap) {
+        size_t n = 0;
+        for (size_t i = 0; i < bitmap_words; ++i) {
+            n += popcount(a.bitmap_[i] & b.bitmap_[i]);
+        }
+        return n;
+    }
+    if (a.type_ == Type::Array || b.type_ == Type::Array) {
+        const RoaringContainer& small = a.type_ == Type::Array ? a : b;
+        const RoaringContainer& other = a.type_ == Type::Array ? b : a;
+        return static_cast<size_t>(std::count_if(small.values_.begin(), small.values_.end(),
+                                                 [&other](uint16_t v) {
+            return other.contains(v);
+        }));
+    }
+    return intersect(a, b).cardinality();
+}
+
+size_t RoaringContainer::RankCursor::rank(uint16_t value)
+{
+    switch (c_.type_) {
+    case Type::Array:
+        while (c_.values_[pos_] < value) {
+            ++pos_;
+        }
+        return pos_;
+    case Type::Bitmap: {
+        const size_t word = value >> 6;
+        for (; pos_ < word; ++pos_) {
+            acc_ += popcount(c_.bitmap_[pos_]);
+        }
+        return acc_ + popcount(c_.bitmap_[word] & ((uint64_t(1) << (value & 63)) - 1));
+    }
+    case Type::Run:
+        while (uint32_t(c_.values_[pos_]) + c_.values_[pos_ + 1] < value) {
+            acc_ += c_.values_[pos_ + 1] + 1u;
+            pos_ += 2;
+        }
+        return acc_ + (value - c_.values_[pos_]);
+    }
+    return 0;
+}
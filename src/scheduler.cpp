@@ -0,0 +1,105 @@
+#include "scheduler.h"
+#include "logger.h"
+#include <algorithm>
+
+Scheduler::Scheduler(const SchedulerConfig& config)
+    : config_(config)
+{
+    for (size_t i = 0; i < std::max<size_t>(1, config_.max_running); ++i) {
+        workers_.emplace_back([this]() { work(); });
+    }
+}
+
+Scheduler::~Scheduler()
+{
+    stop();
+}
+
+Scheduler::ClientPtr Scheduler::add_client(unsigned weight)
+{
+    return std::make_shared<Client>(std::max(1u, weight ? weight : config_.client_weight));
+}
+
+bool Scheduler::set_weight(const ClientPtr& client, unsigned weight)
+{
+    if (weight == 0 || weight > config_.max_weight) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_);
+    client->weight = weight;
+    return true;
+}
+
+bool Scheduler::submit(const ClientPtr& client, Job job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        if (stopped_ || queue_.size() >= config_.max_queued
+            || client->pending >= config_.max_per_client) {
+            LOG_DEBUG("scheduler: busy, queued = {} client pending = {}",
+                      queue_.size(), client->pending);
+            return false;
+        }
+
+        const double start = std::max(virtual_time_, client->finish);
+        client->finish = start + 1.0 / client->weight;
+        ++client->pending;
+        queue_.push(Entry { start, seq_++, client, std::move(job) });
+    }
+    cv_.notify_one();
+    return true;
+}
+
+void Scheduler::stop()
+{
+    std::vector<Entry> dropped;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        if (stopped_) {
+            return;
+        }
+        stopped_ = true;
+        while (!queue_.empty()) {
+            dropped.push_back(std::move(const_cast<Entry&>(queue_.top())));
+            queue_.pop();
+        }
+    }
+    cv_.notify_all();
+    for (auto& t : workers_) {
+        t.join();
+    }
+}
+
+size_t Scheduler::queued() const
+{
+    std::lock_guard<std::mutex> lock(m_);
+    return queue_.size();
+}
+
+void Scheduler::work()
+{
+    for (;;) {
+        Entry entry;
+        {
+            std::unique_lock<std::mutex> lock(m_);
+            cv_.wait(lock, [this]() { return stopped_ || !queue_.empty(); });
+            if (stopped_) {
+                return;
+            }
+            entry = std::move(const_cast<Entry&>(queue_.top()));
+            queue_.pop();
+            virtual_time_ = entry.start;
+        }
+
+        try {
+            entry.job();
+        }
+        catch (const std::exception& e) {
+            gLogger->error("scheduler: job failed: {}", e.what());
+        }
+        entry.job = nullptr;
+
+        std::lock_guard<std::mutex> lock(m_);
+        --entry.client->pending;
+    }
+}
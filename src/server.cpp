@@ -2,121 +2,460 @@
 #include "logger.h"
 #include "storage.h"
 #include "processor.h"
+#include "subscription.h"
 #include <spdlog/fmt/ostr.h>
+#include <cstring>
 #include <iostream>
 
 using asio::ip::tcp;
 
-Session::Session(tcp::socket socket, IStorage& storage)
+#ifdef TCP_CORK
+using tcp_cork = asio::detail::socket_option::boolean<IPPROTO_TCP, TCP_CORK>;
+#endif
+
+Session::Session(tcp::socket socket, const ProcessorContext& context,
+                 SessionManager& manager, const ServerConfig& config,
+                 BufferPoolPtr pool)
     : socket_(std::move(socket))
-    , processor(std::make_unique<Processor>(storage))
+    , timer_(socket_.get_io_service())
+    , pool_(std::move(pool))
+    , processor(std::make_unique<Processor>(context, [this](std::function<void()> task)
+    {
+        socket_.get_io_service().post(std::move(task));
+    }))
+    , storage_(context.storage)
+    , manager_(manager)
+    , config_(config)
 {
 }
 
 Session::~Session()
 {
-    gLogger->debug("END: session = {}",
-                   static_cast<void*>(this));
+    pool_->release(buffer_);
+    LOG_DEBUG("END: session = {}", static_cast<void*>(this));
 }
 
-void Session::prompt()
+void Session::start()
 {
-    reply_ = "> ";
-    do_write();
+    LOG_DEBUG("START: session = {}", static_cast<void*>(this));
+
+    asio::error_code ignored;
+    socket_.set_option(tcp::no_delay(config_.no_delay), ignored);
+    do_read();
 }
 
-void Session::start()
+void Session::stop()
 {
-    gLogger->debug("START: session = {}",
-                   static_cast<void*>(this));
+    asio::error_code ignored;
+    timer_.cancel(ignored);
+    socket_.shutdown(tcp::socket::shutdown_both, ignored);
+    socket_.close(ignored);
+}
 
-    prompt();
-    do_read();
+void Session::drain()
+{
+    draining_ = true;
+    subscription_.reset();
+    if (write_queue_.empty() && !busy_) {
+        manager_.stop(shared_from_this());
+    }
+}
+
+void Session::arm_timer()
+{
+    if (subscription_ && begin_ == end_) {
+        // A subscriber waits for the changes, a pending expiry is ignored.
+        timer_.expires_at(asio::steady_timer::time_point::max());
+        return;
+    }
+    // Nothing buffered means the client is idle between commands,
+    // otherwise it is in the middle of sending one.
+    timer_.expires_from_now(begin_ == end_ ? config_.idle_timeout
+                                           : config_.read_timeout);
+    auto self(shared_from_this());
+    timer_.async_wait(make_custom_alloc_handler(timer_memory_,
+                                                [this, self](const std::error_code& ec)
+    {
+        // The timer may have been re-armed after this handler was queued.
+        if (ec == asio::error::operation_aborted
+            || timer_.expires_at() > asio::steady_timer::clock_type::now()) {
+            return;
+        }
+        LOG_DEBUG("timeout: session = {}", static_cast<void*>(this));
+        manager_.stop(self);
+    }));
 }
 
 void Session::do_read()
 {
-//    auto self(shared_from_this());
+    if (begin_ < end_) {
+        read_some();
+        return;
+    }
 
-    const std::string delimiter = "\n";
+    // Nothing is pending, an idle session keeps no buffer.
+    begin_ = 0;
+    end_ = 0;
+    pool_->release(buffer_);
+    arm_timer();
+    auto self(shared_from_this());
+    socket_.async_wait(tcp::socket::wait_read,
+                       make_custom_alloc_handler(read_memory_,
+                                                 [this, self](const std::error_code& error_code)
+    {
+        if (error_code) {
+            LOG_DEBUG("wait failed: session = {} ec = {}",
+                      static_cast<void*>(this), error_code);
+            manager_.stop(self);
+            return;
+        }
+        read_some();
+    }));
+}
 
-    gLogger->debug("before read_until streambuf contains {} bytes.",
-                   streambuf_.size());
-    asio::async_read_until(socket_, streambuf_, delimiter,
-                           [delimiter, this](const std::error_code& error_code,
-                                                   std::size_t bytes_transferred)
+void Session::read_some()
+{
+    auto self(shared_from_this());
+
+    // The incomplete line moves to the front to make room for the rest.
+    if (begin_ > 0) {
+        std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
+    }
+    if (buffer_.size() < want_ || end_ == buffer_.size()) {
+        BufferPool::Buffer bigger = pool_->acquire(std::max(want_, end_ + 1));
+        if (end_ > 0) {
+            std::memcpy(bigger.data(), buffer_.data(), end_);
+        }
+        pool_->release(buffer_);
+        buffer_ = std::move(bigger);
+    }
+
+    LOG_TRACE("before read_some buffer contains {} bytes.", end_);
+    arm_timer();
+    const size_t room = buffer_.size() - end_;
+    socket_.async_read_some(asio::buffer(buffer_.data() + end_, room),
+                            make_custom_alloc_handler(read_memory_,
+                                                      [this, self, room](
+                                                          const std::error_code& error_code,
+                                                          std::size_t bytes_transferred)
     {
-        gLogger->debug("session = {} streambuf contains {} bytes. "
-                       "bytes transferred = {}",
-                       static_cast<void*>(this), this->streambuf_.size(),
-                       bytes_transferred);
-
-        if (bytes_transferred > 1) {
-            // Extract up to the first delimiter.
-            std::string command {
-                buffers_begin(this->streambuf_.data()),
-                        buffers_begin(this->streambuf_.data())
-                        + bytes_transferred - delimiter.size()
-            };
-
-            // Consume through the first delimiter so that subsequent async_read_until
-            // will not reiterate over the same data.
-            this->streambuf_.consume(bytes_transferred);
-
-            ResultPrinterUPtr result = this->processor->execute(command);
-            this->reply_ = result->print();
-            this->reply_.append("\n");
-            this->do_write();
-
-            gLogger->debug("  received command: {},"
-                           " streambuf contains {} bytes. ec = {}",
-                           command, this->streambuf_.size(), error_code);
-            this->prompt();
+        LOG_TRACE("session = {} bytes transferred = {}",
+                  static_cast<void*>(this), bytes_transferred);
+
+        if (error_code) {
+            LOG_DEBUG("read failed: session = {} ec = {}",
+                      static_cast<void*>(this), error_code);
+            manager_.stop(self);
+            return;
         }
-        else {
-            this->streambuf_.consume(bytes_transferred);
+
+        // Bulk senders fill their buffers, interactive clients send a
+        // line at a time.
+        if (bytes_transferred == room) {
+            want_ = std::min<size_t>(want_ * 2, BufferPool::max_size);
+        }
+        else if (bytes_transferred < want_ / 4) {
+            want_ = std::max<size_t>(want_ / 2, BufferPool::min_size);
+        }
+        end_ += bytes_transferred;
+        process_input();
+    }));
+}
+
+void Session::process_input()
+{
+    while (!busy_ && !draining_ && queued_bytes_ < config_.output_high_water) {
+        const auto result = parser_.parse(buffer_.data() + begin_, end_ - begin_);
+        begin_ += parser_.consumed();
+        if (result == CommandParser::Result::Indeterminate) {
+            break;
+        }
+        if (result == CommandParser::Result::Bad) {
+            LOG_DEBUG("session = {} bad command: {}", static_cast<void*>(this),
+                      parser_.error());
+            deliver(ErrorPrinter(parser_.error()).print() + "\n");
+            continue;
+        }
+
+        // The tokens are still in the buffer, it moves on the next read.
+        verb_.assign(parser_.token(0), parser_.token_size(0));
+        args_.resize(parser_.size() - 1);
+        for (size_t i = 1; i < parser_.size(); ++i) {
+            args_[i - 1].assign(parser_.token(i), parser_.token_size(i));
+        }
+        LOG_DEBUG("  received command: {} with {} arguments,"
+                  " buffer contains {} bytes.",
+                  verb_, args_.size(), end_ - begin_);
+        LOG_SAMPLED("session = {} command: {}", static_cast<void*>(this), verb_);
+        process();
+    }
+    if (busy_) {
+        return;
+    }
+    if (queued_bytes_ >= config_.output_high_water) {
+        // A client that does not read its replies is not read either,
+        // the writes resume it.
+        output_full_ = true;
+        return;
+    }
+    read_next();
+}
+
+void Session::process()
+{
+    if (verb_ == "SUBSCRIBE" || verb_ == "UNSUBSCRIBE") {
+        deliver(subscribe() + "\n");
+        return;
+    }
+
+    auto self(shared_from_this());
+    busy_ = true;
+    executing_ = true;
+    processor->execute(verb_, args_, [this, self](std::string reply)
+    {
+        busy_ = false;
+        reply.append("\n");
+        deliver(std::move(reply));
+        if (!executing_) {
+            process_input();
         }
     });
-    gLogger->debug("after read_until streambuf contains {} bytes.",
-                   streambuf_.size());
+    executing_ = false;
+}
+
+std::string Session::subscribe()
+{
+    if (verb_ == "UNSUBSCRIBE") {
+        if (!args_.empty()) {
+            return ErrorPrinter("wrong arguments").print();
+        }
+        subscription_.reset();
+        return "OK";
+    }
+    if (args_.size() != 1
+        || (args_[0] != "INTERSECTION" && args_[0] != "SYMMETRIC_DIFFERENCE")) {
+        return ErrorPrinter("wrong arguments").print();
+    }
+    if (subscription_) {
+        return ErrorPrinter("already subscribed").print();
+    }
+
+    // The storage notifies from the thread of the change.
+    std::weak_ptr<Session> weak = shared_from_this();
+    try {
+        subscription_ = storage_.subscribe(args_[0] == "INTERSECTION"
+                                           ? JoinKind::Intersection
+                                           : JoinKind::SymmetricDifference,
+                                           config_.subscriber_queue, [weak]()
+        {
+            auto self = weak.lock();
+            if (self) {
+                self->socket_.get_io_service().post([self]() { self->pump_changes(); });
+            }
+        });
+    }
+    catch (const std::exception& e) {
+        return ErrorPrinter(e.what()).print();
+    }
+    return "OK";
+}
+
+void Session::pump_changes()
+{
+    if (!subscription_ || draining_ || !write_queue_.empty()) {
+        return;
+    }
+    std::string changes;
+    if (!subscription_->take(changes, max_changes)) {
+        // The client is told once and keeps its connection for commands, a
+        // new SUBSCRIBE starts over from the rows of the join.
+        subscription_.reset();
+        changes.append(ErrorPrinter("slow subscriber").print()).push_back('\n');
+    }
+    if (!changes.empty()) {
+        deliver(std::move(changes));
+    }
+}
+
+void Session::read_next()
+{
+    if (draining_) {
+        if (write_queue_.empty() && !busy_) {
+            manager_.stop(shared_from_this());
+        }
+        return;
+    }
+    do_read();
+}
+
+void Session::deliver(std::string reply)
+{
+    queued_bytes_ += reply.size();
+    write_queue_.push_back(std::move(reply));
+    if (in_flight_ == 0) {
+        set_cork(true);
+        do_write();
+    }
 }
 
 void Session::do_write()
 {
-//    auto self(shared_from_this());
-    asio::async_write(socket_, asio::buffer(reply_, reply_.size()),
-                      [this](std::error_code ec,
-                      std::size_t length)
+    // The replies queued since the last write go out in one writev.
+    in_flight_ = std::min<size_t>(write_queue_.size(), max_write_buffers);
+    write_buffers_.clear();
+    for (size_t i = 0; i < in_flight_; ++i) {
+        write_buffers_.push_back(asio::buffer(write_queue_[i]));
+    }
+
+    auto self(shared_from_this());
+    asio::async_write(socket_, write_buffers_,
+                      make_custom_alloc_handler(write_memory_,
+                                                [this, self](std::error_code ec,
+                                                             std::size_t length)
     {
-        if (!ec) {
-            this->reply_.clear();
-            gLogger->debug("write output: session = {} length = {}",
-                           static_cast<void*>(this), length);
-            do_read();
+        if (ec) {
+            manager_.stop(self);
+            return;
         }
-    });
+        LOG_TRACE("write output: session = {} length = {} replies = {}",
+                  static_cast<void*>(this), length, in_flight_);
+
+        write_queue_.erase(write_queue_.begin(), write_queue_.begin() + in_flight_);
+        in_flight_ = 0;
+        queued_bytes_ -= length;
+        if (!write_queue_.empty()) {
+            do_write();
+        }
+        else {
+            set_cork(false);
+        }
+
+        if (output_full_ && queued_bytes_ <= config_.output_high_water / 2) {
+            output_full_ = false;
+            process_input();
+        }
+        else if (write_queue_.empty() && draining_ && !busy_) {
+            manager_.stop(self);
+        }
+        else if (write_queue_.empty()) {
+            pump_changes();
+        }
+    }));
 }
 
-Server::Server(asio::io_service& io_service, short port, IStorage& storage)
+void Session::set_cork(bool on)
+{
+#ifdef TCP_CORK
+    if (config_.cork) {
+        asio::error_code ignored;
+        socket_.set_option(tcp_cork(on), ignored);
+    }
+#else
+    (void)on;
+#endif
+}
+
+void SessionManager::start(SessionPtr session)
+{
+    sessions_.insert(session);
+    session->start();
+}
+
+void SessionManager::stop(SessionPtr session)
+{
+    if (sessions_.erase(session) == 0) {
+        return;
+    }
+    session->stop();
+    if (on_drained_ && sessions_.empty()) {
+        auto done = std::move(on_drained_);
+        on_drained_ = nullptr;
+        done();
+    }
+}
+
+void SessionManager::drain_all(std::function<void()> on_drained)
+{
+    on_drained_ = std::move(on_drained);
+    // drain() may remove the session from the set right away.
+    auto sessions = sessions_;
+    for (auto& s : sessions) {
+        s->drain();
+    }
+    if (on_drained_ && sessions_.empty()) {
+        auto done = std::move(on_drained_);
+        on_drained_ = nullptr;
+        done();
+    }
+}
+
+void SessionManager::stop_all()
+{
+    auto sessions = std::move(sessions_);
+    sessions_.clear();
+    for (auto& s : sessions) {
+        s->stop();
+    }
+}
+
+Server::Server(asio::io_service& io_service, unsigned short port,
+               const ProcessorContext& context, const ServerConfig& config)
     : acceptor_(io_service, tcp::endpoint(tcp::v4(), port))
     , socket_(io_service)
-    , storage_(storage)
+    , context_(context)
+    , config_(config)
 {
     do_accept();
 }
 
+void Server::drain(std::function<void()> on_drained)
+{
+    LOG_DEBUG("draining {} sessions", manager_.size());
+    asio::error_code ignored;
+    acceptor_.close(ignored);
+    manager_.drain_all(std::move(on_drained));
+}
+
+void Server::stop()
+{
+    asio::error_code ignored;
+    acceptor_.close(ignored);
+    manager_.stop_all();
+}
+
 void Server::do_accept()
 {
     acceptor_.async_accept(socket_,
                            [this](std::error_code ec)
     {
+        if (!acceptor_.is_open()) {
+            return;
+        }
+
         if (!ec) {
-            gLogger->debug("accepted new connection: server = {}",
-                           static_cast<void*>(this));
-            session_.push_back(std::make_shared<Session>(std::move(socket_), storage_));
-            session_.back()->start();
+            LOG_DEBUG("accepted new connection: server = {}",
+                      static_cast<void*>(this));
+            if (manager_.size() >= config_.max_connections) {
+                reject(socket_);
+            }
+            else {
+                manager_.start(std::make_shared<Session>(std::move(socket_),
+                                                         context_, manager_,
+                                                         config_, pool_));
+            }
         }
 
         do_accept();
     });
 }
+
+void Server::reject(tcp::socket& socket)
+{
+    LOG_DEBUG("connection limit {} reached", config_.max_connections);
+    const std::string message = "ERR too many connections\n";
+    asio::error_code ignored;
+    asio::write(socket, asio::buffer(message), ignored);
+    socket.close(ignored);
+}
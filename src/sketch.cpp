@@ -0,0 +1,68 @@
+#include "sketch.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+/// splitmix64 finalizer, spreads consecutive ids over the registers.
+uint64_t mix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+} // namespace
+
+HyperLogLog::HyperLogLog(unsigned precision)
+    : precision_(precision)
+    , registers_(size_t(1) << precision)
+{
+}
+
+void HyperLogLog::add(uint64_t value)
+{
+    const uint64_t hash = mix(value);
+    const size_t index = hash >> (64 - precision_);
+    // The guard bit bounds the rank when the remaining bits are zero.
+    const uint64_t rest = (hash << precision_) | (uint64_t(1) << (precision_ - 1));
+    const auto rank = static_cast<uint8_t>(__builtin_clzll(rest) + 1);
+    registers_[index] = std::max(registers_[index], rank);
+}
+
+void HyperLogLog::clear()
+{
+    std::fill(registers_.begin(), registers_.end(), 0);
+}
+
+void HyperLogLog::merge(const HyperLogLog& other)
+{
+    for (size_t i = 0; i < registers_.size(); ++i) {
+        registers_[i] = std::max(registers_[i], other.registers_[i]);
+    }
+}
+
+double HyperLogLog::estimate() const
+{
+    const double m = static_cast<double>(registers_.size());
+    double sum = 0;
+    size_t zeros = 0;
+    for (auto r : registers_) {
+        sum += std::ldexp(1.0, -r);
+        zeros += r == 0;
+    }
+
+    const double alpha = 0.7213 / (1 + 1.079 / m);
+    const double raw = alpha * m * m / sum;
+    if (raw <= 2.5 * m && zeros) {
+        // Linear counting is more precise for the small sets.
+        return m * std::log(m / static_cast<double>(zeros));
+    }
+    return raw;
+}
+
+double HyperLogLog::standard_error() const
+{
+    return 1.04 / std::sqrt(static_cast<double>(registers_.size()));
+}
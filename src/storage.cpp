@@ -1,111 +1,1652 @@
 #include "storage.h"
+#include "subscription.h"
 #include <algorithm>
+#include <functional>
 #include <iterator>
+#include <stdexcept>
+#include <thread>
 
-Storage::Storage()
+namespace {
+
+template <typename Key>
+bool parse_key(const std::string& text, Key& key)
+{
+    return parse_id(text.data(), text.data() + text.size(), key);
+}
+
+/// The rows go to the log and the snapshots as lines of tokens.
+bool valid_id(int32_t) { return true; }
+bool valid_id(int64_t) { return true; }
+bool valid_id(const std::string& id) { return valid_token(id); }
+
+uint64_t sketch_value(int32_t id) { return static_cast<uint32_t>(id); }
+uint64_t sketch_value(int64_t id) { return static_cast<uint64_t>(id); }
+uint64_t sketch_value(const std::string& id) { return std::hash<std::string>()(id); }
+
+} // namespace
+
+table_handle_t TableCatalog::add(const std::string& name)
+{
+    names_.push_back(name);
+    return names_.size() - 1;
+}
+
+table_handle_t TableCatalog::find(const std::string& name) const
+{
+    // A few tables, a scan beats a tree.
+    for (size_t i = 0; i < names_.size(); ++i) {
+        if (names_[i] == name) {
+            return i;
+        }
+    }
+    return no_table;
+}
+
+void detail::append_json(std::string& out, const std::string& text)
+{
+    static const char hex[] = "0123456789abcdef";
+    out.push_back('"');
+    for (const char ch : text) {
+        const unsigned char c = static_cast<unsigned char>(ch);
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(ch);
+        }
+        else if (c < 0x20) {
+            out.append("\\u00");
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 0xf]);
+        }
+        else {
+            out.push_back(ch);
+        }
+    }
+    out.push_back('"');
+}
+
+template <typename Key>
+BasicStorage<Key>::BasicStorage(const std::string& data_dir)
+    : data_dir_(data_dir)
 {
     add_table("A");
     add_table("B");
 }
 
-bool Storage::insert(const std::string& table, int id, const std::string& name)
+template <typename Key>
+bool BasicStorage<Key>::valid_key(const std::string& id) const
+{
+    Key key;
+    return parse_key(id, key);
+}
+
+template <typename Key>
+bool BasicStorage<Key>::insert(table_handle_t table,
+                               const std::string& id, const std::string& name)
+{
+    Key key;
+    return parse_key(id, key) && insert_key(table, key, name);
+}
+
+template <typename Key>
+bool BasicStorage<Key>::insert_key(table_handle_t table, const Key& id,
+                                   const std::string& name)
+{
+    if (table >= tables_.size() || !valid_id(id) || !valid_token(name)) {
+        return false;
+    }
+    lock_t lock(m_);
+    const bool inserted = insert_locked(table, id, name);
+    if (inserted) {
+        ++versions_[table];
+    }
+    return inserted;
+}
+
+template <typename Key>
+bool BasicStorage<Key>::insert_locked(table_handle_t table, const Key& id,
+                                      const std::string& name)
+{
+    if (!tables_[table].insert(id, name)) {
+        return false;
+    }
+    sketches_[table].add(sketch_value(id));
+    log_insert(table, id, name);
+    publish_insert(table, id, name);
+    return true;
+}
+
+template <typename Key>
+bool BasicStorage<Key>::truncate(table_handle_t table)
+{
+    if (table >= tables_.size()) {
+        return false;
+    }
+    std::shared_ptr<Table<Key>> old;
+    {
+        lock_t lock(m_);
+        old = truncate_locked(table);
+        ++versions_[table];
+    }
+    reclaimer_.retire(std::move(old));
+    return true;
+}
+
+template <typename Key>
+std::shared_ptr<Table<Key>> BasicStorage<Key>::truncate_locked(table_handle_t table)
+{
+    // Moving the table out is O(1), its rows are freed by the reclaimer.
+    auto old = std::make_shared<Table<Key>>(std::move(tables_[table]));
+    tables_[table] = Table<Key>();
+    sketches_[table].clear();
+    if (log_) {
+        log_->append("TRUNCATE " + catalog_.name(table));
+    }
+    publish_truncate(table, old);
+    return old;
+}
+
+template <typename Key>
+LoadResult BasicStorage<Key>::apply(const WriteSet& writes)
+{
+    // Nothing is changed unless every write is valid, the keys are parsed
+    // before the lock is taken.
+    std::vector<Key> keys(writes.size());
+    for (size_t i = 0; i < writes.size(); ++i) {
+        if (writes[i].table >= tables_.size()
+            || (!writes[i].truncate && (!parse_key(writes[i].id, keys[i])
+                                        || !valid_token(writes[i].name)))) {
+            throw std::invalid_argument("bad write in the transaction");
+        }
+    }
+
+    LoadResult result { 0, 0 };
+    std::vector<std::shared_ptr<Table<Key>>> truncated;
+    {
+        lock_t lock(m_);
+        std::vector<bool> changed(tables_.size());
+        for (size_t i = 0; i < writes.size(); ++i) {
+            const Write& w = writes[i];
+            if (w.truncate) {
+                truncated.push_back(truncate_locked(w.table));
+                changed[w.table] = true;
+            }
+            else if (insert_locked(w.table, keys[i], w.name)) {
+                changed[w.table] = true;
+                ++result.loaded;
+            }
+            else {
+                ++result.duplicates;
+            }
+        }
+        // One version per table for the whole transaction.
+        for (size_t t = 0; t < changed.size(); ++t) {
+            versions_[t] += changed[t];
+        }
+    }
+    for (auto& old : truncated) {
+        reclaimer_.retire(std::move(old));
+    }
+    return result;
+}
+
+template <typename Key>
+LoadResult BasicStorage<Key>::load(const std::string& table, const std::string& path,
+                                   FileFormat format)
 {
+    const table_handle_t index = catalog_.find(table);
+    if (index == no_table) {
+        throw std::invalid_argument("unknown table");
+    }
+
+    // The file is read and sorted before the lock is taken.
+    file_rows_t<Key> rows;
+    LoadResult result { 0, read_rows(data_path(path), format, rows) };
+
+    bool empty;
+    {
+        lock_t lock(m_);
+        empty = tables_[index].size() == 0;
+    }
+    // An empty table is built from the rows with the lock released and
+    // swapped in, the rows keep their names for the log and for the
+    // subscribers.
+    Table<Key> built;
+    HyperLogLog built_sketch;
+    if (empty) {
+        for (const auto& row : rows) {
+            built_sketch.add(sketch_value(row.first));
+            built.append(row.first, row.second);
+        }
+        built.run_optimize();
+    }
+
     lock_t lock(m_);
-    auto found = names_.find(table);
-    if (found != names_.end()) {
-        auto rc = found->second.emplace(id, name);
-        return rc.second;
+    Table<Key>& t = tables_[index];
+    HyperLogLog& sketch = sketches_[index];
+    if (empty && t.size() == 0) {
+        std::swap(t, built);
+        sketch.merge(built_sketch);
+        for (const auto& row : rows) {
+            log_insert(index, row.first, row.second);
+            publish_insert(index, row.first, row.second);
+        }
+        result.loaded = rows.size();
     }
-    return false;
+    else {
+        // Rows were inserted while the table was built, it is merged row
+        // by row.
+        for (const auto& row : rows) {
+            if (t.insert(row.first, row.second)) {
+                sketch.add(sketch_value(row.first));
+                log_insert(index, row.first, row.second);
+                publish_insert(index, row.first, row.second);
+                ++result.loaded;
+            }
+            else {
+                ++result.duplicates;
+            }
+        }
+    }
+    if (result.loaded) {
+        ++versions_[index];
+    }
+    return result;
+}
+
+template <typename Key>
+void BasicStorage<Key>::log_insert(table_handle_t table, const Key& id,
+                                   const std::string& name)
+{
+    if (!log_) {
+        return;
+    }
+    std::string command = "INSERT " + catalog_.name(table) + " ";
+    detail::append_key(command, id);
+    command.push_back(' ');
+    command.append(name);
+    log_->append(std::move(command));
 }
 
-bool Storage::truncate(const std::string& table)
+template <typename Key>
+void BasicStorage<Key>::set_log(MutationLog* log)
 {
     lock_t lock(m_);
-    auto found = names_.find(table);
-    if (found != names_.end()) {
-        found->second.clear();
-        return true;
+    log_ = log;
+}
+
+template <typename Key>
+std::string BasicStorage<Key>::data_path(const std::string& path) const
+{
+    if (data_dir_.empty()) {
+        throw std::runtime_error("files need --data-dir");
     }
-    return false;
+    if (path.empty() || path[0] == '/' || path == ".." || path.find("../") == 0
+        || path.find("/../") != std::string::npos
+        || (path.size() > 2 && path.compare(path.size() - 3, 3, "/..") == 0)) {
+        throw std::invalid_argument("path outside of --data-dir");
+    }
+    return data_dir_ + "/" + path;
 }
 
-result_table_t Storage::intersection() const
+template <typename Key>
+versions_t BasicStorage<Key>::versions() const
 {
     lock_t lock(m_);
-    keys_tables_t table_keys;
-    extract_keys(table_keys);
+    return versions_;
+}
+
+namespace {
+
+const JoinRange whole_range;
+
+/**
+ * @brief Appends the rows of the slice in its order.
+ */
+template <typename Key>
+class SliceWriter
+{
+    public:
+        using key_t = Key;
+        using rows_t = typename ResultTable<Key>::rows_t;
+
+        SliceWriter(const JoinRange& range, rows_t& result)
+            : range_(range), result_(result) {}
+
+        bool full() const { return result_.size() >= range_.limit; }
+        /// The rows may come in any order, there is no slice to cut.
+        bool unordered() const
+        {
+            return range_.order == JoinOrder::Any && range_.offset == 0
+                   && range_.limit == std::numeric_limits<size_t>::max();
+        }
+        /// Writer of the rows of one partition of an unordered join.
+        SliceWriter part(rows_t& rows) const { return SliceWriter(whole_range, rows); }
+        void append(rows_t&& rows)
+        {
+            result_.insert(result_.end(), std::make_move_iterator(rows.begin()),
+                           std::make_move_iterator(rows.end()));
+        }
+
+        void add(const Key& id, const std::string& a, const std::string& b)
+        {
+            if (skipped_ < range_.offset) {
+                ++skipped_;
+                return;
+            }
+            BasicResultRecord<Key> rr(2);
+            rr.id = id;
+            rr.fields[0] = a;
+            rr.fields[1] = b;
+            result_.push_back(std::move(rr));
+        }
+
+    private:
+        const JoinRange& range_;
+        rows_t& result_;
+        size_t skipped_ = 0;
+};
+
+/**
+ * @brief Collects the rows of an export, the names stay in the snapshot.
+ */
+template <typename Key>
+class ExportWriter
+{
+    public:
+        using key_t = Key;
+        using rows_t = export_part_t<Key>;
+
+        explicit ExportWriter(rows_t& rows) : rows_(rows) {}
+
+        bool full() const { return false; }
+        bool unordered() const { return false; }
+        ExportWriter part(rows_t& rows) const { return ExportWriter(rows); }
+        void append(rows_t&& rows) { rows_.insert(rows_.end(), rows.begin(), rows.end()); }
+
+        void add(const Key& id, const std::string& a, const std::string& b)
+        {
+            rows_.push_back(ExportRow<Key> { id, { &a, &b } });
+        }
+
+    private:
+        rows_t& rows_;
+};
+
+const std::string empty_name;
+const IdTable empty_ids;
+
+using chunk_t = IdTable::Chunk;
+using chunks_t = IdTable::chunks_t;
+using cursor_t = RoaringContainer::RankCursor;
+
+/**
+ * @brief The range in the ids of an IdTable, to is 2^32 for the end.
+ */
+struct Bounds
+{
+    uint64_t from;
+    uint64_t to;
+
+    bool empty() const { return from >= to; }
+    bool covers(const chunk_t& c) const
+    {
+        return c.base() >= from && end(c) <= to;
+    }
+    bool before(const chunk_t& c) const { return end(c) <= from; }
+    bool after(const chunk_t& c) const { return c.base() >= to; }
 
-    keys_table_t keys_ab;
-    std::set_intersection(std::begin(table_keys[0]), std::end(table_keys[0]),
-                          std::begin(table_keys[1]), std::end(table_keys[1]),
-                          std::back_inserter(keys_ab));
+    /// Past the chunk, 2^32 for the last one.
+    static uint64_t end(const chunk_t& c) { return uint64_t(c.base()) + 65536; }
+};
 
-    result_table_t result;
-    fill_result(keys_ab, result);
+const uint64_t id_end = uint64_t(1) << 32;
+
+/// First chunk that may hold ids of the range.
+size_t first_chunk(const chunks_t& chunks, const Bounds& bounds)
+{
+    return static_cast<size_t>(std::partition_point(chunks.begin(), chunks.end(),
+                                                    [&bounds](const IdTable::ChunkPtr& c) {
+        return bounds.before(*c);
+    }) - chunks.begin());
+}
+
+/// Values of the container inside the range.
+size_t count_in(const RoaringContainer& ids, uint32_t base, const Bounds& bounds)
+{
+    size_t n = 0;
+    ids.for_each([&](uint16_t low) {
+        const uint64_t u = base | low;
+        if (u >= bounds.to) {
+            return false;
+        }
+        n += u >= bounds.from;
+        return true;
+    });
+    return n;
+}
+
+size_t slice(size_t n, const JoinRange& range)
+{
+    return n > range.offset ? std::min(n - range.offset, range.limit) : 0;
+}
+
+/// The ascending slice that holds the rows of a descending one.
+JoinRange ascending(const JoinRange& range, size_t n)
+{
+    JoinRange slice = range;
+    const size_t end = n > range.offset ? n - range.offset : 0;
+    slice.offset = end - std::min(range.limit, end);
+    slice.limit = end - slice.offset;
+    slice.order = JoinOrder::Asc;
+    return slice;
+}
+
+/// Chunks of the larger table given to one thread of an unordered join.
+const size_t partition_chunks = 64;
+
+/// Consecutive ranges of the ids between the ascending cuts.
+std::vector<JoinRange> ranges(const std::vector<int64_t>& cuts)
+{
+    std::vector<JoinRange> result(cuts.size() + 1);
+    for (size_t i = 0; i < cuts.size(); ++i) {
+        result[i].to = cuts[i];
+        result[i].has_to = true;
+        result[i + 1].from = cuts[i];
+    }
     return result;
 }
 
-result_table_t Storage::symmetric_difference() const
+/**
+ * @brief Runs kernel(ta, tb, bounds, decode, out) over disjoint chunk
+ *        ranges on their own threads when the rows are unordered, the
+ *        rows of every range are appended as soon as it is done.
+ */
+template <typename Kernel, typename Decode, typename Out>
+void join_partitions(const IdTable& ta, const IdTable& tb, const Bounds& bounds,
+                     const Decode& decode, Out& out, Kernel kernel)
 {
-    lock_t lock(m_);
-    keys_tables_t table_keys;
-    extract_keys(table_keys);
+    const chunks_t& c = ta.chunks().size() >= tb.chunks().size() ? ta.chunks()
+                                                                  : tb.chunks();
+    const size_t n = std::min<size_t>(std::thread::hardware_concurrency(),
+                                      c.size() / partition_chunks);
+    if (!out.unordered() || n < 2) {
+        kernel(ta, tb, bounds, decode, out);
+        return;
+    }
+
+    std::mutex m;
+    std::exception_ptr error;
+    std::vector<std::thread> workers;
+    for (size_t p = 0; p < n; ++p) {
+        const Bounds part {
+            p == 0 ? bounds.from : std::max<uint64_t>(bounds.from, c[p * c.size() / n]->base()),
+            p + 1 == n ? bounds.to
+                       : std::min<uint64_t>(bounds.to, c[(p + 1) * c.size() / n]->base())
+        };
+        if (part.empty()) {
+            continue;
+        }
+        workers.emplace_back([&, part]() {
+            try {
+                typename Out::rows_t rows;
+                Out local = out.part(rows);
+                kernel(ta, tb, part, decode, local);
+
+                lock_t lock(m);
+                out.append(std::move(rows));
+            }
+            catch (...) {
+                lock_t lock(m);
+                error = std::current_exception();
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+template <typename Decode, typename Out>
+bool emit_chunk(const chunk_t& c, bool left, const Bounds& bounds,
+                const Decode& decode, Out& out)
+{
+    size_t rank = 0;
+    return c.ids.for_each([&](uint16_t low) {
+        const uint64_t u = c.base() | low;
+        if (u >= bounds.to) {
+            return false;
+        }
+        if (u >= bounds.from) {
+            const std::string& name = c.name_at(rank);
+            out.add(decode(static_cast<uint32_t>(u)),
+                    left ? name : empty_name, left ? empty_name : name);
+        }
+        ++rank;
+        return !out.full();
+    });
+}
+
+/// Intersection of two IdTables, decode turns their ids into keys.
+template <typename Decode, typename Out>
+void merge_intersection(const IdTable& ta, const IdTable& tb, const Bounds& bounds,
+                        const Decode& decode, Out& out)
+{
+    const chunks_t& ca = ta.chunks();
+    const chunks_t& cb = tb.chunks();
+    size_t i = first_chunk(ca, bounds);
+    size_t j = first_chunk(cb, bounds);
+
+    while (i < ca.size() && j < cb.size() && !out.full()) {
+        if (ca[i]->key < cb[j]->key) {
+            ++i;
+            continue;
+        }
+        if (cb[j]->key < ca[i]->key) {
+            ++j;
+            continue;
+        }
+
+        const chunk_t& x = *ca[i++];
+        const chunk_t& y = *cb[j++];
+        if (bounds.after(x)) {
+            break;
+        }
+        cursor_t rx(x.ids);
+        cursor_t ry(y.ids);
+        RoaringContainer::intersect(x.ids, y.ids).for_each([&](uint16_t low) {
+            const uint64_t u = x.base() | low;
+            if (u >= bounds.to) {
+                return false;
+            }
+            if (u >= bounds.from) {
+                out.add(decode(static_cast<uint32_t>(u)),
+                        x.name_at(rx.rank(low)), y.name_at(ry.rank(low)));
+            }
+            return !out.full();
+        });
+    }
+}
+
+/// Symmetric difference of two IdTables, decode turns their ids into keys.
+template <typename Decode, typename Out>
+void merge_symmetric_difference(const IdTable& ta, const IdTable& tb,
+                                const Bounds& bounds, const Decode& decode, Out& out)
+{
+    const chunks_t& ca = ta.chunks();
+    const chunks_t& cb = tb.chunks();
+    size_t i = first_chunk(ca, bounds);
+    size_t j = first_chunk(cb, bounds);
+
+    while ((i < ca.size() || j < cb.size()) && !out.full()) {
+        if (j == cb.size() || (i < ca.size() && ca[i]->key < cb[j]->key)) {
+            if (!emit_chunk(*ca[i++], true, bounds, decode, out)) {
+                break;
+            }
+            continue;
+        }
+        if (i == ca.size() || cb[j]->key < ca[i]->key) {
+            if (!emit_chunk(*cb[j++], false, bounds, decode, out)) {
+                break;
+            }
+            continue;
+        }
+
+        const chunk_t& x = *ca[i++];
+        const chunk_t& y = *cb[j++];
+        if (bounds.after(x)) {
+            break;
+        }
+        cursor_t rx(x.ids);
+        cursor_t ry(y.ids);
+        const bool more = RoaringContainer::symmetric_difference(x.ids, y.ids)
+                          .for_each([&](uint16_t low) {
+            const uint64_t u = x.base() | low;
+            if (u >= bounds.to) {
+                return false;
+            }
+            const auto id = decode(static_cast<uint32_t>(u));
+            // Ranks are taken for every value so the cursors stay in step.
+            if (x.ids.contains(low)) {
+                const std::string& name = x.name_at(rx.rank(low));
+                if (u >= bounds.from) {
+                    out.add(id, name, empty_name);
+                }
+            }
+            else {
+                const std::string& name = y.name_at(ry.rank(low));
+                if (u >= bounds.from) {
+                    out.add(id, empty_name, name);
+                }
+            }
+            return !out.full();
+        });
+        if (!more) {
+            break;
+        }
+    }
+}
+
+size_t count_intersection(const IdTable& ta, const IdTable& tb, const Bounds& bounds)
+{
+    const chunks_t& ca = ta.chunks();
+    const chunks_t& cb = tb.chunks();
+
+    size_t n = 0;
+    for (size_t i = first_chunk(ca, bounds), j = first_chunk(cb, bounds);
+         i < ca.size() && j < cb.size() && !bounds.after(*ca[i]);) {
+        if (ca[i]->key < cb[j]->key) {
+            ++i;
+        }
+        else if (cb[j]->key < ca[i]->key) {
+            ++j;
+        }
+        else {
+            const chunk_t& x = *ca[i++];
+            const chunk_t& y = *cb[j++];
+            n += bounds.covers(x)
+                 ? RoaringContainer::intersect_cardinality(x.ids, y.ids)
+                 : count_in(RoaringContainer::intersect(x.ids, y.ids), x.base(), bounds);
+        }
+    }
+    return n;
+}
+
+size_t count_symmetric_difference(const IdTable& ta, const IdTable& tb,
+                                  const Bounds& bounds)
+{
+    const chunks_t& ca = ta.chunks();
+    const chunks_t& cb = tb.chunks();
+
+    auto count_chunk = [&bounds](const chunk_t& c) {
+        return bounds.covers(c) ? c.ids.cardinality() : count_in(c.ids, c.base(), bounds);
+    };
+
+    size_t n = 0;
+    size_t i = first_chunk(ca, bounds);
+    size_t j = first_chunk(cb, bounds);
+    while (i < ca.size() || j < cb.size()) {
+        const chunk_t& next = j == cb.size() || (i < ca.size() && ca[i]->key <= cb[j]->key)
+                              ? *ca[i] : *cb[j];
+        if (bounds.after(next)) {
+            break;
+        }
+        if (j == cb.size() || (i < ca.size() && ca[i]->key < cb[j]->key)) {
+            n += count_chunk(*ca[i++]);
+        }
+        else if (i == ca.size() || cb[j]->key < ca[i]->key) {
+            n += count_chunk(*cb[j++]);
+        }
+        else {
+            const chunk_t& x = *ca[i++];
+            const chunk_t& y = *cb[j++];
+            n += bounds.covers(x)
+                 ? x.ids.cardinality() + y.ids.cardinality()
+                   - 2 * RoaringContainer::intersect_cardinality(x.ids, y.ids)
+                 : count_in(RoaringContainer::symmetric_difference(x.ids, y.ids),
+                            x.base(), bounds);
+        }
+    }
+    return n;
+}
+
+/// @name Kernels for join_partitions
+/// @{
+struct intersection_kernel
+{
+    template <typename Decode, typename Out>
+    void operator()(const IdTable& ta, const IdTable& tb, const Bounds& bounds,
+                    const Decode& decode, Out& out) const
+    {
+        merge_intersection(ta, tb, bounds, decode, out);
+    }
+};
+
+struct symmetric_difference_kernel
+{
+    template <typename Decode, typename Out>
+    void operator()(const IdTable& ta, const IdTable& tb, const Bounds& bounds,
+                    const Decode& decode, Out& out) const
+    {
+        merge_symmetric_difference(ta, tb, bounds, decode, out);
+    }
+};
+/// @}
+
+/**
+ * @brief Join kernels per key type, counts are before OFFSET and LIMIT.
+ */
+template <typename Key>
+struct Joins;
+
+template <>
+struct Joins<int32_t>
+{
+    using table_t = Table<int32_t>;
+    /// Descending slices are cut from the count of the join.
+    static const bool descending = false;
+
+    static uint64_t encode(int64_t id)
+    {
+        if (id < std::numeric_limits<int32_t>::min()) {
+            return 0;
+        }
+        if (id > std::numeric_limits<int32_t>::max()) {
+            return id_end;
+        }
+        return table_t::encode(static_cast<int32_t>(id));
+    }
+
+    static Bounds bounds(const JoinRange& range)
+    {
+        return Bounds { encode(range.from), range.has_to ? encode(range.to) : id_end };
+    }
+
+    template <typename Out>
+    static void intersection(const table_t& ta, const table_t& tb,
+                             const JoinRange& range, Out& out)
+    {
+        join_partitions(ta.ids(), tb.ids(), bounds(range), table_t::decode, out,
+                        intersection_kernel());
+    }
+
+    template <typename Out>
+    static void symmetric_difference(const table_t& ta, const table_t& tb,
+                                     const JoinRange& range, Out& out)
+    {
+        join_partitions(ta.ids(), tb.ids(), bounds(range), table_t::decode, out,
+                        symmetric_difference_kernel());
+    }
+
+    static size_t intersection_count(const table_t& ta, const table_t& tb,
+                                     const JoinRange& range)
+    {
+        return count_intersection(ta.ids(), tb.ids(), bounds(range));
+    }
+
+    static size_t symmetric_difference_count(const table_t& ta, const table_t& tb,
+                                             const JoinRange& range)
+    {
+        return count_symmetric_difference(ta.ids(), tb.ids(), bounds(range));
+    }
+
+    /// At most n ranges of the ids cut at the chunks of the larger table,
+    /// partition_chunks chunks at least in every range.
+    static std::vector<JoinRange> split(const table_t& ta, const table_t& tb, size_t n)
+    {
+        const chunks_t& c = ta.ids().chunks().size() >= tb.ids().chunks().size()
+                            ? ta.ids().chunks() : tb.ids().chunks();
+        const size_t parts = std::min(n, c.size() / partition_chunks);
+        std::vector<int64_t> cuts;
+        for (size_t p = 1; p < parts; ++p) {
+            cuts.push_back(table_t::decode(c[p * c.size() / parts]->base()));
+        }
+        return ranges(cuts);
+    }
+};
+
+/**
+ * @brief The parts of both tables are merged by their high halves and
+ *        every pair of parts is joined as 32-bit ids.
+ */
+template <>
+struct Joins<int64_t>
+{
+    using table_t = Table<int64_t>;
+    static const bool descending = false;
+    using part_t = table_t::Part;
+    using parts_t = std::vector<part_t>;
+
+    /// Range of the low halves within the part, empty outside the range.
+    static Bounds bounds(uint32_t high, const JoinRange& range)
+    {
+        const uint64_t from = table_t::encode(range.from);
+        const uint64_t to = table_t::encode(range.to);
+        Bounds b { 0, id_end };
+        if (high < from >> 32) {
+            return Bounds { 0, 0 };
+        }
+        if (high == from >> 32) {
+            b.from = from & 0xffffffff;
+        }
+        if (range.has_to) {
+            if (high > to >> 32) {
+                return Bounds { 0, 0 };
+            }
+            if (high == to >> 32) {
+                b.to = to & 0xffffffff;
+            }
+        }
+        return b;
+    }
+
+    /// Calls f(high, part of A, part of B) in ascending order of the high
+    /// halves, a part missing in one table is empty_ids, until f is false.
+    template <typename F>
+    static void merge_parts(const table_t& ta, const table_t& tb, bool both, F f)
+    {
+        const parts_t& pa = ta.parts();
+        const parts_t& pb = tb.parts();
+        size_t i = 0;
+        size_t j = 0;
+        while (i < pa.size() || j < pb.size()) {
+            bool more = true;
+            if (j == pb.size() || (i < pa.size() && pa[i].high < pb[j].high)) {
+                more = both || f(pa[i].high, pa[i].ids, empty_ids);
+                ++i;
+            }
+            else if (i == pa.size() || pb[j].high < pa[i].high) {
+                more = both || f(pb[j].high, empty_ids, pb[j].ids);
+                ++j;
+            }
+            else {
+                more = f(pa[i].high, pa[i].ids, pb[j].ids);
+                ++i;
+                ++j;
+            }
+            if (!more) {
+                break;
+            }
+        }
+    }
+
+    struct Decode
+    {
+        uint32_t high;
+
+        int64_t operator()(uint32_t low) const
+        {
+            return table_t::decode((uint64_t(high) << 32) | low);
+        }
+    };
+
+    template <typename Out>
+    static void intersection(const table_t& ta, const table_t& tb,
+                             const JoinRange& range, Out& out)
+    {
+        merge_parts(ta, tb, true, [&](uint32_t high, const IdTable& a, const IdTable& b) {
+            const Bounds bounds = Joins::bounds(high, range);
+            if (!bounds.empty()) {
+                join_partitions(a, b, bounds, Decode { high }, out, intersection_kernel());
+            }
+            return !out.full() && (!range.has_to || high < table_t::encode(range.to) >> 32);
+        });
+    }
+
+    template <typename Out>
+    static void symmetric_difference(const table_t& ta, const table_t& tb,
+                                     const JoinRange& range, Out& out)
+    {
+        merge_parts(ta, tb, false, [&](uint32_t high, const IdTable& a, const IdTable& b) {
+            const Bounds bounds = Joins::bounds(high, range);
+            if (bounds.empty()) {
+                return !range.has_to || high < table_t::encode(range.to) >> 32;
+            }
+            join_partitions(a, b, bounds, Decode { high }, out,
+                            symmetric_difference_kernel());
+            return !out.full() && (!range.has_to || high < table_t::encode(range.to) >> 32);
+        });
+    }
+
+    static size_t intersection_count(const table_t& ta, const table_t& tb,
+                                     const JoinRange& range)
+    {
+        size_t n = 0;
+        merge_parts(ta, tb, true, [&](uint32_t high, const IdTable& a, const IdTable& b) {
+            const Bounds bounds = Joins::bounds(high, range);
+            if (!bounds.empty()) {
+                n += count_intersection(a, b, bounds);
+            }
+            return true;
+        });
+        return n;
+    }
+
+    static size_t symmetric_difference_count(const table_t& ta, const table_t& tb,
+                                             const JoinRange& range)
+    {
+        size_t n = 0;
+        merge_parts(ta, tb, false, [&](uint32_t high, const IdTable& a, const IdTable& b) {
+            const Bounds bounds = Joins::bounds(high, range);
+            if (!bounds.empty()) {
+                n += count_symmetric_difference(a, b, bounds);
+            }
+            return true;
+        });
+        return n;
+    }
+
+    /// At most n ranges of the ids cut at the chunks of the larger table,
+    /// partition_chunks chunks at least in every range.
+    static std::vector<JoinRange> split(const table_t& ta, const table_t& tb, size_t n)
+    {
+        const table_t& t = ta.size() >= tb.size() ? ta : tb;
+        std::vector<uint64_t> bases;
+        for (const auto& part : t.parts()) {
+            for (const auto& c : part.ids.chunks()) {
+                bases.push_back((uint64_t(part.high) << 32) | c->base());
+            }
+        }
+        const size_t parts = std::min(n, bases.size() / partition_chunks);
+        std::vector<int64_t> cuts;
+        for (size_t p = 1; p < parts; ++p) {
+            cuts.push_back(table_t::decode(bases[p * bases.size() / parts]));
+        }
+        return ranges(cuts);
+    }
+};
+
+/**
+ * @brief Plain merges of the ordered maps, FROM and TO are not defined
+ *        for string ids.
+ */
+template <>
+struct Joins<std::string>
+{
+    using table_t = Table<std::string>;
+    using rows_t = table_t::rows_t;
+    /// The maps are walked backwards for descending slices.
+    static const bool descending = true;
+
+    static void check(const JoinRange& range)
+    {
+        if (range.from != JoinRange().from || range.has_to) {
+            throw std::invalid_argument("FROM and TO need integer ids");
+        }
+    }
+
+    /// Calls f(id, name in A or null, name in B or null) in the order of
+    /// the ids, descending when desc is set, until f is false.
+    template <typename F>
+    static void merge(const rows_t& ra, const rows_t& rb, bool desc, F f)
+    {
+        if (desc) {
+            merge(ra.rbegin(), ra.rend(), rb.rbegin(), rb.rend(),
+                  std::greater<std::string>(), f);
+        }
+        else {
+            merge(ra.begin(), ra.end(), rb.begin(), rb.end(), std::less<std::string>(), f);
+        }
+    }
 
-    keys_table_t keys_ab;
-    std::set_symmetric_difference(
-                std::begin(table_keys[0]), std::end(table_keys[0]),
-                std::begin(table_keys[1]), std::end(table_keys[1]),
-                std::back_inserter(keys_ab));
+    template <typename I, typename Less, typename F>
+    static void merge(I i, I end_i, I j, I end_j, Less less, F f)
+    {
+        while (i != end_i || j != end_j) {
+            bool more = true;
+            if (j == end_j || (i != end_i && less(i->first, j->first))) {
+                more = f(i->first, &i->second, nullptr);
+                ++i;
+            }
+            else if (i == end_i || less(j->first, i->first)) {
+                more = f(j->first, nullptr, &j->second);
+                ++j;
+            }
+            else {
+                more = f(i->first, &i->second, &j->second);
+                ++i;
+                ++j;
+            }
+            if (!more) {
+                break;
+            }
+        }
+    }
+
+    template <typename Out>
+    static void intersection(const table_t& ta, const table_t& tb,
+                             const JoinRange& range, Out& out)
+    {
+        check(range);
+        if (range.order == JoinOrder::Desc) {
+            merge(ta.rows(), tb.rows(), true, [&out](const std::string& id,
+                                                     const std::string* a,
+                                                     const std::string* b) {
+                if (a && b) {
+                    out.add(id, *a, *b);
+                }
+                return !out.full();
+            });
+            return;
+        }
+        const rows_t& ra = ta.rows();
+        const rows_t& rb = tb.rows();
+        auto i = ra.begin();
+        auto j = rb.begin();
+        while (i != ra.end() && j != rb.end() && !out.full()) {
+            if (i->first < j->first) {
+                i = ra.lower_bound(j->first);
+            }
+            else if (j->first < i->first) {
+                j = rb.lower_bound(i->first);
+            }
+            else {
+                out.add(i->first, i->second, j->second);
+                ++i;
+                ++j;
+            }
+        }
+    }
+
+    template <typename Out>
+    static void symmetric_difference(const table_t& ta, const table_t& tb,
+                                     const JoinRange& range, Out& out)
+    {
+        check(range);
+        merge(ta.rows(), tb.rows(), range.order == JoinOrder::Desc,
+              [&out](const std::string& id, const std::string* a, const std::string* b) {
+            if (!a || !b) {
+                out.add(id, a ? *a : empty_name, b ? *b : empty_name);
+            }
+            return !out.full();
+        });
+    }
+
+    static size_t intersection_count(const table_t& ta, const table_t& tb,
+                                     const JoinRange& range)
+    {
+        check(range);
+        size_t n = 0;
+        merge(ta.rows(), tb.rows(), false, [&n](const std::string&,
+                                                const std::string* a,
+                                                const std::string* b) {
+            n += a && b;
+            return true;
+        });
+        return n;
+    }
+
+    static size_t symmetric_difference_count(const table_t& ta, const table_t& tb,
+                                             const JoinRange& range)
+    {
+        return ta.size() + tb.size() - 2 * intersection_count(ta, tb, range);
+    }
+
+    /// Ranges are not defined for string ids, the whole join is one part.
+    static std::vector<JoinRange> split(const table_t&, const table_t&, size_t)
+    {
+        return std::vector<JoinRange>(1);
+    }
+};
+
+} // namespace
 
-    result_table_t result;
-    fill_result(keys_ab, result);
+namespace {
+
+/**
+ * @brief Rows of the join into a vector reserved for at most limit rows
+ *        or the bound. Descending slices of integer ids are cut from the
+ *        count of the join, joined ascending and reversed.
+ */
+template <typename Key, typename Join, typename Count>
+result_table_t join_rows(const JoinRange& range, size_t bound, Join join, Count count)
+{
+    auto result = std::make_shared<ResultTable<Key>>();
+    JoinRange slice = range;
+    if (range.order == JoinOrder::Desc && !Joins<Key>::descending) {
+        slice = ascending(range, count());
+        result->rows().reserve(slice.limit);
+    }
+    else {
+        result->rows().reserve(std::min(range.limit, bound));
+    }
+
+    SliceWriter<Key> out(slice, result->rows());
+    join(slice, out);
+    if (slice.order != range.order) {
+        std::reverse(result->rows().begin(), result->rows().end());
+    }
     return result;
 }
 
-void Storage::add_table(const char* name)
+/**
+ * @brief Joins the snapshot by ranges of the ids on their own threads and
+ *        writes the parts to the file, columns is 1 for a table.
+ */
+template <typename Key>
+size_t export_rows(const Table<Key>& ta, const Table<Key>& tb, JoinKind kind,
+                   unsigned columns, const std::string& path, FileFormat format)
+{
+    const std::vector<JoinRange> ranges = Joins<Key>::split(ta, tb,
+                                                            std::thread::hardware_concurrency());
+
+    std::vector<export_part_t<Key>> parts(ranges.size());
+    std::mutex m;
+    std::exception_ptr error;
+    std::vector<std::thread> workers;
+    for (size_t p = 0; p < ranges.size(); ++p) {
+        workers.emplace_back([&, p]() {
+            try {
+                ExportWriter<Key> out(parts[p]);
+                if (kind == JoinKind::Intersection) {
+                    Joins<Key>::intersection(ta, tb, ranges[p], out);
+                }
+                else {
+                    Joins<Key>::symmetric_difference(ta, tb, ranges[p], out);
+                }
+            }
+            catch (...) {
+                lock_t lock(m);
+                error = std::current_exception();
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return write_rows(path, format, columns, parts);
+}
+
+} // namespace
+
+template <typename Key>
+size_t BasicStorage<Key>::export_join(JoinKind kind, const std::string& path,
+                                      FileFormat format) const
 {
-    tables_.emplace_back(table_t());
-    names_.emplace(name, tables_.back());
+    const std::string file = data_path(path);
+    const std::vector<Table<Key>> tables = snapshot();
+    return export_rows(tables[0], tables[1], kind, 2, file, format);
 }
 
-std::tuple<std::string, bool> Storage::find_name(const table_t& data, int key) const
+template <typename Key>
+size_t BasicStorage<Key>::export_table(const std::string& table, const std::string& path,
+                                       FileFormat format) const
 {
-    auto found = std::find_if(std::begin(data), std::end(data),
-                              [&key](const Record& rec)
+    const table_handle_t index = catalog_.find(table);
+    if (index == no_table) {
+        throw std::invalid_argument("unknown table");
+    }
+    const std::string file = data_path(path);
+    Table<Key> rows;
     {
-        return rec.id == key;
+        lock_t lock(m_);
+        rows = tables_[index];
+    }
+    // The rows of a table are its symmetric difference with an empty one.
+    return export_rows(rows, Table<Key>(), JoinKind::SymmetricDifference, 1, file, format);
+}
+
+namespace {
+
+/// Calls f(id, name) for every row of the chunk.
+template <typename Decode, typename F>
+void for_each_row(const chunk_t& c, const Decode& decode, F& f)
+{
+    size_t rank = 0;
+    c.ids.for_each([&](uint16_t low) {
+        f(decode(c.base() | low), c.name_at(rank++));
+        return true;
     });
-    if (found != std::end(data)) {
-        return std::make_tuple(found->name, true);
+}
+
+/**
+ * @brief Position of a walk through the rows of a table, next() calls
+ *        f(id, name) for the rows of the next chunk and is false at the
+ *        end of the table.
+ */
+template <typename Key>
+struct RowCursor;
+
+template <>
+struct RowCursor<int32_t>
+{
+    size_t chunk = 0;
+
+    template <typename F>
+    bool next(const Table<int32_t>& t, F f)
+    {
+        const chunks_t& chunks = t.ids().chunks();
+        if (chunk == chunks.size()) {
+            return false;
+        }
+        for_each_row(*chunks[chunk++], Table<int32_t>::decode, f);
+        return true;
     }
-    return std::make_tuple("", false);
+};
+
+template <>
+struct RowCursor<int64_t>
+{
+    size_t part = 0;
+    size_t chunk = 0;
+
+    template <typename F>
+    bool next(const Table<int64_t>& t, F f)
+    {
+        const auto& parts = t.parts();
+        while (part < parts.size() && chunk == parts[part].ids.chunks().size()) {
+            ++part;
+            chunk = 0;
+        }
+        if (part == parts.size()) {
+            return false;
+        }
+        for_each_row(*parts[part].ids.chunks()[chunk++],
+                     Joins<int64_t>::Decode { parts[part].high }, f);
+        return true;
+    }
+};
+
+template <>
+struct RowCursor<std::string>
+{
+    bool started = false;
+    Table<std::string>::rows_t::const_iterator row;
+
+    template <typename F>
+    bool next(const Table<std::string>& t, F f)
+    {
+        if (!started) {
+            row = t.rows().begin();
+            started = true;
+        }
+        if (row == t.rows().end()) {
+            return false;
+        }
+        f(row->first, row->second);
+        ++row;
+        return true;
+    }
+};
+
+/**
+ * @brief Dump of copies of the tables, the chunks are shared with the
+ *        storage until it writes to them.
+ */
+template <typename Key>
+class TableDump : public IDump
+{
+    public:
+        TableDump(std::vector<Table<Key>> tables, const std::vector<std::string>& names)
+            : tables_(std::move(tables))
+            , names_(names)
+        {
+        }
+
+        bool next(std::string& out, size_t max_bytes) override
+        {
+            const size_t before = out.size();
+            while (table_ < tables_.size() && out.size() < max_bytes) {
+                if (!started_) {
+                    out.append("TRUNCATE ").append(names_[table_]).push_back('\n');
+                    prefix_ = "INSERT " + names_[table_] + " ";
+                    started_ = true;
+                }
+                else if (!cursor_.next(tables_[table_], [&](const Key& id,
+                                                            const std::string& name) {
+                    out.append(prefix_);
+                    detail::append_key(out, id);
+                    out.push_back(' ');
+                    out.append(name).push_back('\n');
+                })) {
+                    ++table_;
+                    cursor_ = RowCursor<Key>();
+                    started_ = false;
+                }
+            }
+            return out.size() > before;
+        }
+
+    private:
+        std::vector<Table<Key>> tables_;
+        const std::vector<std::string> names_;
+        size_t table_ = 0;
+        /// The TRUNCATE of the table is out.
+        bool started_ = false;
+        std::string prefix_;
+        RowCursor<Key> cursor_;
+};
+
+/**
+ * @brief Changes of a join when a table was truncated, made a chunk at a
+ *        time as the subscriber takes them. Every row of the old table
+ *        leaves the join or, for the symmetric difference, has its row
+ *        of the other table enter it.
+ */
+template <typename Key>
+class TruncateDelta : public IDump
+{
+    public:
+        using table_ptr = std::shared_ptr<const Table<Key>>;
+
+        /// truncated_a when the old rows were those of A, other is the
+        /// other table at the time.
+        TruncateDelta(JoinKind kind, bool truncated_a, table_ptr old, table_ptr other)
+            : kind_(kind)
+            , truncated_a_(truncated_a)
+            , old_(std::move(old))
+            , other_(std::move(other))
+        {
+        }
+
+        bool next(std::string& out, size_t max_bytes) override
+        {
+            const size_t before = out.size();
+            auto row = [&](const Key& id, const std::string&) {
+                const std::string* name = other_->find(id);
+                if (name && kind_ == JoinKind::SymmetricDifference) {
+                    out.push_back('+');
+                    detail::append_key(out, id);
+                    out.append(truncated_a_ ? ",," : ",").append(*name);
+                    out.append(truncated_a_ ? "" : ",").push_back('\n');
+                }
+                else if (name || kind_ == JoinKind::SymmetricDifference) {
+                    out.push_back('-');
+                    detail::append_key(out, id);
+                    out.push_back('\n');
+                }
+            };
+            bool more = true;
+            while (more && out.size() < max_bytes) {
+                more = cursor_.next(*old_, row);
+            }
+            return out.size() > before;
+        }
+
+    private:
+        const JoinKind kind_;
+        const bool truncated_a_;
+        const table_ptr old_;
+        const table_ptr other_;
+        RowCursor<Key> cursor_;
+};
+
+/**
+ * @brief The rows of a join as "+id,a,b" lines, the first item of a
+ *        subscription, so that its changes apply to a known set of rows.
+ */
+template <typename Key>
+class JoinRows : public IDump
+{
+    public:
+        using table_ptr = std::shared_ptr<const Table<Key>>;
+
+        JoinRows(JoinKind kind, table_ptr a, table_ptr b)
+            : kind_(kind)
+            , a_(std::move(a))
+            , b_(std::move(b))
+        {
+        }
+
+        bool next(std::string& out, size_t max_bytes) override
+        {
+            const size_t before = out.size();
+            // The rows of A, then those of B alone for the symmetric
+            // difference.
+            while (!done_ && out.size() < max_bytes) {
+                const bool in_a = !in_b_;
+                const Table<Key>& other = in_a ? *b_ : *a_;
+                auto row = [&](const Key& id, const std::string& name) {
+                    const std::string* match = other.find(id);
+                    if ((match != nullptr) != (kind_ == JoinKind::Intersection)) {
+                        return;
+                    }
+                    out.push_back('+');
+                    detail::append_key(out, id);
+                    if (match) {
+                        out.append(",").append(name).append(",").append(*match);
+                    }
+                    else {
+                        out.append(in_a ? "," : ",,").append(name).append(in_a ? "," : "");
+                    }
+                    out.push_back('\n');
+                };
+                if (!cursor_.next(in_a ? *a_ : *b_, row)) {
+                    done_ = in_b_ || kind_ == JoinKind::Intersection;
+                    in_b_ = true;
+                    cursor_ = RowCursor<Key>();
+                }
+            }
+            return out.size() > before;
+        }
+
+    private:
+        const JoinKind kind_;
+        const table_ptr a_;
+        const table_ptr b_;
+        RowCursor<Key> cursor_;
+        bool in_b_ = false;
+        bool done_ = false;
+};
+
+/// The rows of other a TruncateDelta of old looks up, a copy of other
+/// when copies are cheap.
+template <typename Key>
+std::shared_ptr<const Table<Key>> delta_rows(const Table<Key>&, const Table<Key>& other)
+{
+    return std::make_shared<const Table<Key>>(other);
 }
 
-void Storage::extract_keys(keys_tables_t& table_keys) const
+/// The string ids are copied row by row, only those of the old rows are.
+std::shared_ptr<const Table<std::string>> delta_rows(const Table<std::string>& old,
+                                                      const Table<std::string>& other)
 {
-    for (const auto& t : tables_) {
-        keys_table_t keys;
-        transform(std::begin(t), std::end(t), back_inserter(keys),
-                  [](const Record& rec) { return rec.id; });
-        table_keys.push_back(keys);
+    auto rows = std::make_shared<Table<std::string>>();
+    for (const auto& row : old.rows()) {
+        if (const std::string* name = other.find(row.first)) {
+            rows->append(row.first, *name);
+        }
     }
+    return rows;
 }
 
-void Storage::fill_result(keys_table_t& keys_ab,
-                          result_table_t& result) const
+} // namespace
+
+template <typename Key>
+DumpUPtr BasicStorage<Key>::dump(uint64_t& lsn) const
 {
-    for (const auto& key : keys_ab) {
-        ResultRecord rr(2);
-        for (size_t i = 0; i < tables_.size(); ++i) {
-            bool found;
-            std::string name;
-            std::tie(name, found) = find_name(tables_[i], key);
-            if (found) {
-                rr.id = key;
-                rr.fields[i] = name;
-            }
+    std::vector<std::string> names;
+    for (table_handle_t table = 0; table < catalog_.size(); ++table) {
+        names.push_back(catalog_.name(table));
+    }
+    lock_t lock(m_);
+    lsn = log_ ? log_->last_lsn() : 0;
+    return std::make_unique<TableDump<Key>>(tables_, names);
+}
+
+template <typename Key>
+SubscriptionPtr BasicStorage<Key>::subscribe(JoinKind kind, size_t max_queued,
+                                             SubscriptionNotify notify)
+{
+    auto subscription = std::make_shared<Subscription>(kind, max_queued, std::move(notify));
+    lock_t lock(m_);
+    // The rows of the join now, the changes follow them in the queue.
+    subscription->push(std::make_unique<JoinRows<Key>>(
+                           kind, std::make_shared<const Table<Key>>(tables_[0]),
+                           std::make_shared<const Table<Key>>(tables_[1])));
+    subscribers_.push_back(subscription);
+    return subscription;
+}
+
+template <typename Key>
+void BasicStorage<Key>::publish_insert(size_t index, const Key& id, const std::string& name)
+{
+    if (subscribers_.empty()) {
+        return;
+    }
+    // The row enters the intersection or leaves the symmetric difference
+    // when the id is in the other table.
+    const std::string* other = tables_[1 - index].find(id);
+    std::string intersection;
+    std::string difference;
+    if (other) {
+        intersection.push_back('+');
+        detail::append_key(intersection, id);
+        intersection.append(",").append(index == 0 ? name : *other);
+        intersection.append(",").append(index == 0 ? *other : name);
+        difference.push_back('-');
+        detail::append_key(difference, id);
+    }
+    else {
+        difference.push_back('+');
+        detail::append_key(difference, id);
+        difference.append(index == 0 ? "," : ",,").append(name);
+        difference.append(index == 0 ? "," : "");
+    }
+
+    auto s = subscribers_.begin();
+    while (s != subscribers_.end()) {
+        SubscriptionPtr subscription = s->lock();
+        if (!subscription) {
+            s = subscribers_.erase(s);
+            continue;
+        }
+        if (subscription->kind() == JoinKind::SymmetricDifference) {
+            subscription->push(difference);
+        }
+        else if (other) {
+            subscription->push(intersection);
+        }
+        ++s;
+    }
+}
+
+template <typename Key>
+void BasicStorage<Key>::publish_truncate(size_t index,
+                                         const std::shared_ptr<const Table<Key>>& old)
+{
+    if (subscribers_.empty()) {
+        return;
+    }
+    // The other table may change before the changes are taken.
+    auto other = delta_rows(*old, tables_[1 - index]);
+    auto s = subscribers_.begin();
+    while (s != subscribers_.end()) {
+        SubscriptionPtr subscription = s->lock();
+        if (!subscription) {
+            s = subscribers_.erase(s);
+            continue;
         }
-        result.insert(rr);
+        subscription->push(std::make_unique<TruncateDelta<Key>>(subscription->kind(),
+                                                                index == 0, old, other));
+        ++s;
+    }
+}
+
+template <typename Key>
+std::vector<Table<Key>> BasicStorage<Key>::snapshot() const
+{
+    lock_t lock(m_);
+    return tables_;
+}
+
+template <typename Key>
+template <typename F>
+auto BasicStorage<Key>::read_tables(F f) const
+{
+    if (Table<Key>::cheap_copy) {
+        const std::vector<Table<Key>> tables = snapshot();
+        return f(tables);
+    }
+    // The maps of the string ids share nothing, copying them would hold
+    // the lock longer than the join does.
+    lock_t lock(m_);
+    return f(tables_);
+}
+
+template <typename Key>
+result_table_t BasicStorage<Key>::intersection(const JoinRange& range) const
+{
+    return read_tables([&range](const std::vector<Table<Key>>& tables) {
+        const auto& ta = tables[0];
+        const auto& tb = tables[1];
+        return join_rows<Key>(range, std::min(ta.size(), tb.size()),
+                              [&](const JoinRange& slice, SliceWriter<Key>& out) {
+            Joins<Key>::intersection(ta, tb, slice, out);
+        }, [&]() {
+            return Joins<Key>::intersection_count(ta, tb, range);
+        });
+    });
+}
+
+template <typename Key>
+result_table_t BasicStorage<Key>::symmetric_difference(const JoinRange& range) const
+{
+    return read_tables([&range](const std::vector<Table<Key>>& tables) {
+        const auto& ta = tables[0];
+        const auto& tb = tables[1];
+        return join_rows<Key>(range, ta.size() + tb.size(),
+                              [&](const JoinRange& slice, SliceWriter<Key>& out) {
+            Joins<Key>::symmetric_difference(ta, tb, slice, out);
+        }, [&]() {
+            return Joins<Key>::symmetric_difference_count(ta, tb, range);
+        });
+    });
+}
+
+template <typename Key>
+size_t BasicStorage<Key>::intersection_count(const JoinRange& range) const
+{
+    return read_tables([&range](const std::vector<Table<Key>>& tables) {
+        return slice(Joins<Key>::intersection_count(tables[0], tables[1], range), range);
+    });
+}
+
+template <typename Key>
+size_t BasicStorage<Key>::symmetric_difference_count(const JoinRange& range) const
+{
+    return read_tables([&range](const std::vector<Table<Key>>& tables) {
+        return slice(Joins<Key>::symmetric_difference_count(tables[0], tables[1], range),
+                     range);
+    });
+}
+
+template <typename Key>
+Estimate BasicStorage<Key>::intersection_estimate() const
+{
+    lock_t lock(m_);
+    const Estimate u = union_estimate();
+    const double sizes = double(tables_[0].size() + tables_[1].size());
+    return Estimate { sizes - u.value, u.error };
+}
+
+template <typename Key>
+Estimate BasicStorage<Key>::symmetric_difference_estimate() const
+{
+    lock_t lock(m_);
+    const Estimate u = union_estimate();
+    const double sizes = double(tables_[0].size() + tables_[1].size());
+    return Estimate { 2 * u.value - sizes, 2 * u.error };
+}
+
+template <typename Key>
+void BasicStorage<Key>::add_table(const char* name)
+{
+    catalog_.add(name);
+    tables_.emplace_back();
+    versions_.push_back(0);
+    sketches_.emplace_back();
+}
+
+template <typename Key>
+Estimate BasicStorage<Key>::union_estimate() const
+{
+    HyperLogLog u = sketches_[0];
+    u.merge(sketches_[1]);
+
+    const double a = double(tables_[0].size());
+    const double b = double(tables_[1].size());
+    const double value = std::min(std::max(u.estimate(), std::max(a, b)), a + b);
+    return Estimate { value, 2 * u.standard_error() * value };
+}
+
+template class BasicStorage<int32_t>;
+template class BasicStorage<int64_t>;
+template class BasicStorage<std::string>;
+
+StorageUPtr make_storage(KeyType key_type, const std::string& data_dir)
+{
+    switch (key_type) {
+        case KeyType::Int64:
+            return StorageUPtr(new BasicStorage<int64_t>(data_dir));
+        case KeyType::String:
+            return StorageUPtr(new BasicStorage<std::string>(data_dir));
+        default:
+            return StorageUPtr(new BasicStorage<int32_t>(data_dir));
     }
 }
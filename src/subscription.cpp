@@ -0,0 +1,67 @@
+#include "subscription.h"
+
+Subscription::Subscription(JoinKind kind, size_t max_queued, Notify notify)
+    : kind_(kind)
+    , max_queued_(max_queued)
+    , notify_(std::move(notify))
+{
+}
+
+void Subscription::push(std::string line)
+{
+    push(Item { std::move(line), nullptr });
+}
+
+void Subscription::push(DumpUPtr lines)
+{
+    push(Item { std::string(), std::move(lines) });
+}
+
+void Subscription::push(Item item)
+{
+    bool notify = false;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        if (overflow_) {
+            return;
+        }
+        if (queue_.size() >= max_queued_) {
+            overflow_ = true;
+            queue_.clear();
+        }
+        else {
+            queue_.push_back(std::move(item));
+        }
+        notify = !notified_ || overflow_;
+        notified_ = true;
+    }
+    if (notify) {
+        notify_();
+    }
+}
+
+bool Subscription::take(std::string& out, size_t max_bytes)
+{
+    std::unique_lock<std::mutex> lock(m_);
+    while (!overflow_ && !queue_.empty() && out.size() < max_bytes) {
+        Item& item = queue_.front();
+        if (!item.lines) {
+            out.append(item.line).push_back('\n');
+            queue_.pop_front();
+            continue;
+        }
+        // The lines are made without the lock, the storage only pushes
+        // to the back and the front item stays put.
+        IDump& lines = *item.lines;
+        lock.unlock();
+        const bool more = lines.next(out, max_bytes);
+        lock.lock();
+        if (!more && !overflow_) {
+            queue_.pop_front();
+        }
+    }
+    if (queue_.empty()) {
+        notified_ = false;
+    }
+    return !overflow_;
+}
@@ -0,0 +1,158 @@
+#include "table.h"
+#include <algorithm>
+
+namespace {
+
+bool key_less(const IdTable::ChunkPtr& chunk, uint16_t key)
+{
+    return chunk->key < key;
+}
+
+IdTable::ChunkPtr new_chunk(uint16_t key)
+{
+    return std::make_shared<IdTable::Chunk>(IdTable::Chunk { key, RoaringContainer(), {}, {} });
+}
+
+} // namespace
+
+bool IdTable::insert(uint32_t u, const std::string& name)
+{
+    const auto key = static_cast<uint16_t>(u >> 16);
+    const auto low = static_cast<uint16_t>(u & 0xffff);
+
+    auto found = chunk(key);
+    if (found == chunks_.end() || (*found)->key != key) {
+        found = chunks_.insert(found, new_chunk(key));
+    }
+    else if ((*found)->ids.contains(low)) {
+        return false;
+    }
+
+    Chunk& c = writable(*found);
+    c.ids.add(low);
+    const size_t rank = c.ids.rank(low);
+    c.slots.insert(c.slots.begin() + static_cast<std::ptrdiff_t>(rank),
+                   static_cast<uint16_t>(c.names.size()));
+    c.names.push_back(name);
+    ++size_;
+    return true;
+}
+
+void IdTable::append(uint32_t u, std::string name)
+{
+    const auto key = static_cast<uint16_t>(u >> 16);
+    if (chunks_.empty() || chunks_.back()->key != key) {
+        chunks_.push_back(new_chunk(key));
+    }
+
+    Chunk& c = writable(chunks_.back());
+    c.ids.add(static_cast<uint16_t>(u & 0xffff));
+    c.slots.push_back(static_cast<uint16_t>(c.names.size()));
+    c.names.push_back(std::move(name));
+    ++size_;
+}
+
+void IdTable::clear()
+{
+    chunks_.clear();
+    size_ = 0;
+}
+
+const std::string* IdTable::find(uint32_t u) const
+{
+    const auto key = static_cast<uint16_t>(u >> 16);
+    const auto low = static_cast<uint16_t>(u & 0xffff);
+
+    auto c = std::lower_bound(chunks_.begin(), chunks_.end(), key, key_less);
+    if (c == chunks_.end() || (*c)->key != key || !(*c)->ids.contains(low)) {
+        return nullptr;
+    }
+    return &(*c)->name_at((*c)->ids.rank(low));
+}
+
+size_t IdTable::id_memory() const
+{
+    size_t n = chunks_.capacity() * sizeof(ChunkPtr);
+    for (const auto& c : chunks_) {
+        n += sizeof(Chunk) + c->ids.memory() + c->slots.capacity() * sizeof(uint16_t);
+    }
+    return n;
+}
+
+void IdTable::run_optimize()
+{
+    for (auto& c : chunks_) {
+        writable(c).ids.run_optimize();
+    }
+}
+
+IdTable::chunks_t::iterator IdTable::chunk(uint16_t key)
+{
+    return std::lower_bound(chunks_.begin(), chunks_.end(), key, key_less);
+}
+
+IdTable::Chunk& IdTable::writable(ChunkPtr& c)
+{
+    if (c.use_count() > 1) {
+        c = std::make_shared<Chunk>(*c);
+    }
+    return *c;
+}
+
+bool Table<int64_t>::insert(int64_t id, const std::string& name)
+{
+    const uint64_t u = encode(id);
+    const auto high = static_cast<uint32_t>(u >> 32);
+    auto part = std::lower_bound(parts_.begin(), parts_.end(), high,
+                                 [](const Part& p, uint32_t h) { return p.high < h; });
+    if (part == parts_.end() || part->high != high) {
+        part = parts_.insert(part, Part { high, IdTable() });
+    }
+    if (!part->ids.insert(static_cast<uint32_t>(u), name)) {
+        return false;
+    }
+    ++size_;
+    return true;
+}
+
+void Table<int64_t>::append(int64_t id, std::string name)
+{
+    const uint64_t u = encode(id);
+    const auto high = static_cast<uint32_t>(u >> 32);
+    if (parts_.empty() || parts_.back().high != high) {
+        parts_.push_back(Part { high, IdTable() });
+    }
+    parts_.back().ids.append(static_cast<uint32_t>(u), std::move(name));
+    ++size_;
+}
+
+void Table<int64_t>::run_optimize()
+{
+    for (auto& part : parts_) {
+        part.ids.run_optimize();
+    }
+}
+
+void Table<int64_t>::clear()
+{
+    parts_.clear();
+    size_ = 0;
+}
+
+const std::string* Table<int64_t>::find(int64_t id) const
+{
+    const uint64_t u = encode(id);
+    const auto high = static_cast<uint32_t>(u >> 32);
+    auto part = std::lower_bound(parts_.begin(), parts_.end(), high,
+                                 [](const Part& p, uint32_t h) { return p.high < h; });
+    if (part == parts_.end() || part->high != high) {
+        return nullptr;
+    }
+    return part->ids.find(static_cast<uint32_t>(u));
+}
+
+const std::string* Table<std::string>::find(const std::string& id) const
+{
+    auto found = rows_.find(id);
+    return found == rows_.end() ? nullptr : &found->second;
+}
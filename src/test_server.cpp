@@ -1,9 +1,32 @@
 #include "storage.h"
 #include "interpreter.h"
 #include "processor.h"
+#include "reclaimer.h"
+#include "replication.h"
+#include "commandparser.h"
 #include "commands.h"
+#include "coordinator.h"
+#include "options.h"
+#include "bufferpool.h"
+#include "handlerallocator.h"
+#include "httpparser.h"
+#include "resultcache.h"
+#include "roaring.h"
+#include "scheduler.h"
+#include "server.h"
+#include "subscription.h"
+#ifdef JOIN_SERVER_HAS_IO_URING
+#include "uringserver.h"
+#endif
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <mutex>
+#include <sstream>
 #include <algorithm>
 #include <iterator>
+#include <set>
 #include <gtest/gtest.h>
 #include <gmock/gmock.h>
 
@@ -136,6 +159,13 @@ TEST(Storage_Test, Init)
     EXPECT_FALSE(s.insert("B", 0, "another"));
 
     EXPECT_FALSE(s.insert("C", 0, "another"));
+
+    EXPECT_EQ(1u, s.find_table("B"));
+    EXPECT_EQ(no_table, s.find_table("C"));
+    EXPECT_TRUE(s.insert(s.find_table("B"), "7", "by_handle"));
+    EXPECT_FALSE(s.insert(s.find_table("B"), "9", "with space"));
+    EXPECT_FALSE(s.insert(no_table, "8", "nowhere"));
+    EXPECT_FALSE(s.truncate("C"));
 }
 
 class MockStorage : public IStorage
@@ -144,11 +174,26 @@ class MockStorage : public IStorage
         MockStorage() {}
 
         MOCK_CONST_METHOD0(n_tables, size_t());
-        MOCK_METHOD3(insert, bool(const std::string&,
-                                  int, const std::string&));
-        MOCK_METHOD1(truncate, bool(const std::string&));
-        MOCK_CONST_METHOD0(intersection, result_table_t());
-        MOCK_CONST_METHOD0(symmetric_difference, result_table_t());
+        MOCK_CONST_METHOD0(versions, versions_t());
+        MOCK_CONST_METHOD1(valid_key, bool(const std::string&));
+        MOCK_CONST_METHOD1(find_table, table_handle_t(const std::string&));
+        MOCK_METHOD3(insert, bool(table_handle_t,
+                                  const std::string&, const std::string&));
+        MOCK_METHOD1(truncate, bool(table_handle_t));
+        MOCK_METHOD1(apply, LoadResult(const WriteSet&));
+        MOCK_METHOD3(load, LoadResult(const std::string&, const std::string&, FileFormat));
+        MOCK_CONST_METHOD3(export_join, size_t(JoinKind, const std::string&, FileFormat));
+        MOCK_CONST_METHOD3(export_table, size_t(const std::string&, const std::string&,
+                                                FileFormat));
+        MOCK_METHOD1(set_log, void(MutationLog*));
+        MOCK_CONST_METHOD1(dump, DumpUPtr(uint64_t&));
+        MOCK_METHOD3(subscribe, SubscriptionPtr(JoinKind, size_t, SubscriptionNotify));
+        MOCK_CONST_METHOD1(intersection, result_table_t(const JoinRange&));
+        MOCK_CONST_METHOD1(symmetric_difference, result_table_t(const JoinRange&));
+        MOCK_CONST_METHOD1(intersection_count, size_t(const JoinRange&));
+        MOCK_CONST_METHOD1(symmetric_difference_count, size_t(const JoinRange&));
+        MOCK_CONST_METHOD0(intersection_estimate, Estimate());
+        MOCK_CONST_METHOD0(symmetric_difference_estimate, Estimate());
 };
 
 TEST(CommandFactory, Factory)
@@ -192,4 +237,1481 @@ TEST(Interpreter, Expressions)
 
     EXPECT_FALSE(name_field_kw->interpret("{088}"));
     EXPECT_TRUE(name_field_kw->interpret("wonder"));
+
+    EXPECT_TRUE(Grammar::name_field()->interpret("x,y"));
+    EXPECT_FALSE(Grammar::name_field()->interpret("x\n2"));
+    EXPECT_FALSE(Grammar::name_field()->interpret("x\t"));
+    EXPECT_FALSE(Grammar::name_field()->interpret("x\x7f"));
+    EXPECT_FALSE(Grammar::name_field()->interpret("x y"));
+}
+
+TEST(Options, Parse)
+{
+    const char* argv[] = { "join_server", "9000", "d",
+                           "--max-connections", "5",
+                           "--idle-timeout", "7" };
+    Options options = parse_options(7, argv);
+
+    EXPECT_EQ(9000, options.port);
+    EXPECT_TRUE(options.log.debug);
+    EXPECT_EQ(5u, options.server.max_connections);
+    EXPECT_EQ(7, options.server.idle_timeout.count());
+
+    EXPECT_TRUE(options.server.no_delay);
+
+    const char* output[] = { "join_server", "9000", "--output-limit", "64",
+                             "--tcp-nodelay", "off", "--tcp-cork", "on" };
+    options = parse_options(8, output);
+    EXPECT_EQ(65536u, options.server.output_high_water);
+    EXPECT_FALSE(options.server.no_delay);
+    EXPECT_TRUE(options.server.cork);
+    const char* bad_switch[] = { "join_server", "9000", "--tcp-cork", "yes" };
+    EXPECT_THROW(parse_options(4, bad_switch), std::invalid_argument);
+
+    const char* bad[] = { "join_server", "9000", "--max-connections", "x" };
+    EXPECT_THROW(parse_options(4, bad), std::invalid_argument);
+
+    const char* uring[] = { "join_server", "9000", "--transport", "uring" };
+    EXPECT_EQ(Transport::Uring, parse_options(4, uring).transport);
+    const char* bad_transport[] = { "join_server", "9000", "--transport", "kqueue" };
+    EXPECT_THROW(parse_options(4, bad_transport), std::invalid_argument);
+
+    const char* replica[] = { "join_server", "9001", "--replica-of", "localhost:9100" };
+    EXPECT_EQ("localhost:9100", parse_options(4, replica).replica_of);
+    const char* bad_primary[] = { "join_server", "9001", "--replica-of", "localhost" };
+    EXPECT_THROW(parse_options(4, bad_primary), std::invalid_argument);
+
+    const char* no_port[] = { "join_server" };
+    EXPECT_THROW(parse_options(1, no_port), std::invalid_argument);
+
+    // Ports above 65535 are refused rather than wrapped.
+    const char* ports[] = { "join_server", "65535", "--http-port", "9080",
+                            "--replication-port", "9100" };
+    EXPECT_EQ(65535, parse_options(6, ports).port);
+    ports[1] = "70000";
+    EXPECT_THROW(parse_options(6, ports), std::invalid_argument);
+    ports[1] = "9000";
+    ports[3] = "70000";
+    EXPECT_THROW(parse_options(6, ports), std::invalid_argument);
+    ports[3] = "9080";
+    ports[5] = "65536";
+    EXPECT_THROW(parse_options(6, ports), std::invalid_argument);
+    replica[3] = "localhost:70000";
+    EXPECT_THROW(parse_options(4, replica), std::invalid_argument);
+
+    const char* weights[] = { "join_server", "9000", "--client-weight", "2",
+                              "--max-client-weight", "4" };
+    EXPECT_EQ(2u, parse_options(6, weights).scheduler.client_weight);
+    EXPECT_EQ(4u, parse_options(6, weights).scheduler.max_weight);
+    weights[3] = "5";
+    EXPECT_THROW(parse_options(6, weights), std::invalid_argument);
+    weights[3] = "0";
+    EXPECT_THROW(parse_options(6, weights), std::invalid_argument);
+}
+
+TEST(HandlerMemory, Recycles_Slot)
+{
+    HandlerMemory memory;
+
+    void* first = memory.allocate(64);
+    void* second = memory.allocate(64);
+    EXPECT_NE(first, second);
+
+    memory.deallocate(second);
+    memory.deallocate(first);
+
+    EXPECT_EQ(first, memory.allocate(64));
+    void* big = memory.allocate(4096);
+    EXPECT_NE(first, big);
+    memory.deallocate(big);
+    memory.deallocate(first);
+}
+
+TEST(BufferPool, Reuses_Buffers)
+{
+    BufferPool pool(8192);
+
+    BufferPool::Buffer small = pool.acquire(10);
+    EXPECT_EQ(1024u, small.size());
+    BufferPool::Buffer line = pool.acquire(5000);
+    EXPECT_EQ(8192u, line.size());
+    EXPECT_EQ(65536u, pool.acquire(1 << 20).size());
+
+    const char* data = small.data();
+    pool.release(small);
+    EXPECT_TRUE(small.empty());
+    EXPECT_EQ(1024u, pool.idle());
+    EXPECT_EQ(data, pool.acquire(1000).data());
+    EXPECT_EQ(0u, pool.idle());
+
+    // Above max_idle the buffers are freed.
+    pool.release(line);
+    BufferPool::Buffer more = pool.acquire(1024);
+    pool.release(more);
+    EXPECT_EQ(8192u, pool.idle());
+}
+
+TEST(CommandParser, Split_Reads)
+{
+    CommandParser parser(64);
+    std::string buffer;
+    size_t begin = 0;
+    std::vector<std::string> lines;
+    // Feeds the bytes one read at a time and collects the lines and errors.
+    auto feed = [&](const std::string& bytes) {
+        buffer.append(bytes);
+        for (;;) {
+            const auto result = parser.parse(&buffer[begin], buffer.size() - begin);
+            if (result == CommandParser::Result::Good) {
+                std::string line;
+                for (size_t i = 0; i < parser.size(); ++i) {
+                    line.append(i ? "|" : "").append(parser.token(i), parser.token_size(i));
+                }
+                lines.push_back(line);
+            }
+            else if (result == CommandParser::Result::Bad) {
+                lines.push_back("ERR " + parser.error());
+            }
+            begin += parser.consumed();
+            if (result == CommandParser::Result::Indeterminate) {
+                break;
+            }
+        }
+    };
+
+    feed("INSERT A 1 x\nINTER");
+    feed("SECTION");
+    feed("\r");
+    feed("\n\n\r\nTRUNCATE");
+    feed(" B\n");
+    EXPECT_EQ((std::vector<std::string> { "INSERT|A|1|x", "INTERSECTION", "TRUNCATE|B" }),
+              lines);
+
+    lines.clear();
+    feed("INSERT A  1 x\nINSERT A\x01 1\nOK\n INSERT\nA \nA\rB\nX");
+    feed(" 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15\nX 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16\nLONG");
+    feed(std::string(70, 'x') + "\nEND\n");
+    EXPECT_EQ((std::vector<std::string> {
+        "ERR empty token at 9", "ERR unexpected byte 0x01 at 8", "OK",
+        "ERR empty token at 0", "ERR empty token at 2", "ERR unexpected byte at 2",
+        "X|1|2|3|4|5|6|7|8|9|10|11|12|13|14|15", "ERR too many tokens at 38",
+        "ERR line longer than 64 bytes", "END" }), lines);
+}
+
+TEST(HttpParser, Requests)
+{
+    HttpParser parser(256);
+    HttpRequest request;
+    const std::string get = "GET /intersection?from=1&order=desc HTTP/1.1\r\n"
+                            "Accept: application/x-ndjson\r\n\r\n";
+    // Split in two reads, the parser keeps the state between them.
+    EXPECT_EQ(HttpParser::Result::Indeterminate, parser.parse(request, get.data(), 20));
+    EXPECT_EQ(20u, parser.consumed());
+    EXPECT_EQ(HttpParser::Result::Good, parser.parse(request, get.data() + 20, get.size() - 20));
+    EXPECT_EQ("GET", request.method);
+    EXPECT_EQ("/intersection", request.path);
+    EXPECT_EQ("1", request.params["from"]);
+    EXPECT_EQ("desc", request.params["order"]);
+    EXPECT_TRUE(request.ndjson);
+    EXPECT_TRUE(request.keep_alive);
+
+    const std::string post = "POST /insert HTTP/1.0\r\n"
+                             "Content-Type: application/x-www-form-urlencoded\r\n"
+                             "Content-Length: 23\r\n\r\n"
+                             "table=A&id=7&name=a%2Cb+GET";
+    EXPECT_EQ(HttpParser::Result::Good, parser.parse(request, post.data(), post.size()));
+    EXPECT_EQ(post.size() - 4, parser.consumed());
+    EXPECT_EQ("POST", request.method);
+    EXPECT_EQ("a,b", request.params["name"]);
+    EXPECT_EQ("7", request.params["id"]);
+    EXPECT_FALSE(request.keep_alive);
+    EXPECT_FALSE(request.ndjson);
+
+    const std::vector<std::string> bad_requests {
+        "get / HTTP/1.1\r\n\r\n", "GET / HTTP/2\r\n\r\n", "GET /?a=%zz HTTP/1.1\r\n\r\n",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n",
+        "GET /" + std::string(300, 'x') + " HTTP/1.1\r\n\r\n"
+    };
+    for (const auto& bad : bad_requests) {
+        EXPECT_EQ(HttpParser::Result::Bad, parser.parse(request, bad.data(), bad.size())) << bad;
+    }
+    EXPECT_EQ("request too large", parser.error());
+}
+
+TEST(ResultTable, Json)
+{
+    ResultTable<int32_t> ints;
+    ints.rows().emplace_back(2);
+    ints.rows().back().id = -1;
+    ints.rows().back().fields = { "a\"b", "" };
+    ints.rows().emplace_back(2);
+    ints.rows().back().id = 2;
+    ints.rows().back().fields = { "", "\n" };
+    std::string out;
+    ints.print_json(out, 0, 2, false);
+    EXPECT_EQ("{\"id\":-1,\"a\":\"a\\\"b\",\"b\":null},{\"id\":2,\"a\":null,\"b\":\"\\u000a\"}",
+              out);
+
+    ResultTable<std::string> strings;
+    strings.rows().emplace_back(2);
+    strings.rows().back().id = "k";
+    strings.rows().back().fields = { "x", "y" };
+    out.clear();
+    strings.print_json(out, 0, 1, true);
+    EXPECT_EQ("{\"id\":\"k\",\"a\":\"x\",\"b\":\"y\"}\n", out);
+}
+
+TEST(Processor, Protocol)
+{
+    Storage storage;
+    Processor processor(ProcessorContext { storage, nullptr, nullptr });
+    std::string reply;
+    auto execute = [&processor, &reply](const std::string& command) {
+        processor.execute(command, [&reply](std::string r) { reply = r; });
+        return reply;
+    };
+
+    for (auto command : { "INSERT A 0 lean", "INSERT A 1 sweater",
+                          "INSERT A 3 violation", "INSERT B 3 proposal",
+                          "INSERT B 6 flour" }) {
+        EXPECT_EQ("OK", execute(command));
+    }
+    EXPECT_EQ("ERR duplicate 0", execute("INSERT A 0 understand"));
+    EXPECT_EQ("ERR wrong arguments", execute("INSERT C 0 lean"));
+    EXPECT_EQ("ERR wrong arguments", execute("INSERT A  0 lean"));
+    EXPECT_EQ("ERR unknown command", execute("SELECT"));
+    // HTTP passes the decoded values, they follow the rules of the tokens.
+    processor.execute("INSERT", { "A", "7", "x\n2" }, [&reply](std::string r) { reply = r; });
+    EXPECT_EQ("ERR wrong arguments", reply);
+
+    EXPECT_EQ("3,violation,proposal\nOK", execute("INTERSECTION"));
+    EXPECT_EQ("0,lean,\n1,sweater,\n6,,flour\nOK",
+              execute("SYMMETRIC_DIFFERENCE"));
+
+    EXPECT_EQ("1,sweater,\n6,,flour\nOK",
+              execute("SYMMETRIC_DIFFERENCE FROM 1 TO 7"));
+    EXPECT_EQ("6,,flour\nOK", execute("SYMMETRIC_DIFFERENCE LIMIT 1 OFFSET 2"));
+    EXPECT_EQ("OK", execute("INTERSECTION TO 3"));
+    EXPECT_EQ("6,,flour\n1,sweater,\nOK",
+              execute("SYMMETRIC_DIFFERENCE ORDER DESC LIMIT 2"));
+    EXPECT_EQ("1,sweater,\nOK",
+              execute("SYMMETRIC_DIFFERENCE FROM 1 ORDER DESC OFFSET 1"));
+    EXPECT_EQ("3,violation,proposal\nOK", execute("INTERSECTION UNORDERED"));
+    EXPECT_EQ("ERR wrong arguments", execute("INTERSECTION ORDER ASC UNORDERED"));
+    EXPECT_EQ("1\nOK", execute("INTERSECTION COUNT"));
+    EXPECT_EQ("3\nOK", execute("SYMMETRIC_DIFFERENCE COUNT"));
+    EXPECT_EQ("1\nOK", execute("SYMMETRIC_DIFFERENCE FROM 1 OFFSET 1 COUNT"));
+    EXPECT_EQ("1,0\nOK", execute("INTERSECTION ESTIMATE"));
+    EXPECT_EQ("ERR wrong arguments", execute("INTERSECTION FROM 1 ESTIMATE"));
+    EXPECT_EQ("ERR wrong arguments", execute("INTERSECTION LIMIT 1 FROM 0"));
+    EXPECT_EQ("ERR wrong arguments", execute("INTERSECTION FROM"));
+
+    EXPECT_EQ("ERR files need --data-dir", execute("LOAD A rows.csv"));
+    EXPECT_EQ("ERR wrong arguments", execute("LOAD A rows.csv FORMAT xml"));
+
+    EXPECT_EQ("OK", execute("TRUNCATE A"));
+    EXPECT_EQ("OK", execute("INTERSECTION"));
+}
+
+TEST(Processor, Prepared)
+{
+    Storage storage;
+    Processor processor(ProcessorContext { storage, nullptr, nullptr });
+    std::string reply;
+    auto execute = [&processor, &reply](const std::string& command) {
+        processor.execute(command, [&reply](std::string r) { reply = r; });
+        return reply;
+    };
+
+    EXPECT_EQ("OK", execute("PREPARE a INSERT A ? ?"));
+    EXPECT_EQ("OK", execute("PREPARE b INSERT B ? fixed"));
+    EXPECT_EQ("OK", execute("EXEC a 1 one"));
+    EXPECT_EQ("OK", execute("EXEC a 2 two"));
+    EXPECT_EQ("ERR duplicate 1", execute("EXEC a 1 again"));
+    EXPECT_EQ("ERR wrong arguments", execute("EXEC a x bad"));
+    EXPECT_EQ("ERR wrong arguments", execute("EXEC a 3"));
+    processor.execute("EXEC", { "a", "3", "x\t" }, [&reply](std::string r) { reply = r; });
+    EXPECT_EQ("ERR wrong arguments", reply);
+    EXPECT_EQ("OK", execute("EXEC a 3 three"));
+    EXPECT_EQ("OK", execute("EXEC b 2"));
+    EXPECT_EQ("ERR unknown prepared command", execute("EXEC c 2"));
+
+    // Any command may be prepared, the parameters are parsed by EXEC.
+    EXPECT_EQ("OK", execute("PREPARE page INTERSECTION FROM ? LIMIT ?"));
+    EXPECT_EQ("2,two,fixed\nOK", execute("EXEC page 0 1"));
+    EXPECT_EQ("OK", execute("EXEC page 3 1"));
+    EXPECT_EQ("ERR wrong arguments", execute("EXEC page x 1"));
+    EXPECT_EQ("OK", execute("PREPARE any INTERSECTION ? ? ?"));
+    EXPECT_EQ("OK", execute("EXEC any FROM 3 UNORDERED"));
+    EXPECT_EQ("2,two,fixed\nOK", execute("EXEC any LIMIT 1 UNORDERED"));
+    EXPECT_EQ("OK", execute("PREPARE slice INTERSECTION ? ?"));
+    EXPECT_EQ("OK", execute("EXEC slice LIMIT 0"));
+    EXPECT_EQ("2,two,fixed\nOK", execute("EXEC slice OFFSET 0"));
+    EXPECT_EQ("ERR wrong arguments", execute("PREPARE d INSERT C ? ?"));
+    EXPECT_EQ("ERR wrong arguments", execute("PREPARE d SELECT ?"));
+    EXPECT_EQ("ERR wrong arguments", execute("PREPARE d"));
+
+    // The names belong to the connection.
+    Processor other(ProcessorContext { storage, nullptr, nullptr });
+    other.execute("EXEC a 4 four", [&reply](std::string r) { reply = r; });
+    EXPECT_EQ("ERR unknown prepared command", reply);
+}
+
+TEST(Processor, Transactions)
+{
+    Storage storage;
+    Processor processor(ProcessorContext { storage, nullptr, nullptr });
+    Processor reader(ProcessorContext { storage, nullptr, nullptr });
+    std::string reply;
+    auto execute = [&reply](Processor& p, const std::string& command) {
+        p.execute(command, [&reply](std::string r) { reply = r; });
+        return reply;
+    };
+
+    EXPECT_EQ("OK", execute(processor, "INSERT A 1 one"));
+    EXPECT_EQ("OK", execute(processor, "BEGIN"));
+    EXPECT_EQ("ERR transaction already open", execute(processor, "BEGIN"));
+    EXPECT_EQ("OK", execute(processor, "INSERT B 1 b1"));
+    EXPECT_EQ("OK", execute(processor, "INSERT A 2 two"));
+    EXPECT_EQ("OK", execute(processor, "INSERT A 1 again"));
+    EXPECT_EQ("OK", execute(processor, "PREPARE b INSERT B ? ?"));
+    EXPECT_EQ("OK", execute(processor, "EXEC b 2 b2"));
+    EXPECT_EQ("ERR wrong arguments", execute(processor, "INSERT C 3 c"));
+    EXPECT_EQ("ERR not allowed in a transaction", execute(processor, "LOAD A rows.csv"));
+
+    // The other connections and the transaction itself see the old tables.
+    EXPECT_EQ("OK", execute(reader, "INTERSECTION"));
+    EXPECT_EQ("OK", execute(processor, "INTERSECTION"));
+    const versions_t before = storage.versions();
+    EXPECT_EQ("3,1\nOK", execute(processor, "COMMIT"));
+    EXPECT_EQ("1,one,b1\n2,two,b2\nOK", execute(reader, "INTERSECTION"));
+    EXPECT_EQ(before[0] + 1, storage.versions()[0]);
+    EXPECT_EQ(before[1] + 1, storage.versions()[1]);
+    EXPECT_EQ("ERR no transaction", execute(processor, "COMMIT"));
+
+    // The writes apply in order, a TRUNCATE drops the rows before it.
+    EXPECT_EQ("OK", execute(processor, "BEGIN"));
+    EXPECT_EQ("OK", execute(processor, "INSERT A 3 three"));
+    EXPECT_EQ("OK", execute(processor, "TRUNCATE A"));
+    EXPECT_EQ("OK", execute(processor, "INSERT A 2 new"));
+    EXPECT_EQ("2,0\nOK", execute(processor, "COMMIT"));
+    EXPECT_EQ("2,new,b2\nOK", execute(reader, "INTERSECTION"));
+
+    EXPECT_EQ("OK", execute(processor, "BEGIN"));
+    EXPECT_EQ("OK", execute(processor, "TRUNCATE B"));
+    EXPECT_EQ("OK", execute(processor, "ROLLBACK"));
+    EXPECT_EQ("ERR no transaction", execute(processor, "ROLLBACK"));
+    EXPECT_EQ("2,new,b2\nOK", execute(reader, "INTERSECTION"));
+}
+
+TEST(Scheduler, Fair_Order_And_Quota)
+{
+    SchedulerConfig config;
+    config.max_running = 1;
+    config.max_queued = 8;
+    config.max_per_client = 3;
+    Scheduler scheduler(config);
+
+    // Hold the only worker until every job is queued.
+    std::mutex m;
+    std::condition_variable cv;
+    bool open = false;
+    std::promise<void> started;
+    auto gate = scheduler.add_client();
+    ASSERT_TRUE(scheduler.submit(gate, [&]() {
+        started.set_value();
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&open]() { return open; });
+    }));
+    started.get_future().wait();
+
+    std::vector<std::string> order;
+    std::promise<void> finished;
+    auto job = [&order](const std::string& name) {
+        return [&order, name]() { order.push_back(name); };
+    };
+
+    auto a = scheduler.add_client();
+    auto b = scheduler.add_client();
+    EXPECT_TRUE(scheduler.submit(a, job("a1")));
+    EXPECT_TRUE(scheduler.submit(a, job("a2")));
+    EXPECT_TRUE(scheduler.submit(a, [&finished]() { finished.set_value(); }));
+    EXPECT_FALSE(scheduler.submit(a, job("a4")));
+    EXPECT_TRUE(scheduler.submit(b, job("b1")));
+    EXPECT_EQ(4u, scheduler.queued());
+
+    {
+        std::lock_guard<std::mutex> lock(m);
+        open = true;
+    }
+    cv.notify_all();
+    finished.get_future().wait();
+
+    // b is not stuck behind the jobs of a.
+    std::vector<std::string> expected { "a1", "b1", "a2" };
+    EXPECT_EQ(expected, order);
+}
+
+TEST(Scheduler, Weights)
+{
+    SchedulerConfig config;
+    config.max_running = 1;
+    config.max_weight = 4;
+    Scheduler scheduler(config);
+
+    std::mutex m;
+    std::condition_variable cv;
+    bool open = false;
+    std::promise<void> started;
+    ASSERT_TRUE(scheduler.submit(scheduler.add_client(), [&]() {
+        started.set_value();
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&open]() { return open; });
+    }));
+    started.get_future().wait();
+
+    std::vector<std::string> order;
+    std::promise<void> finished;
+    auto job = [&order](const std::string& name) {
+        return [&order, name]() { order.push_back(name); };
+    };
+
+    // a of weight 2 gets two turns for every turn of b.
+    auto a = scheduler.add_client();
+    auto b = scheduler.add_client(1);
+    EXPECT_TRUE(scheduler.set_weight(a, 2));
+    EXPECT_FALSE(scheduler.set_weight(b, 0));
+    EXPECT_FALSE(scheduler.set_weight(b, 5));
+    for (const char* name : { "a1", "a2", "a3" }) {
+        EXPECT_TRUE(scheduler.submit(a, job(name)));
+    }
+    EXPECT_TRUE(scheduler.submit(b, job("b1")));
+    EXPECT_TRUE(scheduler.submit(b, job("b2")));
+    EXPECT_TRUE(scheduler.submit(b, [&finished]() { finished.set_value(); }));
+
+    {
+        std::lock_guard<std::mutex> lock(m);
+        open = true;
+    }
+    cv.notify_all();
+    finished.get_future().wait();
+    std::vector<std::string> expected { "a1", "b1", "a2", "a3", "b2" };
+    EXPECT_EQ(expected, order);
+
+    // A connection asks for its own weight.
+    Storage storage;
+    Processor processor(ProcessorContext { storage, &scheduler, nullptr });
+    std::string reply;
+    auto execute = [&processor, &reply](const std::string& command) {
+        processor.execute(command, [&reply](std::string r) { reply = r; });
+        return reply;
+    };
+    EXPECT_EQ("OK", execute("WEIGHT 4"));
+    EXPECT_EQ("ERR wrong arguments", execute("WEIGHT 5"));
+    EXPECT_EQ("ERR wrong arguments", execute("WEIGHT 0"));
+    EXPECT_EQ("ERR wrong arguments", execute("WEIGHT"));
+    Processor inline_only(ProcessorContext { storage, nullptr, nullptr });
+    inline_only.execute("WEIGHT 2", [&reply](std::string r) { reply = r; });
+    EXPECT_EQ("ERR WEIGHT needs the scheduler", reply);
+}
+
+TEST(ResultCache, Versions_And_Eviction)
+{
+    ResultCache cache(10);
+    const versions_t v1 { 1, 1 };
+    const versions_t v2 { 2, 1 };
+
+    EXPECT_FALSE(cache.find("INTERSECTION", v1));
+    cache.insert("INTERSECTION", v1, "1,a,b");
+    ASSERT_TRUE(cache.find("INTERSECTION", v1));
+    EXPECT_EQ("1,a,b", *cache.find("INTERSECTION", v1));
+    EXPECT_FALSE(cache.find("INTERSECTION", v2));
+
+    // The newer reply replaces the older one.
+    cache.insert("INTERSECTION", v2, "2,a,b");
+    EXPECT_EQ(5u, cache.size());
+    cache.insert("INTERSECTION", v1, "1,a,b");
+    EXPECT_EQ("2,a,b", *cache.find("INTERSECTION", v2));
+
+    // The least recently used reply goes first.
+    cache.insert("SYMMETRIC_DIFFERENCE", v2, "3,a,");
+    cache.find("INTERSECTION", v2);
+    cache.insert("OTHER", v2, "4,a,");
+    EXPECT_TRUE(cache.find("INTERSECTION", v2));
+    EXPECT_FALSE(cache.find("SYMMETRIC_DIFFERENCE", v2));
+
+    cache.insert("BIG", v2, "too long to be cached");
+    EXPECT_FALSE(cache.find("BIG", v2));
+
+    EXPECT_EQ(5u, cache.hits());
+    EXPECT_EQ(4u, cache.misses());
+}
+
+/// Rows of a join of tables keyed by Key.
+template <typename Key = int32_t>
+const typename ResultTable<Key>::rows_t& rows(const result_table_t& result)
+{
+    return dynamic_cast<const ResultTable<Key>&>(*result).rows();
+}
+
+TEST(Storage_Test, Join_Range)
+{
+    Storage s;
+    std::set<int> a;
+    std::set<int> b;
+    for (int i = 0; i < 2000; ++i) {
+        const int id_a = (i * 7919) % 5000 - 2500;
+        const int id_b = (i * 104729) % 3000;
+        s.insert("A", id_a, "a");
+        s.insert("B", id_b, "b");
+        a.insert(id_a);
+        b.insert(id_b);
+    }
+
+    JoinRange range;
+    range.from = -100;
+    range.to = 1000;
+    range.has_to = true;
+    range.offset = 10;
+    range.limit = 50;
+
+    std::vector<int> expected;
+    std::set_intersection(a.lower_bound(-100), a.lower_bound(1000),
+                          b.lower_bound(-100), b.lower_bound(1000),
+                          std::back_inserter(expected));
+    expected.erase(expected.begin(), expected.begin() + 10);
+    expected.resize(50);
+
+    std::vector<int> ids;
+    const result_table_t intersection = s.intersection(range);
+    for (const auto& r : rows(intersection)) {
+        ids.push_back(r.id);
+    }
+    EXPECT_EQ(expected, ids);
+
+    expected.clear();
+    std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(),
+                                  std::back_inserter(expected));
+    ids.clear();
+    const result_table_t difference = s.symmetric_difference(JoinRange());
+    for (const auto& r : rows(difference)) {
+        ids.push_back(r.id);
+    }
+    EXPECT_EQ(expected, ids);
+    EXPECT_EQ(expected.size(), s.symmetric_difference_count(JoinRange()));
+    range.offset = 0;
+    range.limit = 5;
+    EXPECT_EQ(5u, s.symmetric_difference_count(range));
+
+    range.from = -100;
+    range.to = 1000;
+    range.limit = std::numeric_limits<size_t>::max();
+    std::set<int> a_slice(a.lower_bound(-100), a.lower_bound(1000));
+    std::vector<int> common;
+    std::set_intersection(a_slice.begin(), a_slice.end(), b.begin(), b.end(),
+                          std::back_inserter(common));
+    EXPECT_EQ(common.size(), s.intersection_count(range));
+}
+
+TEST(Storage_Test, Estimates)
+{
+    Storage s;
+    // Tables of 200000 and 120000 ids sharing 40000 of them.
+    for (int i = 0; i < 200000; ++i) {
+        s.insert("A", i * 3, "a");
+    }
+    for (int i = 0; i < 120000; ++i) {
+        s.insert("B", i < 40000 ? i * 15 : 1000000 + i, "b");
+    }
+
+    const double intersection = 40000;
+    const double symmetric_difference = 200000 + 120000 - 2 * intersection;
+
+    Estimate e = s.intersection_estimate();
+    EXPECT_NEAR(intersection, e.value, e.error);
+    EXPECT_LT(e.error, 0.05 * symmetric_difference);
+
+    e = s.symmetric_difference_estimate();
+    EXPECT_NEAR(symmetric_difference, e.value, e.error);
+
+    s.truncate("B");
+    e = s.intersection_estimate();
+    EXPECT_EQ(0, e.value);
+    EXPECT_EQ(200000u, s.symmetric_difference_count(JoinRange()));
+}
+
+TEST(Roaring, Containers)
+{
+    RoaringContainer c;
+    for (uint16_t v = 0; v < 4096; ++v) {
+        EXPECT_TRUE(c.add(static_cast<uint16_t>(v * 16)));
+    }
+    EXPECT_EQ(RoaringContainer::Type::Array, c.type());
+    EXPECT_FALSE(c.add(16));
+    EXPECT_TRUE(c.add(1));
+    EXPECT_EQ(RoaringContainer::Type::Bitmap, c.type());
+    EXPECT_EQ(4097u, c.cardinality());
+    EXPECT_EQ(2u, c.rank(16));
+    EXPECT_TRUE(c.contains(1));
+
+    RoaringContainer full;
+    for (uint32_t v = 0; v < 65536; ++v) {
+        full.add(static_cast<uint16_t>(v));
+    }
+    EXPECT_EQ(RoaringContainer::Type::Run, full.type());
+    EXPECT_LT(full.memory(), 16u);
+    EXPECT_TRUE(full.contains(65535));
+    EXPECT_EQ(1000u, full.rank(1000));
+
+    EXPECT_EQ(4097u, RoaringContainer::intersect_cardinality(c, full));
+    EXPECT_EQ(65536u - 4097u,
+              RoaringContainer::symmetric_difference(c, full).cardinality());
+    // An insert into a few runs keeps them runs: next to a run, between
+    // two runs and on its own.
+    RoaringContainer runs;
+    for (uint32_t v = 0; v < 1000; ++v) {
+        runs.add(static_cast<uint16_t>(v));
+        runs.add(static_cast<uint16_t>(v + 2000));
+    }
+    runs.run_optimize();
+    EXPECT_EQ(RoaringContainer::Type::Run, runs.type());
+    EXPECT_TRUE(runs.add(1000));
+    EXPECT_FALSE(runs.add(500));
+    EXPECT_TRUE(runs.add(5000));
+    for (uint32_t v = 1001; v < 2000; ++v) {
+        runs.add(static_cast<uint16_t>(v));
+    }
+    EXPECT_EQ(RoaringContainer::Type::Run, runs.type());
+    EXPECT_LT(runs.memory(), 64u);
+    EXPECT_EQ(3001u, runs.cardinality());
+    EXPECT_EQ(3000u, runs.rank(5000));
+    EXPECT_TRUE(runs.contains(1999));
+    EXPECT_FALSE(runs.contains(3000));
+
+    // Single values take less as an array.
+    RoaringContainer sparse;
+    for (uint16_t v : { 0, 1, 2 }) {
+        sparse.add(v);
+    }
+    sparse.run_optimize();
+    EXPECT_EQ(RoaringContainer::Type::Run, sparse.type());
+    sparse.add(10);
+    EXPECT_EQ(RoaringContainer::Type::Run, sparse.type());
+    sparse.add(20);
+    EXPECT_EQ(RoaringContainer::Type::Array, sparse.type());
+    EXPECT_EQ(5u, sparse.cardinality());
+    EXPECT_TRUE(sparse.contains(1));
+}
+
+TEST(Storage_Test, Join_Chunks)
+{
+    // Sparse ids, a dense block stored as bitmaps and a full chunk
+    // stored as a run, on both sides of zero.
+    std::map<int, std::string> a;
+    std::map<int, std::string> b;
+    for (int i = 0; i < 20000; ++i) {
+        a.emplace((i * 7919) % 1000000 - 500000, "a" + std::to_string(i));
+        b.emplace(i * 37 - 300000, "b" + std::to_string(i));
+    }
+    for (int i = 0; i < 140000; ++i) {
+        a.emplace(i, "a");
+        b.emplace(i * 2 + 70000, "b");
+    }
+
+    Storage s;
+    for (const auto& r : a) {
+        s.insert("A", r.first, r.second);
+    }
+    for (const auto& r : b) {
+        s.insert("B", r.first, r.second);
+    }
+
+    JoinRange range;
+    range.from = -200000;
+    range.to = 120000;
+    range.has_to = true;
+
+    std::vector<std::string> expected;
+    size_t n_intersection = 0;
+    size_t n_difference = 0;
+    auto ia = a.lower_bound(-200000);
+    auto ib = b.lower_bound(-200000);
+    auto end_a = a.lower_bound(120000);
+    auto end_b = b.lower_bound(120000);
+    while (ia != end_a || ib != end_b) {
+        if (ib == end_b || (ia != end_a && ia->first < ib->first)) {
+            ++ia;
+            ++n_difference;
+        }
+        else if (ia == end_a || ib->first < ia->first) {
+            ++ib;
+            ++n_difference;
+        }
+        else {
+            expected.push_back(std::to_string(ia->first) + ia->second + ib->second);
+            ++ia;
+            ++ib;
+            ++n_intersection;
+        }
+    }
+
+    std::vector<std::string> joined;
+    const result_table_t intersection = s.intersection(range);
+    for (const auto& r : rows(intersection)) {
+        joined.push_back(std::to_string(r.id) + r.fields[0] + r.fields[1]);
+    }
+    EXPECT_EQ(expected, joined);
+    EXPECT_EQ(n_intersection, s.intersection_count(range));
+    EXPECT_EQ(n_difference, s.symmetric_difference(range)->size());
+    EXPECT_EQ(n_difference, s.symmetric_difference_count(range));
+}
+
+TEST(Storage_Test, Key_Types)
+{
+    Storage narrow;
+    EXPECT_TRUE(narrow.valid_key("-2147483648"));
+    EXPECT_FALSE(narrow.valid_key("2147483648"));
+    EXPECT_FALSE(narrow.valid_key("+1"));
+    EXPECT_FALSE(narrow.valid_key("1a"));
+    narrow.insert("A", std::numeric_limits<int32_t>::max(), "a");
+    narrow.insert("B", std::numeric_limits<int32_t>::max(), "b");
+    EXPECT_EQ(1u, narrow.intersection_count(JoinRange()));
+
+    // Ids on both sides of zero and of the 32-bit halves.
+    BasicStorage<int64_t> wide;
+    EXPECT_TRUE(wide.valid_key("-9223372036854775808"));
+    EXPECT_FALSE(wide.valid_key("9223372036854775808"));
+    const int64_t big = int64_t(1) << 40;
+    std::set<int64_t> a;
+    std::set<int64_t> b;
+    for (int64_t i = 0; i < 3000; ++i) {
+        a.insert(i * 5 - big);
+        a.insert(big + i * 3);
+        b.insert(i * 7 - big);
+        b.insert(big + i * 2);
+    }
+    a.insert(-1);
+    b.insert(-1);
+    for (auto id : a) {
+        EXPECT_TRUE(wide.insert("A", std::to_string(id), "a"));
+    }
+    for (auto id : b) {
+        EXPECT_TRUE(wide.insert("B", id, "b"));
+    }
+    EXPECT_FALSE(wide.insert("A", std::to_string(big), "again"));
+
+    std::vector<int64_t> expected;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(),
+                          std::back_inserter(expected));
+    std::vector<int64_t> ids;
+    const result_table_t intersection = wide.intersection(JoinRange());
+    for (const auto& r : rows<int64_t>(intersection)) {
+        ids.push_back(r.id);
+    }
+    EXPECT_EQ(expected, ids);
+
+    JoinRange range;
+    range.from = -1;
+    range.to = big + 3000;
+    range.has_to = true;
+    expected.clear();
+    std::set_symmetric_difference(a.lower_bound(range.from), a.lower_bound(range.to),
+                                  b.lower_bound(range.from), b.lower_bound(range.to),
+                                  std::back_inserter(expected));
+    ids.clear();
+    const result_table_t difference = wide.symmetric_difference(range);
+    for (const auto& r : rows<int64_t>(difference)) {
+        ids.push_back(r.id);
+    }
+    EXPECT_EQ(expected, ids);
+    EXPECT_EQ(expected.size(), wide.symmetric_difference_count(range));
+
+    BasicStorage<std::string> named;
+    EXPECT_FALSE(named.valid_key(""));
+    named.insert("A", "apple", "1");
+    named.insert("A", "pear", "2");
+    named.insert("B", "pear", "3");
+    named.insert("B", "plum", "4");
+    std::string out;
+    named.symmetric_difference(JoinRange())->print(out);
+    EXPECT_EQ("apple,1,\nplum,,4\n", out);
+    EXPECT_EQ(1u, named.intersection_count(JoinRange()));
+    EXPECT_THROW(named.intersection(range), std::invalid_argument);
+
+    // String ids are walked backwards for a descending slice.
+    named.insert("A", "fig", "5");
+    named.insert("B", "fig", "6");
+    named.insert("A", "kiwi", "7");
+    JoinRange desc;
+    desc.order = JoinOrder::Desc;
+    desc.offset = 1;
+    desc.limit = 2;
+    out.clear();
+    named.symmetric_difference(desc)->print(out);
+    EXPECT_EQ("kiwi,7,\napple,1,\n", out);
+    out.clear();
+    named.intersection(desc)->print(out);
+    EXPECT_EQ("fig,5,6\n", out);
+}
+
+TEST(Storage_Test, Join_Order)
+{
+    // Ids spread over enough chunks for the unordered joins to run in
+    // several partitions.
+    Storage s;
+    std::set<int> a;
+    std::set<int> b;
+    for (int i = 0; i < 200000; ++i) {
+        const int id_a = static_cast<int>(int64_t(i) * 7919 % 40000000) - 20000000;
+        const int id_b = static_cast<int>(int64_t(i) * 104729 % 40000000) - 20000000;
+        s.insert("A", id_a, "a");
+        s.insert("B", id_b, "b");
+        a.insert(id_a);
+        b.insert(id_b);
+    }
+    std::vector<int> expected;
+    std::set_symmetric_difference(a.begin(), a.end(), b.begin(), b.end(),
+                                  std::back_inserter(expected));
+
+    JoinRange range;
+    range.order = JoinOrder::Any;
+    std::vector<int> ids;
+    const result_table_t unordered = s.symmetric_difference(range);
+    for (const auto& r : rows(unordered)) {
+        ids.push_back(r.id);
+    }
+    std::sort(ids.begin(), ids.end());
+    EXPECT_EQ(expected, ids);
+
+    range.order = JoinOrder::Desc;
+    range.offset = 5;
+    range.limit = 100;
+    ids.clear();
+    const result_table_t descending = s.symmetric_difference(range);
+    for (const auto& r : rows(descending)) {
+        ids.push_back(r.id);
+    }
+    EXPECT_EQ(std::vector<int>(expected.rbegin() + 5, expected.rbegin() + 105), ids);
+}
+
+TEST(Reclaimer, Frees_Off_Thread)
+{
+    auto tracked = [](std::promise<std::thread::id>& freed) {
+        return std::shared_ptr<int>(new int(0), [&freed](int* p) {
+            freed.set_value(std::this_thread::get_id());
+            delete p;
+        });
+    };
+
+    std::promise<std::thread::id> freed;
+    auto kept = tracked(freed);
+    {
+        Reclaimer reclaimer;
+        reclaimer.retire(kept);
+        reclaimer.retire(std::make_shared<int>(1));
+    }
+    // Still referenced here, the reclaimer only dropped its copy.
+    EXPECT_EQ(1, kept.use_count());
+    kept.reset();
+    EXPECT_EQ(std::this_thread::get_id(), freed.get_future().get());
+
+    std::promise<std::thread::id> retired;
+    Reclaimer reclaimer;
+    reclaimer.retire(tracked(retired));
+    EXPECT_NE(std::this_thread::get_id(), retired.get_future().get());
+
+    Storage s;
+    for (int i = 0; i < 1000; ++i) {
+        s.insert("A", i, "a");
+        s.insert("B", i * 2, "b");
+    }
+    EXPECT_TRUE(s.truncate("A"));
+    EXPECT_EQ(0u, s.intersection_count(JoinRange()));
+    EXPECT_TRUE(s.insert("A", 2, "again"));
+    EXPECT_EQ(1u, s.intersection_count(JoinRange()));
+}
+
+TEST(Storage_Test, Load)
+{
+    const std::string dir = testing::TempDir();
+    std::ofstream(dir + "/join_server_a.csv")
+            << "5,five\n-3,minus_three\r\n\n70000,big\n5,again\n";
+    std::ofstream(dir + "/join_server_bad.csv") << "1,one\nx,two\n";
+    // The names follow the rules of INSERT.
+    std::ofstream(dir + "/join_server_space.csv") << "1,one two\n";
+    std::ofstream(dir + "/join_server_tab.csv") << "1,one\t\n";
+
+    // Ids 5 and 70000 as a binary table.
+    std::string bin(sizeof(BinHeader), '\0');
+    BinHeader header;
+    std::memcpy(header.magic, bin_magic, sizeof(bin_magic));
+    header.key_type = static_cast<uint8_t>(KeyType::Int32);
+    header.columns = 1;
+    header.reserved = 0;
+    header.rows = 2;
+    std::memcpy(&bin[0], &header, sizeof(header));
+    for (int32_t id : { 70000, 5 }) {
+        bin.append(reinterpret_cast<const char*>(&id), sizeof(id));
+    }
+    for (uint64_t offset : { 0, 1, 3 }) {
+        bin.append(reinterpret_cast<const char*>(&offset), sizeof(offset));
+    }
+    bin.append("xyz");
+    std::ofstream(dir + "/join_server_b.bin", std::ios::binary) << bin;
+    // The same with an empty first name.
+    std::string empty = bin;
+    std::memset(&empty[sizeof(header) + 2 * sizeof(int32_t) + sizeof(uint64_t)], 0,
+                sizeof(uint64_t));
+    std::ofstream(dir + "/join_server_empty.bin", std::ios::binary) << empty;
+
+    Storage s(dir);
+    LoadResult loaded = s.load("A", "join_server_a.csv", FileFormat::Csv);
+    EXPECT_EQ(3u, loaded.loaded);
+    EXPECT_EQ(1u, loaded.duplicates);
+    loaded = s.load("A", "join_server_a.csv", FileFormat::Csv);
+    EXPECT_EQ(0u, loaded.loaded);
+    EXPECT_EQ(4u, loaded.duplicates);
+    loaded = s.load("B", "join_server_b.bin", FileFormat::Bin);
+    EXPECT_EQ(2u, loaded.loaded);
+
+    std::string out;
+    s.symmetric_difference(JoinRange())->print(out);
+    EXPECT_EQ("-3,minus_three,\n", out);
+    out.clear();
+    s.intersection(JoinRange())->print(out);
+    EXPECT_EQ("5,five,yz\n70000,big,x\n", out);
+
+    EXPECT_THROW(s.load("A", "join_server_bad.csv", FileFormat::Csv), std::runtime_error);
+    EXPECT_THROW(s.load("A", "join_server_space.csv", FileFormat::Csv), std::runtime_error);
+    EXPECT_THROW(s.load("A", "join_server_tab.csv", FileFormat::Csv), std::runtime_error);
+    EXPECT_THROW(s.load("A", "join_server_empty.bin", FileFormat::Bin), std::runtime_error);
+    EXPECT_THROW(s.load("A", "join_server_a.csv", FileFormat::Bin), std::runtime_error);
+    EXPECT_THROW(s.load("A", "../join_server_a.csv", FileFormat::Csv), std::invalid_argument);
+    EXPECT_THROW(s.load("A", "missing.csv", FileFormat::Csv), std::system_error);
+}
+
+TEST(Storage_Test, Export)
+{
+    const std::string dir = testing::TempDir();
+    auto read = [&dir](const std::string& name) {
+        std::ifstream in(dir + "/" + name, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>());
+    };
+
+    Storage s(dir);
+    for (int32_t id : { -7, 3, 70000 }) {
+        s.insert("A", id, "a" + std::to_string(id));
+    }
+    for (int32_t id : { 3, 5, 70000 }) {
+        s.insert("B", id, "b" + std::to_string(id));
+    }
+
+    EXPECT_EQ(2u, s.export_join(JoinKind::Intersection, "join_server_i.csv", FileFormat::Csv));
+    EXPECT_EQ("3,a3,b3\n70000,a70000,b70000\n", read("join_server_i.csv"));
+    EXPECT_EQ(2u, s.export_join(JoinKind::SymmetricDifference, "join_server_s.csv",
+                                FileFormat::Csv));
+    EXPECT_EQ("-7,a-7,\n5,,b5\n", read("join_server_s.csv"));
+    EXPECT_EQ(3u, s.export_table("A", "join_server_t.bin", FileFormat::Bin));
+
+    // A binary table loads back into the same rows.
+    Storage copy(dir);
+    EXPECT_EQ(3u, copy.load("B", "join_server_t.bin", FileFormat::Bin).loaded);
+    std::string out;
+    copy.symmetric_difference(JoinRange())->print(out);
+    EXPECT_EQ("-7,,a-7\n3,,a3\n70000,,a70000\n", out);
+
+    BasicStorage<std::string> strings(dir);
+    strings.insert("A", std::string("x"), "1");
+    strings.insert("B", std::string("x"), "2");
+    strings.insert("B", std::string("y"), "3");
+    EXPECT_EQ(1u, strings.export_join(JoinKind::Intersection, "join_server_x.csv",
+                                      FileFormat::Csv));
+    EXPECT_EQ("x,1,2\n", read("join_server_x.csv"));
+    EXPECT_EQ(2u, strings.export_table("B", "join_server_x.bin", FileFormat::Bin));
+    BasicStorage<std::string> loaded(dir);
+    EXPECT_EQ(2u, loaded.load("A", "join_server_x.bin", FileFormat::Bin).loaded);
+    out.clear();
+    loaded.symmetric_difference(JoinRange())->print(out);
+    EXPECT_EQ("x,2,\ny,3,\n", out);
+    // Joins of two name columns do not load as a table.
+    strings.export_join(JoinKind::Intersection, "join_server_j.bin", FileFormat::Bin);
+    EXPECT_THROW(loaded.load("B", "join_server_j.bin", FileFormat::Bin), std::runtime_error);
+
+    EXPECT_THROW(s.export_table("C", "join_server_t.csv", FileFormat::Csv),
+                 std::invalid_argument);
+    EXPECT_THROW(s.export_join(JoinKind::Intersection, "/tmp/x.csv", FileFormat::Csv),
+                 std::invalid_argument);
+}
+
+TEST(Replication, Log_And_Snapshot)
+{
+    MutationLog log(40);
+    Storage primary;
+    primary.set_log(&log);
+    EXPECT_EQ(0u, log.last_lsn());
+
+    int woken = 0;
+    EXPECT_TRUE(log.wait(0, [&woken]() { ++woken; }));
+    primary.insert("A", 1, "one");
+    primary.insert("A", 1, "again");
+    primary.insert("B", 70000, "far");
+    // A line end would split the entry, such names never reach the log.
+    EXPECT_FALSE(primary.insert("A", 2, "x\n2"));
+    EXPECT_THROW(primary.apply({ Write { 0, false, "3", "x\n3" } }), std::invalid_argument);
+    EXPECT_EQ(1, woken);
+    EXPECT_EQ(2u, log.last_lsn());
+    EXPECT_FALSE(log.wait(1, [&woken]() { ++woken; }));
+
+    uint64_t lsn = 0;
+    std::string out;
+    EXPECT_TRUE(log.read(lsn, out, 1000));
+    EXPECT_EQ("1 INSERT A 1 one\n2 INSERT B 70000 far\n", out);
+    EXPECT_EQ(2u, lsn);
+
+    // 40 bytes keep the two newest entries only.
+    primary.truncate("B");
+    primary.insert("A", -5, "minus");
+    lsn = 0;
+    EXPECT_FALSE(log.read(lsn, out, 1000));
+    lsn = 2;
+    out.clear();
+    EXPECT_TRUE(log.read(lsn, out, 1000));
+    EXPECT_EQ("3 TRUNCATE B\n4 INSERT A -5 minus\n", out);
+
+    // The snapshot rebuilds the tables of a replica whatever it had.
+    primary.insert("B", 1, "b");
+    uint64_t at = 0;
+    DumpUPtr dump = primary.dump(at);
+    primary.insert("B", 2, "after");
+    EXPECT_EQ(5u, at);
+    std::string lines;
+    for (std::string piece; dump->next(piece, 1); piece.clear()) {
+        lines += piece;
+    }
+    EXPECT_EQ("TRUNCATE A\nINSERT A -5 minus\nINSERT A 1 one\n"
+              "TRUNCATE B\nINSERT B 1 b\n", lines);
+
+    Storage replica;
+    replica.insert("A", 7, "stale");
+    Processor processor(ProcessorContext { replica, nullptr, nullptr });
+    std::istringstream in(lines);
+    std::string line;
+    while (std::getline(in, line)) {
+        processor.execute(line, [](std::string) {});
+    }
+    std::string a;
+    std::string b;
+    for (const Storage* s : { &primary, &replica }) {
+        std::string& out = s == &primary ? a : b;
+        s->intersection(JoinRange())->print(out);
+        s->symmetric_difference(JoinRange())->print(out);
+    }
+    EXPECT_EQ("1,one,b\n-5,minus,\n2,,after\n", a);
+    EXPECT_EQ("1,one,b\n-5,minus,\n", b);
+
+    BasicStorage<std::string> strings;
+    strings.insert("B", std::string("k"), "v");
+    EXPECT_FALSE(strings.insert("B", std::string("k\n"), "v"));
+    lines.clear();
+    for (auto d = strings.dump(at); d->next(lines, 1 << 20);) {
+    }
+    EXPECT_EQ(0u, at);
+    EXPECT_EQ("TRUNCATE A\nTRUNCATE B\nINSERT B k v\n", lines);
+}
+
+TEST(Replication, Read_Only)
+{
+    struct Role : IReplication
+    {
+        bool read_only() const override { return true; }
+        std::string status() const override { return "replica,streaming,3,5,2"; }
+    } role;
+
+    Storage storage;
+    Processor processor(ProcessorContext { storage, nullptr, nullptr, &role });
+    std::string reply;
+    auto execute = [&processor, &reply](const std::string& command) {
+        processor.execute(command, [&reply](std::string r) { reply = r; });
+        return reply;
+    };
+    EXPECT_EQ("ERR read-only replica", execute("INSERT A 0 lean"));
+    EXPECT_EQ("ERR read-only replica", execute("TRUNCATE A"));
+    EXPECT_EQ("ERR read-only replica", execute("LOAD A rows.csv"));
+    EXPECT_EQ("OK", execute("INTERSECTION"));
+    EXPECT_EQ("replica,streaming,3,5,2\nOK", execute("REPLICATION"));
+
+    Processor standalone(ProcessorContext { storage, nullptr, nullptr });
+    standalone.execute("REPLICATION", [&reply](std::string r) { reply = r; });
+    EXPECT_EQ("standalone\nOK", reply);
+}
+
+TEST(Replication, Loopback)
+{
+    MutationLog log(1 << 20);
+    Storage primary;
+    Storage replica;
+    asio::io_service io_service;
+    auto server = std::make_unique<ReplicationServer>(io_service, 0, primary, log);
+    const unsigned short port = server->port();
+    primary.insert("A", 1, "one");
+    primary.insert("B", 1, "b1");
+    primary.insert("B", 2, "b2");
+    replica.insert("A", 7, "stale");
+
+    ReplicaClient client(io_service, "127.0.0.1:" + std::to_string(port), replica);
+    std::thread io([&io_service]() { io_service.run(); });
+    auto replies = [](IReplication& role) {
+        Storage none;
+        Processor processor(ProcessorContext { none, nullptr, nullptr, &role });
+        std::string reply;
+        processor.execute("REPLICATION", [&reply](std::string r) { reply = r; });
+        return reply;
+    };
+    auto caught_up = [&](const std::string& status) {
+        for (int i = 0; i < 500 && replies(client) != status; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return replies(client);
+    };
+    auto rows = [](const Storage& s) {
+        std::string out;
+        s.intersection(JoinRange())->print(out);
+        s.symmetric_difference(JoinRange())->print(out);
+        return out;
+    };
+
+    // The rows before the replica came arrive in the snapshot, the later
+    // ones from the log.
+    EXPECT_EQ("replica,streaming,3,3,0\nOK", caught_up("replica,streaming,3,3,0\nOK"));
+    EXPECT_EQ(rows(primary), rows(replica));
+    primary.insert("A", 2, "two");
+    primary.truncate("B");
+    primary.insert("B", 2, "again");
+    EXPECT_EQ("replica,streaming,6,6,0\nOK", caught_up("replica,streaming,6,6,0\nOK"));
+    EXPECT_EQ("2,two,again\n1,one,\n", rows(replica));
+    EXPECT_EQ(rows(primary), rows(replica));
+    for (int i = 0; i < 500 && replies(*server).find(",6,0\n") == std::string::npos; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    const std::string status = replies(*server);
+    EXPECT_EQ(0u, status.find("primary,6,1\n127.0.0.1:"));
+    EXPECT_NE(std::string::npos, status.find(",6,0\nOK"));
+
+    // A new listener with the same log: the replica resumes after its lsn,
+    // a snapshot would have dropped its local row.
+    io_service.stop();
+    io.join();
+    server->stop();
+    io_service.reset();
+    io_service.poll();
+    server.reset();
+    replica.insert("A", 8, "local");
+    server = std::make_unique<ReplicationServer>(io_service, port, primary, log);
+    primary.insert("B", 1, "back");
+    io = std::thread([&io_service]() { io_service.run(); });
+    EXPECT_EQ("replica,streaming,7,7,0\nOK", caught_up("replica,streaming,7,7,0\nOK"));
+    EXPECT_EQ(rows(primary) + "8,local,\n", rows(replica));
+
+    client.stop();
+    server->stop();
+    io_service.stop();
+    io.join();
+}
+
+TEST(Subscription, Changes)
+{
+    Storage storage;
+    storage.insert("A", 1, "a1");
+    storage.insert("A", 2, "a2");
+
+    int notified = 0;
+    auto notify = [&notified]() { ++notified; };
+    SubscriptionPtr intersection = storage.subscribe(JoinKind::Intersection, 10, notify);
+    SubscriptionPtr difference = storage.subscribe(JoinKind::SymmetricDifference, 10, notify);
+
+    storage.insert("B", 1, "b1");
+    storage.insert("B", 3, "b3");
+    storage.insert("B", 3, "again");
+    EXPECT_EQ(2, notified);
+
+    std::string out;
+    EXPECT_TRUE(intersection->take(out, 1000));
+    EXPECT_EQ("+1,a1,b1\n", out);
+    out.clear();
+    EXPECT_TRUE(difference->take(out, 1000));
+    EXPECT_EQ("+1,a1,\n+2,a2,\n-1\n+3,,b3\n", out);
+
+    // 1 leaves the intersection, 2 leaves and 1 comes back to the
+    // symmetric difference with the name in B.
+    storage.truncate("A");
+    EXPECT_EQ(4, notified);
+    out.clear();
+    EXPECT_TRUE(intersection->take(out, 1000));
+    EXPECT_EQ("-1\n", out);
+    out.clear();
+    EXPECT_TRUE(difference->take(out, 1000));
+    EXPECT_EQ("+1,,b1\n-2\n", out);
+
+    // Released subscriptions are forgotten.
+    intersection.reset();
+    storage.insert("A", 3, "a3");
+    out.clear();
+    EXPECT_TRUE(difference->take(out, 1000));
+    EXPECT_EQ("-3\n", out);
+
+    // A subscriber that falls behind is dropped.
+    for (int id = 10; id < 21; ++id) {
+        storage.insert("A", id, "many");
+    }
+    out.clear();
+    EXPECT_FALSE(difference->take(out, 1000));
+    EXPECT_TRUE(out.empty());
+    storage.insert("A", 30, "late");
+    EXPECT_FALSE(difference->take(out, 1000));
+    // The string tables keep only the rows of B that the old rows meet.
+    BasicStorage<std::string> strings;
+    strings.insert("A", std::string("k1"), "a1");
+    strings.insert("A", std::string("k2"), "a2");
+    strings.insert("B", std::string("k1"), "b1");
+    strings.insert("B", std::string("k3"), "b3");
+    difference = strings.subscribe(JoinKind::SymmetricDifference, 10, notify);
+    SubscriptionPtr both = strings.subscribe(JoinKind::Intersection, 10, notify);
+    strings.truncate("A");
+    strings.insert("B", std::string("k2"), "b2");
+    out.clear();
+    EXPECT_TRUE(difference->take(out, 1000));
+    EXPECT_EQ("+k2,a2,\n+k3,,b3\n+k1,,b1\n-k2\n+k2,,b2\n", out);
+    out.clear();
+    EXPECT_TRUE(both->take(out, 1000));
+    EXPECT_EQ("+k1,a1,b1\n-k1\n", out);
+}
+
+TEST(Coordinator, Scatter_Gather)
+{
+    Storage low;
+    Storage high;
+    asio::io_service io_service;
+    Server low_server(io_service, 0, ProcessorContext { low, nullptr, nullptr });
+    Server high_server(io_service, 0, ProcessorContext { high, nullptr, nullptr });
+    std::thread shards([&io_service]() { io_service.run(); });
+
+    ShardedStorage s(KeyType::Int32,
+                     { parse_shard("127.0.0.1:" + std::to_string(low_server.port())),
+                       parse_shard("100@127.0.0.1:" + std::to_string(high_server.port())) });
+    for (int id : { 5, 50, 150, 250 }) {
+        EXPECT_TRUE(s.insert("A", std::to_string(id), "a" + std::to_string(id)));
+    }
+    for (int id : { 50, 150, 300 }) {
+        EXPECT_TRUE(s.insert("B", std::to_string(id), "b" + std::to_string(id)));
+    }
+    EXPECT_FALSE(s.insert("A", "150", "again"));
+    EXPECT_FALSE(s.insert("A", "x", "bad"));
+    // Each shard has the rows of its range only.
+    EXPECT_EQ(1u, low.symmetric_difference_count(JoinRange()));
+    EXPECT_EQ(2u, high.symmetric_difference_count(JoinRange()));
+
+    auto rows = [](result_table_t result) {
+        std::string out;
+        result->print(out);
+        return out;
+    };
+    EXPECT_EQ("50,a50,b50\n150,a150,b150\n", rows(s.intersection(JoinRange())));
+    EXPECT_EQ("5,a5,\n250,a250,\n300,,b300\n", rows(s.symmetric_difference(JoinRange())));
+
+    JoinRange range;
+    range.from = 40;
+    range.to = 200;
+    range.has_to = true;
+    EXPECT_EQ("50,a50,b50\n150,a150,b150\n", rows(s.intersection(range)));
+    range.from = 100;
+    EXPECT_EQ(1u, s.intersection_count(range));
+
+    // Descending slices cross the shards from the last one.
+    JoinRange desc;
+    desc.order = JoinOrder::Desc;
+    desc.offset = 1;
+    desc.limit = 2;
+    EXPECT_EQ("250,a250,\n5,a5,\n", rows(s.symmetric_difference(desc)));
+    desc.order = JoinOrder::Asc;
+    EXPECT_EQ("250,a250,\n300,,b300\n", rows(s.symmetric_difference(desc)));
+    EXPECT_EQ(2u, s.symmetric_difference_count(desc));
+    EXPECT_NEAR(3.0, s.symmetric_difference_estimate().value, 0.5);
+
+    std::string json;
+    s.symmetric_difference(JoinRange())->print_json(json, 0, 3, false);
+    EXPECT_EQ("{\"id\":5,\"a\":\"a5\",\"b\":null},"
+              "{\"id\":250,\"a\":\"a250\",\"b\":null},"
+              "{\"id\":300,\"a\":null,\"b\":\"b300\"}", json);
+
+    // Through the processor the writes wait on the shards like joins.
+    Processor processor(ProcessorContext { s, nullptr, nullptr });
+    std::string reply;
+    processor.execute("INSERT B 5 b5", [&reply](std::string r) { reply = r; });
+    EXPECT_EQ("OK", reply);
+    processor.execute("INSERT B 5 b5", [&reply](std::string r) { reply = r; });
+    EXPECT_EQ("ERR duplicate 5", reply);
+    processor.execute("LOAD A rows.csv", [&reply](std::string r) { reply = r; });
+    EXPECT_EQ("ERR LOAD the files on the shards", reply);
+    EXPECT_TRUE(s.truncate("A"));
+    EXPECT_EQ(0u, low.intersection_count(JoinRange()));
+    // The estimates wait on the shards too.
+    CommandUPtr estimate(CommandFactory::create("INTERSECTION", s));
+    EXPECT_TRUE(estimate->parse({ "ESTIMATE" }));
+    EXPECT_TRUE(estimate->heavy());
+    CommandUPtr local(CommandFactory::create("INTERSECTION", low));
+    EXPECT_TRUE(local->parse({ "ESTIMATE" }));
+    EXPECT_FALSE(local->heavy());
+
+    // A shard that accepts and never replies is given up on.
+    asio::ip::tcp::acceptor silent(io_service, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), 0));
+    Shard hung = parse_shard("127.0.0.1:" + std::to_string(silent.local_endpoint().port()));
+    ShardClient client(hung, std::chrono::milliseconds(50));
+    std::string out;
+    size_t n = 0;
+    EXPECT_THROW(client.call("INTERSECTION", out, n), std::runtime_error);
+
+    io_service.stop();
+    shards.join();
+    EXPECT_THROW(parse_shard("x@127.0.0.1:1"), std::invalid_argument);
+    EXPECT_THROW(ShardedStorage(KeyType::Int32, { parse_shard("5@127.0.0.1:1") }),
+                 std::invalid_argument);
+}
+
+TEST(Session, Pipelined_Replies)
+{
+    Storage storage;
+    storage.insert("A", 1, "a");
+    storage.insert("B", 1, "b");
+    ServerConfig config;
+    config.output_high_water = 256;
+    config.cork = true;
+    asio::io_service io_service;
+    Server server(io_service, 0, ProcessorContext { storage, nullptr, nullptr }, config);
+    std::thread io([&io_service]() { io_service.run(); });
+
+    // The replies pile up past the high water before the client reads any.
+    asio::ip::tcp::socket client(io_service);
+    client.connect(asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), server.port()));
+    std::string commands;
+    for (int i = 0; i < 500; ++i) {
+        commands += "INTERSECTION\n";
+    }
+    asio::write(client, asio::buffer(commands));
+
+    std::string replies;
+    const std::string reply = "1,a,b\nOK\n";
+    std::array<char, 4096> buffer;
+    while (replies.size() < 500 * reply.size()) {
+        replies.append(buffer.data(), client.read_some(asio::buffer(buffer)));
+    }
+    std::string expected;
+    for (int i = 0; i < 500; ++i) {
+        expected += reply;
+    }
+    EXPECT_EQ(expected, replies);
+
+    client.close();
+    io_service.stop();
+    io.join();
+}
+
+#ifdef JOIN_SERVER_HAS_IO_URING
+TEST(Session, Uring_Bounded_Input)
+{
+    Storage storage;
+    std::string reply;
+    for (int i = 0; i < 30; ++i) {
+        storage.insert("A", i, "a");
+        storage.insert("B", i, "b");
+        reply += std::to_string(i) + ",a,b\n";
+    }
+    reply += "OK\n";
+    ServerConfig config;
+    config.output_high_water = 256;
+    std::unique_ptr<UringServer> server;
+    try {
+        server = std::make_unique<UringServer>(0, ProcessorContext { storage, nullptr, nullptr },
+                                               config);
+    }
+    catch (const UringUnavailable&) {
+        // Nothing to test on a kernel without io_uring.
+        return;
+    }
+    std::thread loop([&server]() { server->run(); });
+
+    asio::io_service io_service;
+    asio::ip::tcp::socket client(io_service);
+    client.open(asio::ip::tcp::v4());
+    client.set_option(asio::socket_base::receive_buffer_size(4096));
+    client.set_option(asio::socket_base::send_buffer_size(4096));
+    client.connect(asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), server->port()));
+    std::array<char, 65536> buffer;
+    auto read = [&](size_t size) {
+        std::string replies;
+        while (replies.size() < size) {
+            replies.append(buffer.data(), client.read_some(asio::buffer(buffer)));
+        }
+        return replies;
+    };
+
+    // An overlong line gets an error and the next line runs.
+    asio::write(client, asio::buffer(std::string(9000, 'x') + "\nINTERSECTION\n"));
+    const std::string error = "ERR line longer than 8192 bytes\n";
+    EXPECT_EQ(error + reply, read(error.size() + reply.size()));
+
+    // A client that does not read stops being read, the kernel buffers
+    // fill up and its writes would block.
+    client.non_blocking(true);
+    const std::string command = "INTERSECTION\n";
+    std::string commands;
+    for (int i = 0; i < 1024; ++i) {
+        commands += command;
+    }
+    size_t written = 0;
+    int blocked = 0;
+    while (blocked < 20 && written < (4u << 20)) {
+        const size_t at = written % commands.size();
+        asio::error_code ec;
+        const size_t n = client.write_some(asio::buffer(commands.data() + at,
+                                                        commands.size() - at), ec);
+        if (ec == asio::error::would_block) {
+            ++blocked;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        else if (ec) {
+            ADD_FAILURE() << ec.message();
+            break;
+        }
+        else {
+            written += n;
+            blocked = 0;
+        }
+    }
+    EXPECT_EQ(20, blocked);
+
+    // Reading the replies resumes the input, every command is answered.
+    client.non_blocking(false);
+    const size_t replies = written / command.size();
+    size_t received = 0;
+    bool same = true;
+    while (received < replies * reply.size()) {
+        const size_t n = client.read_some(asio::buffer(buffer));
+        for (size_t i = 0; i < n; ++i) {
+            same = same && buffer[i] == reply[(received + i) % reply.size()];
+        }
+        received += n;
+    }
+    EXPECT_TRUE(same);
+    EXPECT_EQ(replies * reply.size(), received);
+    // The last write may have ended inside a command.
+    if (written % command.size()) {
+        asio::write(client, asio::buffer(command.substr(written % command.size())));
+        EXPECT_EQ(reply, read(reply.size()));
+    }
+
+    client.close();
+    server->stop();
+    loop.join();
 }
+#endif
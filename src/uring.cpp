@@ -0,0 +1,268 @@
+#include "uring.h"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+int sys_io_uring_setup(unsigned entries, io_uring_params* p)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+}
+
+int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit,
+                                      min_complete, flags, nullptr, 0));
+}
+
+int sys_io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode,
+                                      arg, nr_args));
+}
+
+void* map_ring(int fd, size_t size, uint64_t offset)
+{
+    void* p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, static_cast<off_t>(offset));
+    if (p == MAP_FAILED) {
+        throw std::system_error(errno, std::system_category(), "io_uring mmap");
+    }
+    return p;
+}
+
+template <typename T>
+T* at(void* base, unsigned offset)
+{
+    return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+}
+
+} // namespace
+
+Uring::Uring(unsigned entries)
+{
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    fd_ = sys_io_uring_setup(entries, &p);
+    if (fd_ < 0) {
+        throw std::system_error(errno, std::system_category(), "io_uring_setup");
+    }
+
+    try {
+        sq_ring_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = map_ring(fd_, sq_ring_size_, IORING_OFF_SQ_RING);
+        cq_ring_ = (p.features & IORING_FEAT_SINGLE_MMAP)
+                   ? sq_ring_
+                   : map_ring(fd_, cq_ring_size_, IORING_OFF_CQ_RING);
+        sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = static_cast<io_uring_sqe*>(map_ring(fd_, sqes_size_, IORING_OFF_SQES));
+    }
+    catch (...) {
+        release();
+        throw;
+    }
+
+    sq_head_ = at<unsigned>(sq_ring_, p.sq_off.head);
+    sq_tail_ = at<unsigned>(sq_ring_, p.sq_off.tail);
+    sq_mask_ = *at<unsigned>(sq_ring_, p.sq_off.ring_mask);
+    sq_entries_ = *at<unsigned>(sq_ring_, p.sq_off.ring_entries);
+    sqe_tail_ = *sq_tail_;
+
+    // Slot i always holds entry i, the array never changes afterwards.
+    unsigned* array = at<unsigned>(sq_ring_, p.sq_off.array);
+    for (unsigned i = 0; i < sq_entries_; ++i) {
+        array[i] = i;
+    }
+
+    cq_head_ = at<unsigned>(cq_ring_, p.cq_off.head);
+    cq_tail_ = at<unsigned>(cq_ring_, p.cq_off.tail);
+    cq_mask_ = *at<unsigned>(cq_ring_, p.cq_off.ring_mask);
+    cqes_ = at<io_uring_cqe>(cq_ring_, p.cq_off.cqes);
+}
+
+Uring::~Uring()
+{
+    release();
+}
+
+void Uring::release()
+{
+    if (sqes_) {
+        ::munmap(sqes_, sqes_size_);
+    }
+    if (cq_ring_ && cq_ring_ != sq_ring_) {
+        ::munmap(cq_ring_, cq_ring_size_);
+    }
+    if (sq_ring_) {
+        ::munmap(sq_ring_, sq_ring_size_);
+    }
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+io_uring_sqe* Uring::get_sqe()
+{
+    if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+        submit_and_wait(0);
+        if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            return nullptr;
+        }
+    }
+    io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+    ++sqe_tail_;
+    std::memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+int Uring::submit_and_wait(unsigned wait_nr)
+{
+    const unsigned to_submit = sqe_tail_ - *sq_tail_;
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    int rc;
+    do {
+        rc = sys_io_uring_enter(fd_, to_submit, wait_nr,
+                                wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while (rc < 0 && errno == EINTR && wait_nr);
+    return rc < 0 ? -errno : rc;
+}
+
+bool Uring::supports(unsigned opcode) const
+{
+    const size_t n_ops = 256;
+    std::vector<char> memory(sizeof(io_uring_probe) + n_ops * sizeof(io_uring_probe_op));
+    auto probe = reinterpret_cast<io_uring_probe*>(memory.data());
+    if (sys_io_uring_register(fd_, IORING_REGISTER_PROBE, probe, n_ops) < 0) {
+        return false;
+    }
+    return opcode <= probe->last_op
+           && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+}
+
+ProvidedBuffers::ProvidedBuffers(Uring& ring, uint16_t group, unsigned count,
+                                 unsigned size, uint64_t user_data)
+    : ring_(ring)
+    , group_(group)
+    , size_(size)
+    , user_data_(user_data)
+    , buffers_(new char[size_t(count) * size])
+{
+    recycled_.reserve(count);
+    provide(0, count);
+    ring_.submit_and_wait(1);
+
+    int rc = 0;
+    ring_.for_each_cqe([&rc](const io_uring_cqe& cqe) { rc = cqe.res; });
+    if (rc < 0) {
+        throw std::system_error(-rc, std::system_category(), "provide buffers");
+    }
+}
+
+void ProvidedBuffers::publish()
+{
+    if (recycled_.empty()) {
+        return;
+    }
+
+    std::sort(recycled_.begin(), recycled_.end());
+    uint16_t first = recycled_.front();
+    unsigned count = 1;
+    for (size_t i = 1; i < recycled_.size(); ++i) {
+        if (recycled_[i] == first + count) {
+            ++count;
+        }
+        else {
+            provide(first, count);
+            first = recycled_[i];
+            count = 1;
+        }
+    }
+    provide(first, count);
+    recycled_.clear();
+}
+
+void ProvidedBuffers::provide(uint16_t first, unsigned count)
+{
+    io_uring_sqe* sqe = ring_.get_sqe();
+    if (!sqe) {
+        throw std::system_error(EBUSY, std::system_category(), "io_uring sq full");
+    }
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = static_cast<int>(count);
+    sqe->addr = reinterpret_cast<uint64_t>(data(first));
+    sqe->len = size_;
+    sqe->off = first;
+    sqe->buf_group = group_;
+    sqe->user_data = user_data_;
+}
+
+void prep_multishot_accept(io_uring_sqe* sqe, int fd, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = user_data;
+}
+
+void prep_recv_select(io_uring_sqe* sqe, int fd, uint16_t group, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->user_data = user_data;
+}
+
+void prep_send(io_uring_sqe* sqe, int fd, const void* data, size_t size,
+               uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(size);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data;
+}
+
+void prep_read(io_uring_sqe* sqe, int fd, void* data, size_t size, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = static_cast<uint32_t>(size);
+    sqe->user_data = user_data;
+}
+
+void prep_timeout(io_uring_sqe* sqe, __kernel_timespec* ts, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = reinterpret_cast<uint64_t>(ts);
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+void prep_cancel(io_uring_sqe* sqe, uint64_t target, uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
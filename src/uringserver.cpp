@@ -0,0 +1,518 @@
+#include "uringserver.h"
+#include "logger.h"
+#include "processor.h"
+#include "resultprinter.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <system_error>
+#include <vector>
+
+namespace {
+
+int listen_on(unsigned short port)
+{
+    int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::system_category(), "socket");
+    }
+
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0
+        || ::listen(fd, SOMAXCONN) < 0) {
+        const int error = errno;
+        ::close(fd);
+        throw std::system_error(error, std::system_category(), "bind");
+    }
+    return fd;
+}
+
+bool kernel_at_least(int major, int minor)
+{
+    utsname name;
+    if (::uname(&name) < 0) {
+        return false;
+    }
+    int kernel_major = 0;
+    int kernel_minor = 0;
+    std::sscanf(name.release, "%d.%d", &kernel_major, &kernel_minor);
+    return kernel_major > major || (kernel_major == major && kernel_minor >= minor);
+}
+
+} // namespace
+
+UringServer::UringServer(unsigned short port, const ProcessorContext& context,
+                         const ServerConfig& config)
+    : context_(context)
+    , config_(config)
+{
+    try {
+        ring_ = std::make_unique<Uring>(queue_depth);
+        for (auto op : { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                         IORING_OP_READ, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+                         IORING_OP_PROVIDE_BUFFERS }) {
+            if (!ring_->supports(op)) {
+                throw std::system_error(ENOSYS, std::system_category(),
+                                        "io_uring opcode " + std::to_string(op));
+            }
+        }
+        if (!kernel_at_least(5, 19)) {
+            throw std::system_error(ENOSYS, std::system_category(),
+                                    "multishot accept needs linux 5.19");
+        }
+        buffers_ = std::make_unique<ProvidedBuffers>(*ring_, 0, buffer_count,
+                                                     buffer_size, tag(Op::Provide, 0));
+    }
+    catch (const std::system_error& e) {
+        throw UringUnavailable(e.what());
+    }
+
+    listen_fd_ = listen_on(port);
+    wake_fd_ = ::eventfd(0, EFD_CLOEXEC);
+    if (wake_fd_ < 0) {
+        ::close(listen_fd_);
+        throw std::system_error(errno, std::system_category(), "eventfd");
+    }
+    tick_.tv_sec = 1;
+}
+
+UringServer::~UringServer()
+{
+    for (auto& c : connections_) {
+        ::close(c.first);
+    }
+    ::close(listen_fd_);
+    ::close(wake_fd_);
+}
+
+uint64_t UringServer::tag(Op op, int fd)
+{
+    return (uint64_t(op) << 56) | uint32_t(fd);
+}
+
+io_uring_sqe* UringServer::sqe()
+{
+    io_uring_sqe* entry = ring_->get_sqe();
+    if (!entry) {
+        // get_sqe() already flushed the queue, the kernel is overloaded.
+        throw std::system_error(EBUSY, std::system_category(), "io_uring sq full");
+    }
+    return entry;
+}
+
+void UringServer::run()
+{
+    arm_accept();
+    arm_wake();
+    arm_tick();
+
+    while (!stopped_) {
+        const int rc = ring_->submit_and_wait(1);
+        if (rc < 0 && rc != -EINTR && rc != -EBUSY && rc != -EAGAIN) {
+            throw std::system_error(-rc, std::system_category(), "io_uring_enter");
+        }
+        ring_->for_each_cqe([this](const io_uring_cqe& cqe) { dispatch(cqe); });
+        buffers_->publish();
+
+        if (draining_ && !accept_armed_ && connections_.empty()) {
+            LOG_DEBUG("uring: drained");
+            stopped_ = true;
+            if (on_drained_) {
+                on_drained_();
+            }
+        }
+    }
+}
+
+void UringServer::drain(std::function<void()> on_drained)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        request_ = Request::Drain;
+        on_drained_ = std::move(on_drained);
+    }
+    wake();
+}
+
+void UringServer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        request_ = Request::Stop;
+    }
+    wake();
+}
+
+unsigned short UringServer::port() const
+{
+    sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+    if (::getsockname(listen_fd_, reinterpret_cast<sockaddr*>(&addr), &size) < 0) {
+        throw std::system_error(errno, std::system_category(), "getsockname");
+    }
+    return ntohs(addr.sin_port);
+}
+
+void UringServer::post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        posted_.push_back(std::move(task));
+    }
+    wake();
+}
+
+void UringServer::wake()
+{
+    const uint64_t one = 1;
+    if (::write(wake_fd_, &one, sizeof(one)) < 0) {
+        gLogger->error("uring: wake up failed: {}", std::strerror(errno));
+    }
+}
+
+void UringServer::dispatch(const io_uring_cqe& cqe)
+{
+    const auto op = static_cast<Op>(cqe.user_data >> 56);
+    const int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+
+    switch (op) {
+    case Op::Accept:
+        on_accept(cqe);
+        break;
+    case Op::Recv:
+    case Op::Send: {
+        auto found = connections_.find(fd);
+        if (found == connections_.end()) {
+            break;
+        }
+        if (op == Op::Recv) {
+            on_recv(*found->second, cqe);
+        }
+        else {
+            on_send(*found->second, cqe);
+        }
+        break;
+    }
+    case Op::Wake:
+        on_wake();
+        break;
+    case Op::Tick:
+        on_tick();
+        break;
+    case Op::Cancel:
+        break;
+    case Op::Provide:
+        if (cqe.res < 0) {
+            gLogger->error("uring: provide buffers failed: {}", std::strerror(-cqe.res));
+        }
+        break;
+    }
+}
+
+void UringServer::arm_accept()
+{
+    prep_multishot_accept(sqe(), listen_fd_, tag(Op::Accept, listen_fd_));
+    accept_armed_ = true;
+}
+
+void UringServer::arm_recv(Connection& c)
+{
+    prep_recv_select(sqe(), c.fd, buffers_->group(), tag(Op::Recv, c.fd));
+    c.receiving = true;
+}
+
+void UringServer::arm_wake()
+{
+    prep_read(sqe(), wake_fd_, &wake_value_, sizeof(wake_value_), tag(Op::Wake, wake_fd_));
+}
+
+void UringServer::arm_tick()
+{
+    prep_timeout(sqe(), &tick_, tag(Op::Tick, 0));
+}
+
+void UringServer::on_accept(const io_uring_cqe& cqe)
+{
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        accept_armed_ = false;
+        if (!draining_) {
+            arm_accept();
+        }
+    }
+
+    if (cqe.res < 0) {
+        if (cqe.res != -ECANCELED) {
+            LOG_DEBUG("uring: accept failed: {}", std::strerror(-cqe.res));
+        }
+        return;
+    }
+
+    const int fd = cqe.res;
+    if (draining_) {
+        ::close(fd);
+        return;
+    }
+    if (connections_.size() >= config_.max_connections) {
+        LOG_DEBUG("connection limit {} reached", config_.max_connections);
+        const std::string message = "ERR too many connections\n";
+        ::send(fd, message.data(), message.size(), MSG_NOSIGNAL);
+        ::close(fd);
+        return;
+    }
+
+    LOG_DEBUG("uring: accepted fd = {}", fd);
+    auto c = std::make_shared<Connection>();
+    c->fd = fd;
+    c->processor = std::make_unique<Processor>(context_, [this](std::function<void()> task)
+    {
+        post(std::move(task));
+    });
+    c->last_activity = std::chrono::steady_clock::now();
+    arm_recv(*c);
+    connections_.emplace(fd, std::move(c));
+}
+
+void UringServer::on_recv(Connection& c, const io_uring_cqe& cqe)
+{
+    c.receiving = false;
+
+    if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+        const auto id = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        c.last_activity = std::chrono::steady_clock::now();
+        if (!c.closing) {
+            consume(c, buffers_->data(id), static_cast<size_t>(cqe.res));
+        }
+        buffers_->recycle(id);
+    }
+    else if (cqe.res != -ENOBUFS) {
+        // End of stream or an error.
+        close(c);
+        return;
+    }
+
+    if (c.closing) {
+        release_if_idle(c);
+    }
+    else if (draining_ && c.output.empty() && !c.busy) {
+        close(c);
+    }
+    else if (!c.busy && !c.output_full) {
+        arm_recv(c);
+    }
+}
+
+void UringServer::consume(Connection& c, const char* data, size_t size)
+{
+    c.input.append(data, size);
+    process_input(c);
+}
+
+void UringServer::process_input(Connection& c)
+{
+    size_t begin = 0;
+    while (!c.busy) {
+        if (c.queued >= config_.output_high_water) {
+            // A client that does not read its replies is not read either,
+            // the sends resume it.
+            c.output_full = true;
+            break;
+        }
+        const size_t eol = c.input.find('\n', begin);
+        if (c.skipping) {
+            begin = eol == std::string::npos ? c.input.size() : eol + 1;
+            c.skipping = eol == std::string::npos;
+            if (c.skipping) {
+                break;
+            }
+            continue;
+        }
+        if ((eol == std::string::npos ? c.input.size() : eol) - begin > max_line) {
+            const std::string error = "line longer than " + std::to_string(max_line) + " bytes";
+            LOG_DEBUG("uring fd = {} bad command: {}", c.fd, error);
+            deliver(c, ErrorPrinter(error).print() + "\n");
+            c.skipping = true;
+            continue;
+        }
+        if (eol == std::string::npos) {
+            break;
+        }
+        if (eol == begin) {
+            ++begin;
+            continue;
+        }
+
+        const std::string command = c.input.substr(begin, eol - begin);
+        begin = eol + 1;
+        LOG_DEBUG("  received command: {}", command);
+        LOG_SAMPLED("uring fd = {} command: {}", c.fd, command);
+
+        // Replies inline for the light commands, through post() when
+        // a heavy one finishes.
+        auto conn = connections_.at(c.fd);
+        c.busy = true;
+        c.executing = true;
+        c.processor->execute(command, [this, conn](std::string reply)
+        {
+            conn->busy = false;
+            if (conn->closing) {
+                return;
+            }
+            reply.append("\n");
+            deliver(*conn, std::move(reply));
+            if (!conn->executing) {
+                resume(*conn);
+            }
+        });
+        c.executing = false;
+    }
+    c.input.erase(0, begin);
+}
+
+void UringServer::resume(Connection& c)
+{
+    process_input(c);
+    if (!c.closing && !c.receiving && !c.busy && !c.output_full) {
+        arm_recv(c);
+    }
+}
+
+void UringServer::deliver(Connection& c, std::string reply)
+{
+    c.queued += reply.size();
+    c.output.push_back(std::move(reply));
+    if (!c.sending) {
+        start_send(c);
+    }
+}
+
+void UringServer::start_send(Connection& c)
+{
+    const std::string& front = c.output.front();
+    prep_send(sqe(), c.fd, front.data() + c.sent, front.size() - c.sent,
+              tag(Op::Send, c.fd));
+    c.sending = true;
+}
+
+void UringServer::on_send(Connection& c, const io_uring_cqe& cqe)
+{
+    c.sending = false;
+    if (cqe.res < 0) {
+        close(c);
+        return;
+    }
+
+    c.sent += static_cast<size_t>(cqe.res);
+    c.queued -= static_cast<size_t>(cqe.res);
+    if (c.sent == c.output.front().size()) {
+        c.output.pop_front();
+        c.sent = 0;
+    }
+
+    if (c.closing) {
+        release_if_idle(c);
+        return;
+    }
+    if (!c.output.empty()) {
+        start_send(c);
+    }
+    else if (draining_ && !c.busy) {
+        close(c);
+        return;
+    }
+    if (c.output_full && c.queued <= config_.output_high_water / 2) {
+        c.output_full = false;
+        resume(c);
+    }
+}
+
+void UringServer::on_wake()
+{
+    Request request;
+    std::vector<std::function<void()>> posted;
+    {
+        std::lock_guard<std::mutex> lock(m_);
+        request = request_;
+        request_ = Request::None;
+        posted.swap(posted_);
+    }
+
+    if (request == Request::Stop) {
+        LOG_DEBUG("uring: stop");
+        stopped_ = true;
+        return;
+    }
+
+    if (request == Request::Drain && !draining_) {
+        LOG_DEBUG("uring: draining {} connections", connections_.size());
+        draining_ = true;
+        if (accept_armed_) {
+            prep_cancel(sqe(), tag(Op::Accept, listen_fd_), tag(Op::Cancel, 0));
+        }
+        std::vector<Connection*> idle;
+        for (auto& c : connections_) {
+            if (c.second->output.empty() && !c.second->busy) {
+                idle.push_back(c.second.get());
+            }
+        }
+        for (auto c : idle) {
+            close(*c);
+        }
+    }
+
+    for (auto& task : posted) {
+        task();
+    }
+    arm_wake();
+}
+
+void UringServer::on_tick()
+{
+    const auto now = std::chrono::steady_clock::now();
+    std::vector<Connection*> expired;
+    for (auto& entry : connections_) {
+        Connection& c = *entry.second;
+        const auto timeout = c.input.empty() ? config_.idle_timeout
+                                             : config_.read_timeout;
+        if (!c.closing && !c.busy && now - c.last_activity > timeout) {
+            expired.push_back(&c);
+        }
+    }
+    for (auto c : expired) {
+        LOG_DEBUG("uring: timeout fd = {}", c->fd);
+        close(*c);
+    }
+    arm_tick();
+}
+
+void UringServer::close(Connection& c)
+{
+    if (!c.closing) {
+        c.closing = true;
+        // Completes the outstanding receive.
+        ::shutdown(c.fd, SHUT_RDWR);
+    }
+    release_if_idle(c);
+}
+
+void UringServer::release_if_idle(Connection& c)
+{
+    if (c.receiving || c.sending) {
+        return;
+    }
+    const int fd = c.fd;
+    ::close(fd);
+    connections_.erase(fd);
+}